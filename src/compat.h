@@ -17,6 +17,26 @@
 typedef enum { B_FALSE, B_TRUE } boolean_t;
 #endif
 
+#ifndef __sun
+#include <time.h>
+
+typedef long long hrtime_t;
+
+#define	MICROSEC	1000000
+#define	NANOSEC		1000000000LL
+
+static inline hrtime_t
+gethrtime(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((hrtime_t)ts.tv_sec * NANOSEC + ts.tv_nsec);
+}
+#else
+#include <sys/time.h>
+#endif
+
 #ifndef __sun
 //#define GETOPT_RESET()	(optreset = 1)
 #define	GETOPT_RESET()	
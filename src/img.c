@@ -6,16 +6,34 @@
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "img.h"
+#include "probes.h"
+
+#define	MIN(x, y)	((x) < (y) ? (x) : (y))
+#define	MAX(x, y)	((x) > (y) ? (x) : (y))
 
-static img_t *img_read_ppm(FILE *, const char *);
-static img_t *img_read_png(FILE *, const char *);
+static img_t *img_read_ppm(FILE *, const char *, img_t **);
+static void img_bound(img_t *);
+static img_t *img_map_ppm(FILE *, const char *, size_t);
+static int img_write_ppm_map(img_t *, int, const char *);
+static img_t *img_read_png(FILE *, const char *, img_t **);
+static int img_write_png_level(img_t *, FILE *, int);
+static int img_write_level(img_t *, const char *, int);
+static int img_write_file(img_t *, const char *, int);
 
 extern int kv_debug;
 
@@ -33,21 +51,171 @@ stdio_error(FILE *fp)
 	return (strerror(err));
 }
 
+/*
+ * Return a view of the rectangle of "src" with its upper-left corner at (x, y)
+ * (in src's coordinates) and the given dimensions.  The view shares src's
+ * pixels and uses the same coordinates: pixel (x, y) of the view is pixel (x, y)
+ * of src.  Freeing the view doesn't affect src, but the view must not be used
+ * after src is freed.
+ */
 img_t *
-img_alloc(unsigned int width, unsigned int height)
+img_view(img_t *src, unsigned int x, unsigned int y, unsigned int width,
+    unsigned int height)
 {
 	img_t *rv;
 
-	rv = calloc(1, sizeof (*rv));
-	if (rv == NULL)
+	assert(x >= src->img_x0 && x + width <= src->img_x0 + src->img_width);
+	assert(y >= src->img_y0 && y + height <= src->img_y0 + src->img_height);
+
+	if (img_materialize(src) != 0)
 		return (NULL);
 
-	rv->img_pixels = calloc(sizeof (rv->img_pixels[0]), width * height);
-	if (rv->img_pixels == NULL) {
-		free(rv);
+	if ((rv = calloc(1, sizeof (*rv))) == NULL)
 		return (NULL);
+
+	rv->img_pixels = img_pixel(src, x, y);
+	rv->img_stride = src->img_stride;
+	rv->img_isview = B_TRUE;
+	rv->img_x0 = x;
+	rv->img_y0 = y;
+	rv->img_width = width;
+	rv->img_height = height;
+	rv->img_minx = MAX(src->img_minx, x);
+	rv->img_maxx = MIN(src->img_maxx, x + width);
+	rv->img_miny = MAX(src->img_miny, y);
+	rv->img_maxy = MIN(src->img_maxy, y + height);
+	return (rv);
+}
+
+/*
+ * Return a view of one field of an interlaced image: every other row of "src",
+ * starting with row "field" (0 or 1).  Unlike img_view(), the field has its own
+ * coordinates, with row y of the field being row (2 * y + field) of src.
+ */
+img_t *
+img_field(img_t *src, unsigned int field)
+{
+	img_t *rv;
+
+	assert(field < 2);
+
+	if (img_materialize(src) != 0)
+		return (NULL);
+
+	if ((rv = calloc(1, sizeof (*rv))) == NULL)
+		return (NULL);
+
+	rv->img_pixels = img_pixel(src, src->img_x0, src->img_y0 + field);
+	rv->img_stride = src->img_stride * 2;
+	rv->img_isview = B_TRUE;
+	rv->img_width = src->img_width;
+	rv->img_height = (src->img_height - field + 1) / 2;
+	rv->img_minx = src->img_minx - src->img_x0;
+	rv->img_maxx = src->img_maxx - src->img_x0;
+	rv->img_miny = (src->img_miny - src->img_y0 + 1 - field) / 2;
+	rv->img_maxy = (src->img_maxy - src->img_y0 + 1 - field) / 2;
+	return (rv);
+}
+
+/*
+ * Images are allocated from a pool of recycled images, keyed by geometry, so
+ * that steady-state frame processing doesn't touch the heap: img_free() hands
+ * ordinary images back to the pool (up to IMG_POOL_DEPTH images of each of
+ * IMG_POOL_NGEOMS sizes, and IMG_POOL_MAXBYTES in all) rather than freeing
+ * them.  Buffers at least as big as a huge page are aligned to one and (where
+ * supported) backed by huge pages.
+ */
+#define	IMG_POOL_NGEOMS		8
+#define	IMG_POOL_DEPTH		32
+#define	IMG_POOL_MAXBYTES	(64 * 1024 * 1024)
+#define	IMG_HUGEPAGE		(2 * 1024 * 1024)
+
+typedef struct img_poolgeom {
+	unsigned int	ipg_width;
+	unsigned int	ipg_height;
+	int		ipg_nfree;
+	img_t		*ipg_free[IMG_POOL_DEPTH];
+} img_poolgeom_t;
+
+static pthread_mutex_t img_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+	img_poolgeom_t	ipl_geoms[IMG_POOL_NGEOMS];
+	size_t		ipl_pooled;	/* bytes of free images in the pool */
+	size_t		ipl_bytes;	/* bytes of all image buffers */
+	size_t		ipl_peakbytes;
+	unsigned long	ipl_nhits;	/* allocations satisfied by the pool */
+	unsigned long	ipl_nmisses;	/* allocations from the heap */
+	unsigned long	ipl_nrecycled;	/* images returned to the pool */
+	unsigned long	ipl_nfreed;	/* images returned to the heap */
+} img_pool;
+
+static size_t
+img_stride(unsigned int width)
+{
+	return ((width * sizeof (img_pixel_t) + IMG_ALIGN - 1) &
+	    ~(size_t)(IMG_ALIGN - 1));
+}
+
+/*
+ * Allocate an image whose pixels are not initialized.  Each row starts on an
+ * IMG_ALIGN-byte boundary, so rows may be padded at the end.
+ */
+img_t *
+img_alloc_uninit(unsigned int width, unsigned int height)
+{
+	img_t *rv = NULL;
+	img_poolgeom_t *ipg;
+	void *pixels;
+	size_t stride, size, align;
+	int i;
+
+	stride = img_stride(width);
+	size = stride * height;
+
+	(void) pthread_mutex_lock(&img_pool_lock);
+	for (i = 0; i < IMG_POOL_NGEOMS; i++) {
+		ipg = &img_pool.ipl_geoms[i];
+		if (ipg->ipg_nfree > 0 && ipg->ipg_width == width &&
+		    ipg->ipg_height == height) {
+			rv = ipg->ipg_free[--ipg->ipg_nfree];
+			img_pool.ipl_pooled -= size;
+			img_pool.ipl_nhits++;
+			break;
+		}
 	}
 
+	if (rv == NULL)
+		img_pool.ipl_nmisses++;
+	(void) pthread_mutex_unlock(&img_pool_lock);
+
+	if (rv != NULL) {
+		pixels = rv->img_pixels;
+		bzero(rv, sizeof (*rv));
+	} else {
+		if ((rv = malloc(sizeof (*rv))) == NULL)
+			return (NULL);
+
+		align = size >= IMG_HUGEPAGE ? IMG_HUGEPAGE : IMG_ALIGN;
+		if (posix_memalign(&pixels, align, size) != 0) {
+			free(rv);
+			return (NULL);
+		}
+
+#ifdef MADV_HUGEPAGE
+		if (align == IMG_HUGEPAGE)
+			(void) madvise(pixels, size, MADV_HUGEPAGE);
+#endif
+
+		bzero(rv, sizeof (*rv));
+		(void) pthread_mutex_lock(&img_pool_lock);
+		img_pool.ipl_bytes += size;
+		img_pool.ipl_peakbytes = MAX(img_pool.ipl_peakbytes,
+		    img_pool.ipl_bytes);
+		(void) pthread_mutex_unlock(&img_pool_lock);
+	}
+
+	rv->img_pixels = pixels;
+	rv->img_stride = stride;
 	rv->img_width = width;
 	rv->img_height = height;
 	rv->img_maxx = 0;
@@ -58,67 +226,320 @@ img_alloc(unsigned int width, unsigned int height)
 	return (rv);
 }
 
+/*
+ * Allocate a zero-filled image.
+ */
+img_t *
+img_alloc(unsigned int width, unsigned int height)
+{
+	img_t *rv;
+
+	if ((rv = img_alloc_uninit(width, height)) != NULL)
+		bzero(rv->img_pixels, rv->img_stride * height);
+
+	return (rv);
+}
+
+/*
+ * Return an image allocated by img_alloc() to the pool if there's room for it.
+ */
+static void
+img_pool_put(img_t *imgp)
+{
+	img_poolgeom_t *ipg, *empty = NULL;
+	size_t size;
+	int i;
+
+	size = imgp->img_stride * imgp->img_height;
+
+	(void) pthread_mutex_lock(&img_pool_lock);
+	for (i = 0; i < IMG_POOL_NGEOMS; i++) {
+		ipg = &img_pool.ipl_geoms[i];
+		if (ipg->ipg_width == imgp->img_width &&
+		    ipg->ipg_height == imgp->img_height)
+			break;
+
+		if (empty == NULL && ipg->ipg_nfree == 0)
+			empty = ipg;
+	}
+
+	if (i == IMG_POOL_NGEOMS && (ipg = empty) != NULL) {
+		ipg->ipg_width = imgp->img_width;
+		ipg->ipg_height = imgp->img_height;
+	}
+
+	if (ipg != NULL && ipg->ipg_nfree < IMG_POOL_DEPTH &&
+	    img_pool.ipl_pooled + size <= IMG_POOL_MAXBYTES) {
+		ipg->ipg_free[ipg->ipg_nfree++] = imgp;
+		img_pool.ipl_pooled += size;
+		img_pool.ipl_nrecycled++;
+		imgp = NULL;
+	} else {
+		img_pool.ipl_bytes -= size;
+		img_pool.ipl_nfreed++;
+	}
+	(void) pthread_mutex_unlock(&img_pool_lock);
+
+	if (imgp != NULL) {
+		free(imgp->img_pixels);
+		free(imgp);
+	}
+}
+
+void
+img_pool_report(FILE *fp)
+{
+	(void) pthread_mutex_lock(&img_pool_lock);
+	(void) fprintf(fp, "img_pool: %lu hits, %lu misses, %lu recycled, "
+	    "%lu freed, %zu bytes peak, %zu bytes pooled\n", img_pool.ipl_nhits,
+	    img_pool.ipl_nmisses, img_pool.ipl_nrecycled, img_pool.ipl_nfreed,
+	    img_pool.ipl_peakbytes, img_pool.ipl_pooled);
+	(void) pthread_mutex_unlock(&img_pool_lock);
+}
+
+/*
+ * Copy the pixels (and bounding box and origin) of "src" into "dst", allocating
+ * "dst" if it's NULL.  Both images must have the same dimensions.
+ */
+img_t *
+img_copy(img_t *dst, img_t *src)
+{
+	unsigned int y;
+
+	if (img_materialize(src) != 0)
+		return (NULL);
+
+	if (dst == NULL &&
+	    (dst = img_alloc_uninit(src->img_width, src->img_height)) == NULL)
+		return (NULL);
+
+	assert(dst->img_width == src->img_width);
+	assert(dst->img_height == src->img_height);
+
+	dst->img_x0 = src->img_x0;
+	dst->img_y0 = src->img_y0;
+	for (y = src->img_y0; y < src->img_y0 + src->img_height; y++)
+		bcopy(img_pixel(src, src->img_x0, y),
+		    img_pixel(dst, dst->img_x0, y),
+		    sizeof (img_pixel_t) * src->img_width);
+
+	dst->img_minx = src->img_minx;
+	dst->img_maxx = src->img_maxx;
+	dst->img_miny = src->img_miny;
+	dst->img_maxy = src->img_maxy;
+	return (dst);
+}
+
 img_t *
 img_read(const char *filename)
+{
+	return (img_read_reuse(filename, NULL));
+}
+
+/*
+ * Like img_read(), but reuse the pixel buffer of "reuse" (if it's not NULL and
+ * has the right dimensions) rather than allocating a new image.  Either way,
+ * "reuse" is consumed: it's returned or freed.
+ */
+img_t *
+img_read_reuse(const char *filename, img_t *reuse)
 {
 	FILE *fp;
 	img_t *rv;
-	int x, y, i;
-	img_pixel_t *imagepx;
 	char buffer[3];
+	struct stat st;
 
 	if ((fp = fopen(filename, "r")) == NULL) {
 		warn("img_read %s", filename);
+		img_free(reuse);
 		return (NULL);
 	}
 
 	if (fread(buffer, sizeof (buffer), 1, fp) != 1) {
 		warnx("img_read %s: %s", filename, stdio_error(fp));
 		(void) fclose(fp);
+		img_free(reuse);
 		return (NULL);
 	}
 
 	(void) fseek(fp, 0, SEEK_SET);
 
 	if (buffer[0] == 'P' && buffer[1] == '6' && isspace(buffer[2])) {
-		rv = img_read_ppm(fp, filename);
+		/*
+		 * PPM pixel data has the same layout as img_pixel_t, so if
+		 * this is a regular file, we use the pixels in place rather
+		 * than reading them into a separate buffer.
+		 */
+		if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode)) {
+			rv = img_map_ppm(fp, filename, st.st_size);
+		} else {
+			rv = img_read_ppm(fp, filename, &reuse);
+		}
 	} else {
-		rv = img_read_png(fp, filename);
+		rv = img_read_png(fp, filename, &reuse);
 	}
 
 	(void) fclose(fp);
+	img_free(reuse);
 
-	/*
-	 * Compute the bounding box for the image, which is used as an
-	 * optimization when operating on masks.
-	 */
-	for (y = 0; y < rv->img_height; y++) {
-		for (x = 0; x < rv->img_width; x++) {
-			i = img_coord(rv, x, y);
-			imagepx = &rv->img_pixels[i];
+	if (rv == NULL)
+		return (NULL);
+
+	img_bound(rv);
+	return (rv);
+}
+
+/*
+ * Compute the bounding box of the pixels in an image that aren't nearly black,
+ * which is used as an optimization when operating on masks.
+ */
+static void
+img_bound(img_t *image)
+{
+	unsigned int x, y;
+	img_pixel_t *imagepx;
+
+	image->img_minx = image->img_x0 + image->img_width;
+	image->img_maxx = 0;
+	image->img_miny = image->img_y0 + image->img_height;
+	image->img_maxy = 0;
 
+	for (y = image->img_y0; y < image->img_y0 + image->img_height; y++) {
+		imagepx = img_pixel(image, image->img_x0, y);
+		for (x = image->img_x0; x < image->img_x0 + image->img_width;
+		    x++, imagepx++) {
 			if (imagepx->r < 2 && imagepx->g < 2 && imagepx->b < 2)
 				continue;
 
-			if (x < rv->img_minx)
-				rv->img_minx = x;
-			if (x + 1 > rv->img_maxx)
-				rv->img_maxx = x + 1;
-			if (y < rv->img_miny)
-				rv->img_miny = y;
-			if (y + 1 > rv->img_maxy)
-				rv->img_maxy = y + 1;
+			if (x < image->img_minx)
+				image->img_minx = x;
+			if (x + 1 > image->img_maxx)
+				image->img_maxx = x + 1;
+			if (y < image->img_miny)
+				image->img_miny = y;
+			if (y + 1 > image->img_maxy)
+				image->img_maxy = y + 1;
 		}
 	}
+}
+
+/*
+ * Move an image (and its bounding box) so that its top-left pixel is at (x0,
+ * y0).  The pixels themselves are unchanged.
+ */
+void
+img_relocate(img_t *image, unsigned int x0, unsigned int y0)
+{
+	image->img_minx += x0 - image->img_x0;
+	image->img_maxx += x0 - image->img_x0;
+	image->img_miny += y0 - image->img_y0;
+	image->img_maxy += y0 - image->img_y0;
+	image->img_x0 = x0;
+	image->img_y0 = y0;
+}
 
+/*
+ * Resample "src" to cover the "width" x "height" rectangle at (x0, y0), which
+ * may extend past the top-left of the plane, clipping the result to the
+ * "clipw" x "cliph" rectangle at the origin.  This is intended for masks: we
+ * use nearest-neighbour sampling so that the result only contains colors from
+ * the original (in particular, nearly-black pixels stay ignored rather than
+ * blending into their neighbours), and we only allocate the part of the result
+ * that covers the original's bounding box, so the result's origin is generally
+ * not (0, 0).  The result's bounding box is recomputed.
+ */
+img_t *
+img_rescale(img_t *src, long x0, long y0, unsigned int width,
+    unsigned int height, unsigned int clipw, unsigned int cliph)
+{
+	img_t *rv;
+	img_pixel_t *px;
+	long dx0, dy0, dx1, dy1, x, y;
+	unsigned int sx, sy;
+
+	if (img_materialize(src) != 0)
+		return (NULL);
+
+	if (src->img_minx >= src->img_maxx || src->img_miny >= src->img_maxy) {
+		dx0 = dy0 = 0;
+		dx1 = dy1 = 1;
+	} else {
+		dx0 = x0 + (long)(src->img_minx - src->img_x0) * width /
+		    src->img_width;
+		dy0 = y0 + (long)(src->img_miny - src->img_y0) * height /
+		    src->img_height;
+		dx1 = x0 + ((long)(src->img_maxx - src->img_x0) * width +
+		    src->img_width - 1) / src->img_width;
+		dy1 = y0 + ((long)(src->img_maxy - src->img_y0) * height +
+		    src->img_height - 1) / src->img_height;
+		dx0 = MAX(dx0, 0);
+		dy0 = MAX(dy0, 0);
+		dx1 = MIN(dx1, (long)clipw);
+		dy1 = MIN(dy1, (long)cliph);
+		if (dx1 <= dx0 || dy1 <= dy0) {
+			dx0 = dy0 = 0;
+			dx1 = dy1 = 1;
+		}
+	}
+
+	if ((rv = img_alloc_uninit(dx1 - dx0, dy1 - dy0)) == NULL)
+		return (NULL);
+
+	rv->img_x0 = dx0;
+	rv->img_y0 = dy0;
+
+	for (y = dy0; y < dy1; y++) {
+		px = img_pixel(rv, dx0, y);
+		sy = ((y - y0) * 2 + 1) * src->img_height / (2 * height);
+		for (x = dx0; x < dx1; x++, px++) {
+			sx = ((x - x0) * 2 + 1) * src->img_width / (2 * width);
+			if (y < y0 || x < x0 || sx >= src->img_width ||
+			    sy >= src->img_height) {
+				px->r = px->g = px->b = 0;
+				continue;
+			}
+
+			*px = *img_pixel(src, src->img_x0 + sx,
+			    src->img_y0 + sy);
+		}
+	}
+
+	img_bound(rv);
+	return (rv);
+}
+
+/*
+ * Returns an image of the given size for one of the readers, using *reusep if
+ * possible.  *reusep is consumed either way.
+ */
+static img_t *
+img_reuse(img_t **reusep, unsigned int width, unsigned int height)
+{
+	img_t *rv = *reusep;
+
+	*reusep = NULL;
+	if (rv == NULL || rv->img_isview || rv->img_map != NULL ||
+	    rv->img_width != width ||
+	    rv->img_height != height) {
+		img_free(rv);
+		return (img_alloc_uninit(width, height));
+	}
+
+	rv->img_planar = NULL;
+	rv->img_x0 = 0;
+	rv->img_y0 = 0;
+	rv->img_maxx = 0;
+	rv->img_minx = rv->img_width;
+	rv->img_maxy = 0;
+	rv->img_miny = rv->img_height;
 	return (rv);
 }
 
 img_t *
-img_read_ppm(FILE *fp, const char *filename)
+img_read_ppm(FILE *fp, const char *filename, img_t **reusep)
 {
 	int nread;
-	unsigned int width, height, maxval;
+	unsigned int width, height, maxval, y;
 	img_t *rv = NULL;
 
 	nread = fscanf(fp, "P6 %u %u %u", &width, &height, &maxval);
@@ -132,23 +553,96 @@ img_read_ppm(FILE *fp, const char *filename)
 		return (NULL);
 	}
 
-	if ((rv = img_alloc(width, height)) == NULL) {
+	if ((rv = img_reuse(reusep, width, height)) == NULL) {
 		warn("img_read_ppm %s", filename);
 		return (NULL);
 	}
 
 	/* Skip the single whitespace character that follows the header. */
-	(void) fseek(fp, SEEK_CUR, 1);
+	(void) fseek(fp, 1, SEEK_CUR);
+
+	for (y = 0; y < rv->img_height; y++) {
+		nread = fread(img_pixel(rv, 0, y), sizeof (img_pixel_t),
+		    rv->img_width, fp);
+
+		if (nread != rv->img_width) {
+			warnx("img_read_ppm %s: %s", filename,
+			    stdio_error(fp));
+			img_free(rv);
+			return (NULL);
+		}
+	}
 
-	nread = fread(rv->img_pixels, sizeof (rv->img_pixels[0]),
-	    rv->img_width * rv->img_height, fp);
+	return (rv);
+}
+
+/*
+ * Read a PPM image by mapping the file: the returned image's pixels point
+ * directly into the (private) mapping, which is torn down by img_free().
+ */
+static img_t *
+img_map_ppm(FILE *fp, const char *filename, size_t filesize)
+{
+	char header[64];
+	size_t hdrlen, len;
+	unsigned int width, height, maxval;
+	int nread, offset;
+	void *map;
+	img_t *rv;
 
-	if (nread != rv->img_width * rv->img_height) {
+	if ((hdrlen = fread(header, 1, sizeof (header) - 1, fp)) == 0) {
 		warnx("img_read_ppm %s: %s", filename, stdio_error(fp));
-		img_free(rv);
 		return (NULL);
 	}
 
+	header[hdrlen] = '\0';
+	nread = sscanf(header, "P6 %u %u %u%n", &width, &height, &maxval,
+	    &offset);
+	if (nread != 3 || offset >= hdrlen || !isspace(header[offset])) {
+		warnx("img_read_ppm %s: mangled ppm header", filename);
+		return (NULL);
+	}
+
+	if (maxval > 255) {
+		warnx("img_read_ppm %s: unsupported color depth", filename);
+		return (NULL);
+	}
+
+	/* Skip the single whitespace character that follows the header. */
+	offset++;
+	len = (size_t)width * height * sizeof (img_pixel_t);
+	if (filesize < offset + len) {
+		warnx("img_read_ppm %s: unexpected EOF", filename);
+		return (NULL);
+	}
+
+	/*
+	 * The mapping is private so that callers can modify the image (as they
+	 * can any other) without affecting the file.
+	 */
+	map = mmap(NULL, offset + len, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	    fileno(fp), 0);
+	if (map == MAP_FAILED) {
+		warn("img_read_ppm %s: mmap", filename);
+		return (NULL);
+	}
+
+	if ((rv = calloc(1, sizeof (*rv))) == NULL) {
+		warn("img_read_ppm %s", filename);
+		(void) munmap(map, offset + len);
+		return (NULL);
+	}
+
+	rv->img_map = map;
+	rv->img_maplen = offset + len;
+	rv->img_pixels = (img_pixel_t *)((uint8_t *)map + offset);
+	rv->img_stride = width * sizeof (img_pixel_t);
+	rv->img_width = width;
+	rv->img_height = height;
+	rv->img_maxx = 0;
+	rv->img_minx = rv->img_width;
+	rv->img_maxy = 0;
+	rv->img_miny = rv->img_height;
 	return (rv);
 }
 
@@ -156,24 +650,27 @@ int
 img_write_ppm(img_t *image, FILE *fp)
 {
 	int nread;
+	unsigned int y;
 
 	(void) fprintf(fp, "P6\n%u %u\n%u\n", image->img_width,
 	    image->img_height, 255);
 
-	nread = fwrite(image->img_pixels, sizeof (image->img_pixels[0]),
-	    image->img_width * image->img_height, fp);
+	for (y = image->img_y0; y < image->img_y0 + image->img_height; y++) {
+		nread = fwrite(img_pixel(image, image->img_x0, y),
+		    sizeof (img_pixel_t), image->img_width, fp);
 
-	if (nread != image->img_width * image->img_height) {
-		warn("img_write_ppm: failed after %d of %d pixels", nread,
-		    image->img_width * image->img_height);
-		return (-1);
+		if (nread != image->img_width) {
+			warn("img_write_ppm: failed at row %u of %u",
+			    y - image->img_y0, image->img_height);
+			return (-1);
+		}
 	}
 
 	return (0);
 }
 
 img_t *
-img_read_png(FILE *fp, const char *filename)
+img_read_png(FILE *fp, const char *filename, img_t **reusep)
 {
 	uint8_t header[8];
 	unsigned int width, height, i;
@@ -229,7 +726,7 @@ img_read_png(FILE *fp, const char *filename)
 		return (NULL);
 	}
 
-	if ((rv = img_alloc(width, height)) == NULL) {
+	if ((rv = img_reuse(reusep, width, height)) == NULL) {
 		warn("img_read_png %s", filename);
 		return (NULL);
 	}
@@ -243,7 +740,7 @@ img_read_png(FILE *fp, const char *filename)
 	assert(png_get_rowbytes(png, pnginfo) == sizeof (img_pixel_t) * width);
 
 	for (i = 0; i < height; i++)
-		rows[i] = (png_bytep)&rv->img_pixels[img_coord(rv, 0, i)];
+		rows[i] = (png_bytep)img_pixel(rv, 0, i);
 
 	png_read_image(png, rows);
 	png_read_end(png, NULL);
@@ -255,6 +752,16 @@ img_read_png(FILE *fp, const char *filename)
 
 int
 img_write_png(img_t *img, FILE *fp)
+{
+	return (img_write_png_level(img, fp, -1));
+}
+
+/*
+ * Write a PNG image with the given zlib compression level (-1 for the libpng
+ * default).
+ */
+static int
+img_write_png_level(img_t *img, FILE *fp, int level)
 {
 	png_structp png;
 	png_infop pnginfo;
@@ -267,7 +774,8 @@ img_write_png(img_t *img, FILE *fp)
 	}
 
 	for (i = 0; i < img->img_height; i++)
-		rows[i] = (png_bytep)&img->img_pixels[img_coord(img, 0, i)];
+		rows[i] = (png_bytep)img_pixel(img, img->img_x0,
+		    img->img_y0 + i);
 
 	if ((png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL,
 	    NULL)) == NULL ||
@@ -285,6 +793,8 @@ img_write_png(img_t *img, FILE *fp)
 	}
 
 	png_init_io(png, fp);
+	if (level >= 0)
+		png_set_compression_level(png, level);
 	png_set_IHDR(png, pnginfo, img->img_width, img->img_height,
 	    8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
 	    PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
@@ -297,40 +807,525 @@ img_write_png(img_t *img, FILE *fp)
 
 int
 img_write(img_t *img, const char *filename)
+{
+	return (img_write_level(img, filename, -1));
+}
+
+static int
+img_write_level(img_t *img, const char *filename, int level)
+{
+	hrtime_t start;
+	int rv;
+
+	start = gethrtime();
+	rv = img_write_file(img, filename, level);
+	PROBE3(image__written, filename, rv, gethrtime() - start);
+	return (rv);
+}
+
+static int
+img_write_file(img_t *img, const char *filename, int level)
 {
 	FILE *fp;
-	int namelen, rv;
-	int (*func)(img_t *, FILE *);
+	int fd, namelen, rv;
+	struct stat st;
 
+	if (img_materialize(img) != 0) {
+		warnx("img_write %s: failed to convert image", filename);
+		return (-1);
+	}
+
+	/*
+	 * PPM images written to regular files go through a mapping of the
+	 * file, which must be opened for reading as well as writing.
+	 */
 	namelen = strlen(filename);
 	if (namelen >= sizeof (".ppm") &&
-	    strcmp(filename + namelen - sizeof (".ppm") + 1, ".ppm") == 0)
-		func = img_write_ppm;
-	else
-		func = img_write_png;
+	    strcmp(filename + namelen - sizeof (".ppm") + 1, ".ppm") == 0 &&
+	    (stat(filename, &st) != 0 || S_ISREG(st.st_mode))) {
+		if ((fd = open(filename, O_RDWR | O_CREAT | O_TRUNC,
+		    0666)) == -1) {
+			warn("img_write %s: open", filename);
+			return (-1);
+		}
+
+		rv = img_write_ppm_map(img, fd, filename);
+		(void) close(fd);
+		return (rv);
+	}
 
 	if ((fp = fopen(filename, "w")) == NULL) {
 		warn("img_write %s: fopen", filename);
 		return (-1);
 	}
 
-	rv = func(img, fp);
+	if (namelen >= sizeof (".ppm") &&
+	    strcmp(filename + namelen - sizeof (".ppm") + 1, ".ppm") == 0)
+		rv = img_write_ppm(img, fp);
+	else
+		rv = img_write_png_level(img, fp, level);
+
 	(void) fclose(fp);
 	return (rv);
 }
 
+/*
+ * Write a PPM image to the regular file "fd" by sizing the file up front and
+ * copying the pixels into a shared mapping of it, avoiding stdio's buffering.
+ */
+static int
+img_write_ppm_map(img_t *image, int fd, const char *filename)
+{
+	char header[64];
+	size_t rowlen, len;
+	unsigned int y;
+	uint8_t *map, *p;
+	int hdrlen;
+
+	hdrlen = snprintf(header, sizeof (header), "P6\n%u %u\n%u\n",
+	    image->img_width, image->img_height, 255);
+	rowlen = image->img_width * sizeof (img_pixel_t);
+	len = hdrlen + rowlen * image->img_height;
+
+	if (ftruncate(fd, len) != 0) {
+		warn("img_write %s: ftruncate", filename);
+		return (-1);
+	}
+
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		warn("img_write %s: mmap", filename);
+		return (-1);
+	}
+
+	bcopy(header, map, hdrlen);
+	p = map + hdrlen;
+	for (y = image->img_y0; y < image->img_y0 + image->img_height; y++) {
+		bcopy(img_pixel(image, image->img_x0, y), p, rowlen);
+		p += rowlen;
+	}
+
+	(void) munmap(map, len);
+	return (0);
+}
+
+/*
+ * Asynchronous image writer.  Images submitted with img_writer_submit() are
+ * copied into a job and written out by a pool of background threads, so that
+ * the caller doesn't wait for compression.  At most "maxjobs" images may be
+ * queued or in progress at once; beyond that, img_writer_submit() blocks until
+ * a writer finishes an image.  Job buffers are reused rather than freed.
+ */
+typedef struct img_job {
+	struct img_job	*ij_next;
+	img_t		*ij_image;
+	char		ij_filename[PATH_MAX];
+} img_job_t;
+
+struct img_writer {
+	pthread_mutex_t	iw_lock;
+	pthread_cond_t	iw_cv;		/* work queued or job finished */
+	pthread_t	*iw_threads;
+	int		iw_nthreads;
+	int		iw_level;	/* PNG compression level */
+	int		iw_maxjobs;	/* max queued or in-progress jobs */
+	int		iw_njobs;	/* current queued or in-progress jobs */
+	boolean_t	iw_done;	/* no more jobs are coming */
+	img_job_t	*iw_head;	/* queue of jobs to write */
+	img_job_t	*iw_tail;
+	img_job_t	*iw_free;	/* unused jobs */
+	unsigned long	iw_nwritten;	/* stats */
+	unsigned long	iw_nerrors;
+	unsigned long	iw_nwaits;
+};
+
+static void *
+img_writer_thread(void *arg)
+{
+	img_writer_t *iwp = arg;
+	img_job_t *ijp;
+	int rv;
+
+	(void) pthread_mutex_lock(&iwp->iw_lock);
+	for (;;) {
+		while (iwp->iw_head == NULL && !iwp->iw_done)
+			(void) pthread_cond_wait(&iwp->iw_cv, &iwp->iw_lock);
+
+		if ((ijp = iwp->iw_head) == NULL)
+			break;
+
+		iwp->iw_head = ijp->ij_next;
+		if (iwp->iw_head == NULL)
+			iwp->iw_tail = NULL;
+		(void) pthread_mutex_unlock(&iwp->iw_lock);
+
+		rv = img_write_level(ijp->ij_image, ijp->ij_filename,
+		    iwp->iw_level);
+
+		(void) pthread_mutex_lock(&iwp->iw_lock);
+		if (rv != 0)
+			iwp->iw_nerrors++;
+		else
+			iwp->iw_nwritten++;
+		ijp->ij_next = iwp->iw_free;
+		iwp->iw_free = ijp;
+		iwp->iw_njobs--;
+		(void) pthread_cond_broadcast(&iwp->iw_cv);
+	}
+	(void) pthread_mutex_unlock(&iwp->iw_lock);
+
+	return (NULL);
+}
+
+img_writer_t *
+img_writer_init(int nthreads, int maxjobs, int level)
+{
+	img_writer_t *iwp;
+	int rv;
+
+	assert(nthreads > 0);
+	assert(maxjobs >= nthreads);
+
+	if ((iwp = calloc(1, sizeof (*iwp))) == NULL ||
+	    (iwp->iw_threads = calloc(nthreads,
+	    sizeof (iwp->iw_threads[0]))) == NULL) {
+		warn("calloc");
+		free(iwp);
+		return (NULL);
+	}
+
+	(void) pthread_mutex_init(&iwp->iw_lock, NULL);
+	(void) pthread_cond_init(&iwp->iw_cv, NULL);
+	iwp->iw_level = level;
+	iwp->iw_maxjobs = maxjobs;
+
+	for (; iwp->iw_nthreads < nthreads; iwp->iw_nthreads++) {
+		rv = pthread_create(&iwp->iw_threads[iwp->iw_nthreads], NULL,
+		    img_writer_thread, iwp);
+		if (rv != 0) {
+			warnx("pthread_create: %s", strerror(rv));
+			img_writer_fini(iwp);
+			return (NULL);
+		}
+	}
+
+	return (iwp);
+}
+
+/*
+ * Queue a copy of "image" to be written to "filename".
+ */
+int
+img_writer_submit(img_writer_t *iwp, img_t *image, const char *filename)
+{
+	img_job_t *ijp;
+
+	(void) pthread_mutex_lock(&iwp->iw_lock);
+	if (iwp->iw_njobs == iwp->iw_maxjobs) {
+		iwp->iw_nwaits++;
+		while (iwp->iw_njobs == iwp->iw_maxjobs)
+			(void) pthread_cond_wait(&iwp->iw_cv, &iwp->iw_lock);
+	}
+
+	if ((ijp = iwp->iw_free) != NULL)
+		iwp->iw_free = ijp->ij_next;
+	iwp->iw_njobs++;
+	(void) pthread_mutex_unlock(&iwp->iw_lock);
+
+	if (ijp == NULL && (ijp = calloc(1, sizeof (*ijp))) == NULL) {
+		warn("calloc");
+		goto err;
+	}
+
+	if (ijp->ij_image != NULL &&
+	    (ijp->ij_image->img_width != image->img_width ||
+	    ijp->ij_image->img_height != image->img_height)) {
+		img_free(ijp->ij_image);
+		ijp->ij_image = NULL;
+	}
+
+	if ((ijp->ij_image = img_copy(ijp->ij_image, image)) == NULL) {
+		warnx("img_writer %s: failed to copy image", filename);
+		goto err;
+	}
+
+	(void) strncpy(ijp->ij_filename, filename,
+	    sizeof (ijp->ij_filename) - 1);
+	ijp->ij_next = NULL;
+
+	(void) pthread_mutex_lock(&iwp->iw_lock);
+	if (iwp->iw_tail != NULL)
+		iwp->iw_tail->ij_next = ijp;
+	else
+		iwp->iw_head = ijp;
+	iwp->iw_tail = ijp;
+	(void) pthread_cond_broadcast(&iwp->iw_cv);
+	(void) pthread_mutex_unlock(&iwp->iw_lock);
+	return (0);
+
+err:
+	(void) pthread_mutex_lock(&iwp->iw_lock);
+	if (ijp != NULL) {
+		ijp->ij_next = iwp->iw_free;
+		iwp->iw_free = ijp;
+	}
+	iwp->iw_njobs--;
+	iwp->iw_nerrors++;
+	(void) pthread_cond_broadcast(&iwp->iw_cv);
+	(void) pthread_mutex_unlock(&iwp->iw_lock);
+	return (-1);
+}
+
+/*
+ * Wait for all queued images to be written, then tear down the pool.
+ */
+void
+img_writer_fini(img_writer_t *iwp)
+{
+	img_job_t *ijp;
+	int i;
+
+	(void) pthread_mutex_lock(&iwp->iw_lock);
+	iwp->iw_done = B_TRUE;
+	(void) pthread_cond_broadcast(&iwp->iw_cv);
+	(void) pthread_mutex_unlock(&iwp->iw_lock);
+
+	for (i = 0; i < iwp->iw_nthreads; i++)
+		(void) pthread_join(iwp->iw_threads[i], NULL);
+
+	if (kv_debug > 0)
+		(void) fprintf(stderr, "img_writer: %lu written, %lu failed, "
+		    "%lu waits for a free slot\n", iwp->iw_nwritten,
+		    iwp->iw_nerrors, iwp->iw_nwaits);
+
+	while ((ijp = iwp->iw_free) != NULL) {
+		iwp->iw_free = ijp->ij_next;
+		img_free(ijp->ij_image);
+		free(ijp);
+	}
+
+	(void) pthread_mutex_destroy(&iwp->iw_lock);
+	(void) pthread_cond_destroy(&iwp->iw_cv);
+	free(iwp->iw_threads);
+	free(iwp);
+}
+
+/*
+ * Image prefetcher.  A pool of reader threads reads (and decompresses) the
+ * named images ahead of the consumer, which retrieves them strictly in order
+ * with img_prefetch_next().  At most "depth" images are read ahead or held by
+ * the consumer at once, and image buffers handed back with
+ * img_prefetch_release() are reused for later frames.  With no threads, images
+ * are simply read synchronously by img_prefetch_next().
+ */
+struct img_prefetch {
+	pthread_mutex_t	ip_lock;
+	pthread_cond_t	ip_cv;		/* image read or slot released */
+	pthread_t	*ip_threads;
+	int		ip_nthreads;
+	char		**ip_names;	/* images to read, in order */
+	int		ip_nnames;
+	int		ip_depth;	/* max images read ahead */
+	int		ip_next;	/* next image for a reader to claim */
+	int		ip_nout;	/* images returned to the consumer */
+	int		ip_nreleased;	/* images released by the consumer */
+	boolean_t	ip_done;	/* tearing down */
+	img_t		**ip_slots;	/* read images, indexed by i % depth */
+	boolean_t	*ip_ready;	/* slot has been read */
+	img_t		**ip_free;	/* released images available for reuse */
+	int		ip_nfree;
+	unsigned long	ip_nread;	/* stats */
+	unsigned long	ip_nerrors;
+	unsigned long	ip_nwaits;
+};
+
+static void *
+img_prefetch_thread(void *arg)
+{
+	img_prefetch_t *ipp = arg;
+	img_t *image;
+	int i;
+
+	(void) pthread_mutex_lock(&ipp->ip_lock);
+	for (;;) {
+		while (!ipp->ip_done && ipp->ip_next < ipp->ip_nnames &&
+		    ipp->ip_next >= ipp->ip_nreleased + ipp->ip_depth)
+			(void) pthread_cond_wait(&ipp->ip_cv, &ipp->ip_lock);
+
+		if (ipp->ip_done || ipp->ip_next >= ipp->ip_nnames)
+			break;
+
+		i = ipp->ip_next++;
+		image = ipp->ip_nfree > 0 ? ipp->ip_free[--ipp->ip_nfree] : NULL;
+		(void) pthread_mutex_unlock(&ipp->ip_lock);
+
+		image = img_read_reuse(ipp->ip_names[i], image);
+
+		(void) pthread_mutex_lock(&ipp->ip_lock);
+		if (image == NULL)
+			ipp->ip_nerrors++;
+		else
+			ipp->ip_nread++;
+		ipp->ip_slots[i % ipp->ip_depth] = image;
+		ipp->ip_ready[i % ipp->ip_depth] = B_TRUE;
+		(void) pthread_cond_broadcast(&ipp->ip_cv);
+	}
+	(void) pthread_mutex_unlock(&ipp->ip_lock);
+
+	return (NULL);
+}
+
+img_prefetch_t *
+img_prefetch_init(char **names, int nnames, int nthreads, int depth)
+{
+	img_prefetch_t *ipp;
+	int rv;
+
+	assert(nthreads >= 0);
+	assert(depth >= 1);
+
+	if ((ipp = calloc(1, sizeof (*ipp))) == NULL ||
+	    (ipp->ip_threads = calloc(nthreads + 1,
+	    sizeof (ipp->ip_threads[0]))) == NULL ||
+	    (ipp->ip_slots = calloc(depth, sizeof (ipp->ip_slots[0]))) == NULL ||
+	    (ipp->ip_ready = calloc(depth, sizeof (ipp->ip_ready[0]))) == NULL ||
+	    (ipp->ip_free = calloc(depth, sizeof (ipp->ip_free[0]))) == NULL) {
+		warn("calloc");
+		if (ipp != NULL) {
+			free(ipp->ip_threads);
+			free(ipp->ip_slots);
+			free(ipp->ip_ready);
+			free(ipp);
+		}
+		return (NULL);
+	}
+
+	(void) pthread_mutex_init(&ipp->ip_lock, NULL);
+	(void) pthread_cond_init(&ipp->ip_cv, NULL);
+	ipp->ip_names = names;
+	ipp->ip_nnames = nnames;
+	ipp->ip_depth = depth;
+
+	for (; ipp->ip_nthreads < nthreads; ipp->ip_nthreads++) {
+		rv = pthread_create(&ipp->ip_threads[ipp->ip_nthreads], NULL,
+		    img_prefetch_thread, ipp);
+		if (rv != 0) {
+			warnx("pthread_create: %s", strerror(rv));
+			img_prefetch_fini(ipp);
+			return (NULL);
+		}
+	}
+
+	return (ipp);
+}
+
+/*
+ * Returns the next image in order, waiting for it to be read if necessary, or
+ * NULL if it couldn't be read.  Each call must be matched by a call to
+ * img_prefetch_release() (even if this returned NULL), and the caller may hold
+ * fewer than "depth" images at once.
+ */
+img_t *
+img_prefetch_next(img_prefetch_t *ipp)
+{
+	img_t *image;
+	int i, s;
+
+	(void) pthread_mutex_lock(&ipp->ip_lock);
+	assert(ipp->ip_nout < ipp->ip_nnames);
+	assert(ipp->ip_nout - ipp->ip_nreleased < ipp->ip_depth);
+	i = ipp->ip_nout++;
+
+	if (ipp->ip_nthreads == 0) {
+		image = ipp->ip_nfree > 0 ? ipp->ip_free[--ipp->ip_nfree] : NULL;
+		(void) pthread_mutex_unlock(&ipp->ip_lock);
+		image = img_read_reuse(ipp->ip_names[i], image);
+		if (image == NULL)
+			ipp->ip_nerrors++;
+		else
+			ipp->ip_nread++;
+		return (image);
+	}
+
+	s = i % ipp->ip_depth;
+	if (!ipp->ip_ready[s]) {
+		ipp->ip_nwaits++;
+		while (!ipp->ip_ready[s])
+			(void) pthread_cond_wait(&ipp->ip_cv, &ipp->ip_lock);
+	}
+
+	image = ipp->ip_slots[s];
+	ipp->ip_slots[s] = NULL;
+	ipp->ip_ready[s] = B_FALSE;
+	(void) pthread_mutex_unlock(&ipp->ip_lock);
+	return (image);
+}
+
+/*
+ * Hand back an image returned by img_prefetch_next() so that its buffer can be
+ * reused.
+ */
+void
+img_prefetch_release(img_prefetch_t *ipp, img_t *image)
+{
+	(void) pthread_mutex_lock(&ipp->ip_lock);
+	assert(ipp->ip_nreleased < ipp->ip_nout);
+	ipp->ip_nreleased++;
+	if (image != NULL) {
+		assert(ipp->ip_nfree < ipp->ip_depth);
+		ipp->ip_free[ipp->ip_nfree++] = image;
+	}
+	(void) pthread_cond_broadcast(&ipp->ip_cv);
+	(void) pthread_mutex_unlock(&ipp->ip_lock);
+}
+
+void
+img_prefetch_fini(img_prefetch_t *ipp)
+{
+	int i;
+
+	(void) pthread_mutex_lock(&ipp->ip_lock);
+	ipp->ip_done = B_TRUE;
+	(void) pthread_cond_broadcast(&ipp->ip_cv);
+	(void) pthread_mutex_unlock(&ipp->ip_lock);
+
+	for (i = 0; i < ipp->ip_nthreads; i++)
+		(void) pthread_join(ipp->ip_threads[i], NULL);
+
+	if (kv_debug > 0)
+		(void) fprintf(stderr, "img_prefetch: %lu read, %lu failed, "
+		    "%lu waits for a frame\n", ipp->ip_nread, ipp->ip_nerrors,
+		    ipp->ip_nwaits);
+
+	for (i = 0; i < ipp->ip_depth; i++)
+		img_free(ipp->ip_slots[i]);
+	for (i = 0; i < ipp->ip_nfree; i++)
+		img_free(ipp->ip_free[i]);
+
+	(void) pthread_mutex_destroy(&ipp->ip_lock);
+	(void) pthread_cond_destroy(&ipp->ip_cv);
+	free(ipp->ip_threads);
+	free(ipp->ip_slots);
+	free(ipp->ip_ready);
+	free(ipp->ip_free);
+	free(ipp);
+}
+
 void
 img_free(img_t *imgp)
 {
 	if (imgp == NULL)
 		return;
-	
-	free(imgp->img_pixels);
+
+	if (imgp->img_map != NULL) {
+		(void) munmap(imgp->img_map, imgp->img_maplen);
+	} else if (!imgp->img_isview) {
+		img_pool_put(imgp);
+		return;
+	}
+
 	free(imgp);
 }
- 
-#define	MIN(x, y)	((x) < (y) ? (x) : (y))
-#define	MAX(x, y)	((x) > (y) ? (x) : (y))
 
 /*
  * This implementation is adapted from that by Eugene Vishnevsky:
@@ -375,7 +1370,7 @@ img_pix_rgb2hsv(img_pixelhsv_t *hsv, img_pixel_t *rgb)
 double
 img_compare(img_t *image, img_t *mask, img_t **dbgmask)
 {
-	unsigned int x, y, i;
+	unsigned int x, y;
 	unsigned int dr, dg, db, dz2;
 	unsigned int npixels;
 	unsigned int ncompared = 0, nignored = 0, ndifferent = 0;
@@ -383,18 +1378,27 @@ img_compare(img_t *image, img_t *mask, img_t **dbgmask)
 	double score;
 	img_pixel_t *imgpx, *maskpx, *dbgpx;
 
+	if (img_materialize(image) != 0) {
+		warnx("img_compare: failed to convert image");
+		return (1);
+	}
+
 	if (dbgmask != NULL)
-		*dbgmask = img_alloc(image->img_width, image->img_height);
+		*dbgmask = img_alloc(mask->img_width, mask->img_height);
 
-	assert(image->img_width == mask->img_width);
-	assert(image->img_height == mask->img_height);
+	/*
+	 * The image may be a view, but it must cover the mask's bounding box.
+	 */
+	assert(mask->img_minx >= image->img_x0 &&
+	    mask->img_maxx <= image->img_x0 + image->img_width);
+	assert(mask->img_miny >= image->img_y0 &&
+	    mask->img_maxy <= image->img_y0 + image->img_height);
 
 	for (y = mask->img_miny; y < mask->img_maxy; y++) {
-		for (x = mask->img_minx; x < mask->img_maxx; x++) {
-			i = img_coord(image, x, y);
-			maskpx = &mask->img_pixels[i];
-			imgpx = &image->img_pixels[i];
-
+		maskpx = img_pixel(mask, mask->img_minx, y);
+		imgpx = img_pixel(image, mask->img_minx, y);
+		for (x = mask->img_minx; x < mask->img_maxx;
+		    x++, maskpx++, imgpx++) {
 			/*
 			 * Ignore nearly-black pixels in the mask.
 			 */
@@ -413,7 +1417,7 @@ img_compare(img_t *image, img_t *mask, img_t **dbgmask)
 				continue;
 
 			if (dbgmask != NULL) {
-				dbgpx = &((*dbgmask)->img_pixels[i]);
+				dbgpx = img_pixel(*dbgmask, x, y);
 				dbgpx->g = 255 - (sqrt(dz2));
 			}
 
@@ -443,21 +1447,432 @@ img_compare(img_t *image, img_t *mask, img_t **dbgmask)
 	return (score);
 }
 
+/*
+ * Make sure that img_pixels is filled in for an image backed by planar data.
+ */
+int
+img_materialize(img_t *image)
+{
+	if (image->img_pixels != NULL)
+		return (0);
+
+	if (image->img_planar == NULL || image->img_planar->ip_torgb == NULL)
+		return (-1);
+
+	return (image->img_planar->ip_torgb(image, image->img_planar->ip_arg));
+}
+
+/*
+ * Convert a mask for comparison against planar YUV images with the given
+ * chroma subsampling.  We use the same BT.601 limited-range conversion that
+ * swscale uses by default.
+ */
+img_yuvmask_t *
+img_yuvmask(img_t *mask, unsigned int hshift, unsigned int vshift)
+{
+	img_yuvmask_t *rv;
+	img_yuvpx_t *yp;
+	img_pixel_t *maskpx;
+	unsigned int x, y, n;
+
+	if ((rv = calloc(1, sizeof (*rv))) == NULL)
+		return (NULL);
+
+	n = 0;
+	for (y = mask->img_miny; y < mask->img_maxy; y++) {
+		for (x = mask->img_minx; x < mask->img_maxx; x++) {
+			maskpx = img_pixel(mask, x, y);
+			if (maskpx->r >= 2 || maskpx->g >= 2 || maskpx->b >= 2)
+				n++;
+		}
+	}
+
+	if (n > 0 && (rv->iym_pixels = calloc(n, sizeof (*yp))) == NULL) {
+		free(rv);
+		return (NULL);
+	}
+
+	rv->iym_hshift = hshift;
+	rv->iym_vshift = vshift;
+
+	for (y = mask->img_miny; y < mask->img_maxy; y++) {
+		for (x = mask->img_minx; x < mask->img_maxx; x++) {
+			maskpx = img_pixel(mask, x, y);
+
+			/* See img_compare(). */
+			if (maskpx->r < 2 && maskpx->g < 2 && maskpx->b < 2)
+				continue;
+
+			yp = &rv->iym_pixels[rv->iym_npixels++];
+			yp->iyp_x = x;
+			yp->iyp_y = y;
+			yp->iyp_cx = x >> hshift;
+			yp->iyp_cy = y >> vshift;
+			yp->iyp_yuv[0] = 16 + 0.257 * maskpx->r +
+			    0.504 * maskpx->g + 0.098 * maskpx->b;
+			yp->iyp_yuv[1] = 128 - 0.148 * maskpx->r -
+			    0.291 * maskpx->g + 0.439 * maskpx->b;
+			yp->iyp_yuv[2] = 128 + 0.439 * maskpx->r -
+			    0.368 * maskpx->g - 0.071 * maskpx->b;
+		}
+	}
+
+	return (rv);
+}
+
+void
+img_yuvmask_free(img_yuvmask_t *ymp)
+{
+	if (ymp == NULL)
+		return;
+
+	free(ymp->iym_pixels);
+	free(ymp);
+}
+
+/*
+ * Like img_compare(), signatures ignore nearly-black pixels in the mask.
+ */
+#define	IMG_IGNORED(px)	((px)->r < 2 && (px)->g < 2 && (px)->b < 2)
+
+/*
+ * Compute the signature bits for the given luma values (one for each of the
+ * signature's pixels, in order).  If "out" is non-NULL, the bits are stored
+ * there.  If "ref" is non-NULL, they're compared against "ref" and we return
+ * the number of bits that differ, using popcount on each 64-bit word.
+ */
+static unsigned int
+img_sig_bits(img_sig_t *isp, const uint8_t *luma, uint64_t *out,
+    const uint64_t *ref)
+{
+	unsigned int i, j, nbits, dist;
+	unsigned long sum;
+	const uint8_t *lp;
+	uint64_t word;
+
+	nbits = 0;
+	dist = 0;
+	word = 0;
+
+#define	IMG_SIG_FLUSH(i)	{					\
+	if (out != NULL)						\
+		out[i] = word;						\
+	if (ref != NULL)						\
+		dist += __builtin_popcountll(word ^ ref[i]);		\
+	word = 0;							\
+}
+#define	IMG_SIG_BIT(b)	{						\
+	word |= (uint64_t)(b) << (nbits % 64);				\
+	if (++nbits % 64 == 0)						\
+		IMG_SIG_FLUSH(nbits / 64 - 1);				\
+}
+
+	if (isp->isg_type & IMG_SIG_LUMA) {
+		/* Compare luma * npixels against the sum to avoid dividing. */
+		for (sum = 0, i = 0; i < isp->isg_npixels; i++)
+			sum += luma[i];
+
+		for (i = 0; i < isp->isg_npixels; i++)
+			IMG_SIG_BIT((unsigned long)luma[i] * isp->isg_npixels >
+			    sum);
+	}
+
+	if (isp->isg_type & IMG_SIG_GRAD) {
+		for (lp = luma, i = 0; i < isp->isg_nruns; i++) {
+			for (j = 1; j < isp->isg_runs[i].isr_n; j++)
+				IMG_SIG_BIT(lp[j] > lp[j - 1]);
+			lp += isp->isg_runs[i].isr_n;
+		}
+	}
+
+	if (nbits % 64 != 0)
+		IMG_SIG_FLUSH(nbits / 64);
+#undef	IMG_SIG_BIT
+#undef	IMG_SIG_FLUSH
+
+	return (dist);
+}
+
+/*
+ * Gather the luma of each of the signature's pixels in "image" into
+ * isg_luma.  For planar images, we use the Y plane directly: it's a scaled and
+ * offset version of the same luma, which the signature doesn't care about.
+ */
+static int
+img_sig_luma(img_t *image, img_sig_t *isp)
+{
+	img_planar_t *ip = image->img_planar;
+	img_sigrun_t *isr;
+	img_pixel_t *px;
+	const uint8_t *yp;
+	uint8_t *lp = isp->isg_luma;
+	unsigned int i, j;
+
+	if (ip != NULL) {
+		for (i = 0; i < isp->isg_nruns; i++) {
+			isr = &isp->isg_runs[i];
+			yp = ip->ip_data[0] + isr->isr_y * ip->ip_linesize[0] +
+			    isr->isr_x;
+			bcopy(yp, lp, isr->isr_n);
+			lp += isr->isr_n;
+		}
+
+		return (0);
+	}
+
+	if (img_materialize(image) != 0)
+		return (-1);
+
+	for (i = 0; i < isp->isg_nruns; i++) {
+		isr = &isp->isg_runs[i];
+		px = img_pixel(image, isr->isr_x, isr->isr_y);
+		for (j = 0; j < isr->isr_n; j++, px++)
+			*lp++ = (77 * px->r + 150 * px->g + 29 * px->b) >> 8;
+	}
+
+	return (0);
+}
+
+/*
+ * Compute the signature of a mask.
+ */
+img_sig_t *
+img_sig(img_t *mask, img_sigtype_t type)
+{
+	img_sig_t *isp;
+	img_sigrun_t *isr;
+	img_pixel_t *px;
+	unsigned int x, y, x0, nruns, nbits;
+	int pass;
+
+	if ((isp = calloc(1, sizeof (*isp))) == NULL)
+		return (NULL);
+
+	isp->isg_type = type;
+
+	/*
+	 * Find the runs of compared pixels in two passes: the first counts them
+	 * so that we can allocate them all at once, and the second fills them in.
+	 */
+	for (pass = 0; pass < 2; pass++) {
+		nruns = 0;
+		for (y = mask->img_miny; y < mask->img_maxy; y++) {
+			x = mask->img_minx;
+			px = img_pixel(mask, x, y);
+			while (x < mask->img_maxx) {
+				if (IMG_IGNORED(px)) {
+					x++;
+					px++;
+					continue;
+				}
+
+				for (x0 = x; x < mask->img_maxx &&
+				    !IMG_IGNORED(px); x++, px++)
+					continue;
+
+				if (pass == 1) {
+					isr = &isp->isg_runs[nruns];
+					isr->isr_x = x0;
+					isr->isr_y = y;
+					isr->isr_n = x - x0;
+					isp->isg_npixels += x - x0;
+				}
+
+				nruns++;
+			}
+		}
+
+		if (pass == 0 && (isp->isg_runs = calloc(nruns + 1,
+		    sizeof (isp->isg_runs[0]))) == NULL) {
+			img_sig_free(isp);
+			return (NULL);
+		}
+	}
+
+	isp->isg_nruns = nruns;
+
+	nbits = 0;
+	if (type & IMG_SIG_LUMA)
+		nbits += isp->isg_npixels;
+	if (type & IMG_SIG_GRAD)
+		nbits += isp->isg_npixels - isp->isg_nruns;
+	isp->isg_nbits = nbits;
+
+	if ((isp->isg_bits = calloc(nbits / 64 + 1,
+	    sizeof (isp->isg_bits[0]))) == NULL ||
+	    (isp->isg_luma = malloc(isp->isg_npixels + 1)) == NULL ||
+	    img_sig_luma(mask, isp) != 0) {
+		img_sig_free(isp);
+		return (NULL);
+	}
+
+	(void) img_sig_bits(isp, isp->isg_luma, isp->isg_bits, NULL);
+	return (isp);
+}
+
+void
+img_sig_free(img_sig_t *isp)
+{
+	if (isp == NULL)
+		return;
+
+	free(isp->isg_runs);
+	free(isp->isg_bits);
+	free(isp->isg_luma);
+	free(isp);
+}
+
+/*
+ * Score an image against a mask's signature: the fraction of signature bits
+ * that differ.  Like img_compare(), 0 is a perfect match.  This uses the
+ * signature's scratch space, so a signature may only be used by one thread at
+ * a time.
+ */
+double
+img_sig_compare(img_t *image, img_sig_t *isp)
+{
+	if (isp->isg_nbits == 0 || img_sig_luma(image, isp) != 0)
+		return (1);
+
+	return ((double)img_sig_bits(isp, isp->isg_luma, NULL,
+	    isp->isg_bits) / isp->isg_nbits);
+}
+
+/*
+ * Like img_compare(), but operates directly on planar YUV data.  To reproduce
+ * img_compare()'s scores, we transform each YUV difference back into an RGB
+ * difference (which weights luma and each chroma component accordingly) rather
+ * than converting the whole frame to RGB first.
+ */
+double
+img_compare_planar(img_planar_t *ip, img_yuvmask_t *ymp)
+{
+	unsigned int i;
+	img_yuvpx_t *yp;
+	double dy, du, dv, dr, dg, db;
+	double sum = 0;
+
+	assert(ip->ip_hshift == ymp->iym_hshift);
+	assert(ip->ip_vshift == ymp->iym_vshift);
+
+	for (i = 0; i < ymp->iym_npixels; i++) {
+		yp = &ymp->iym_pixels[i];
+		dy = ip->ip_data[0][yp->iyp_y * ip->ip_linesize[0] +
+		    yp->iyp_x] - yp->iyp_yuv[0];
+		du = ip->ip_data[1][yp->iyp_cy * ip->ip_linesize[1] +
+		    yp->iyp_cx] - yp->iyp_yuv[1];
+		dv = ip->ip_data[2][yp->iyp_cy * ip->ip_linesize[2] +
+		    yp->iyp_cx] - yp->iyp_yuv[2];
+
+		dr = 1.164 * dy + 1.596 * dv;
+		dg = 1.164 * dy - 0.392 * du - 0.813 * dv;
+		db = 1.164 * dy + 2.017 * du;
+		sum += sqrt(dr * dr + dg * dg + db * db);
+	}
+
+	return ((sum / sqrt(255 * 255 * 3)) / ymp->iym_npixels);
+}
+
+/*
+ * Downsample a region of an image: compute the mean color of each "cell" x
+ * "cell" block of the "cols" x "rows" blocks starting at (x0, y0), storing them
+ * in "rgb" in row-major order.  Blocks are clipped to the image, and a block
+ * entirely outside it is black.  For images backed by planar YUV data, we
+ * average the planes directly and convert the means to RGB, which avoids
+ * converting the frame (and is exact, since the conversion is affine).
+ */
+void
+img_cellmeans(img_t *image, unsigned int x0, unsigned int y0,
+    unsigned int cols, unsigned int rows, unsigned int cell, float (*rgb)[3])
+{
+	img_planar_t *ip = image->img_planar;
+	img_pixel_t *px;
+	const uint8_t *yp, *up, *vp;
+	unsigned int x, y, xs, ys, x1, y1, c, r, w, h;
+	float *sum, my, mu, mv;
+
+	bzero(rgb, cols * rows * sizeof (rgb[0]));
+
+	x1 = MIN(x0 + cols * cell, image->img_x0 + image->img_width);
+	y1 = MIN(y0 + rows * cell, image->img_y0 + image->img_height);
+	xs = MAX(x0, image->img_x0);
+	ys = MAX(y0, image->img_y0);
+
+	for (y = ys; y < y1; y++) {
+		r = (y - y0) / cell;
+		if (ip != NULL) {
+			yp = ip->ip_data[0] + y * ip->ip_linesize[0];
+			up = ip->ip_data[1] + (y >> ip->ip_vshift) *
+			    ip->ip_linesize[1];
+			vp = ip->ip_data[2] + (y >> ip->ip_vshift) *
+			    ip->ip_linesize[2];
+			for (x = xs; x < x1; x++) {
+				sum = rgb[r * cols + (x - x0) / cell];
+				sum[0] += yp[x];
+				sum[1] += up[x >> ip->ip_hshift];
+				sum[2] += vp[x >> ip->ip_hshift];
+			}
+		} else {
+			px = img_pixel(image, xs, y);
+			for (x = xs; x < x1; x++, px++) {
+				sum = rgb[r * cols + (x - x0) / cell];
+				sum[0] += px->r;
+				sum[1] += px->g;
+				sum[2] += px->b;
+			}
+		}
+	}
+
+	for (r = 0; r < rows; r++) {
+		y = MAX(y0 + r * cell, ys);
+		if (y >= y1 || y0 + (r + 1) * cell <= y)
+			continue;
+		h = MIN(y0 + (r + 1) * cell, y1) - y;
+		for (c = 0; c < cols; c++) {
+			x = MAX(x0 + c * cell, xs);
+			if (x >= x1 || x0 + (c + 1) * cell <= x)
+				continue;
+			w = MIN(x0 + (c + 1) * cell, x1) - x;
+			sum = rgb[r * cols + c];
+			sum[0] /= w * h;
+			sum[1] /= w * h;
+			sum[2] /= w * h;
+
+			if (ip == NULL)
+				continue;
+
+			/* See img_compare_planar(). */
+			my = 1.164 * (sum[0] - 16);
+			mu = sum[1] - 128;
+			mv = sum[2] - 128;
+			sum[0] = my + 1.596 * mv;
+			sum[1] = my - 0.392 * mu - 0.813 * mv;
+			sum[2] = my + 2.017 * mu;
+		}
+	}
+}
+
 void
 img_and(img_t *image, img_t *mask)
 {
-	unsigned int x, y, i;
+	unsigned int x, y;
 	img_pixel_t *imgpx, *maskpx;
 
-	assert(image->img_width == mask->img_width);
-	assert(image->img_height == mask->img_height);
+	/* The image may be a view, but the mask must cover it. */
+	assert(image->img_x0 >= mask->img_x0 && image->img_x0 +
+	    image->img_width <= mask->img_x0 + mask->img_width);
+	assert(image->img_y0 >= mask->img_y0 && image->img_y0 +
+	    image->img_height <= mask->img_y0 + mask->img_height);
 
-	for (y = 0; y < image->img_height; y++) {
-		for (x = 0; x < image->img_width; x++) {
-			i = img_coord(image, x, y);
-			maskpx = &mask->img_pixels[i];
-			imgpx = &image->img_pixels[i];
+	if (img_materialize(image) != 0) {
+		warnx("img_and: failed to convert image");
+		return;
+	}
 
+	for (y = image->img_y0; y < image->img_y0 + image->img_height; y++) {
+		maskpx = img_pixel(mask, image->img_x0, y);
+		imgpx = img_pixel(image, image->img_x0, y);
+		for (x = 0; x < image->img_width; x++, maskpx++, imgpx++) {
 			imgpx->r &= maskpx->r;
 			imgpx->g &= maskpx->g;
 			imgpx->b &= maskpx->b;
@@ -470,31 +1885,31 @@ img_translatexy(img_t *image, long dx, long dy)
 {
 	img_t *newimg;
 	img_pixel_t *imgpx, *newpx;
-	unsigned int x, y, i;
-	
-	if ((newimg = calloc(1, sizeof (*newimg))) == NULL ||
-	    (newimg->img_pixels = malloc(image->img_width * image->img_height *
-	    sizeof (newimg->img_pixels[0]))) == NULL) {
-		free(newimg);
+	long x, y, x0, y0, x1, y1;
+
+	if (img_materialize(image) != 0 ||
+	    (newimg = img_alloc_uninit(image->img_width,
+	    image->img_height)) == NULL)
 		return (NULL);
-	}
 
-	newimg->img_width = image->img_width;
-	newimg->img_height = image->img_height;
+	newimg->img_x0 = image->img_x0;
+	newimg->img_y0 = image->img_y0;
+	x0 = image->img_x0;
+	y0 = image->img_y0;
+	x1 = x0 + image->img_width;
+	y1 = y0 + image->img_height;
 
-	for (y = 0; y < newimg->img_height; y++) {
-		for (x = 0; x < newimg->img_width; x++) {
-			i = img_coord(newimg, x, y);
-			newpx = &newimg->img_pixels[i];
+	for (y = y0; y < y1; y++) {
+		for (x = x0; x < x1; x++) {
+			newpx = img_pixel(newimg, x, y);
 
-			if (x - dx < 0 || x - dx >= image->img_width ||
-			    y - dy < 0 || y - dy >= image->img_height) {
+			if (x - dx < x0 || x - dx >= x1 ||
+			    y - dy < y0 || y - dy >= y1) {
 				newpx->r = newpx->g = newpx->b = 0;
 				continue;
 			}
 
-			i = img_coord(image, x - dx, y - dy);
-			imgpx = &image->img_pixels[i];
+			imgpx = img_pixel(image, x - dx, y - dy);
 			newpx->r = imgpx->r;
 			newpx->g = imgpx->g;
 			newpx->b = imgpx->b;
@@ -5,6 +5,7 @@
 #ifndef IMG_H
 #define	IMG_H
 
+#include <stdint.h>
 #include <stdio.h>
 
 #include <png.h>
@@ -23,6 +24,34 @@ typedef struct img_pixelhsv {
 	uint8_t v;
 } img_pixelhsv_t;
 
+struct img;
+
+/*
+ * Planar YUV (Y'CbCr, limited range) image data, as produced by a video
+ * decoder.  Each chroma sample covers (1 << ip_hshift) x (1 << ip_vshift) luma
+ * samples.  Images backed by planar data may not have RGB pixels until
+ * img_materialize() is called, which invokes ip_torgb to convert them.
+ */
+typedef struct img_planar {
+	uint8_t		*ip_data[3];
+	int		ip_linesize[3];
+	unsigned int	ip_hshift;
+	unsigned int	ip_vshift;
+	int		(*ip_torgb)(struct img *, void *);
+	void		*ip_arg;
+} img_planar_t;
+
+/*
+ * Rows of pixels are img_stride bytes apart, which may be more than the width
+ * of the image (e.g., for padded or aligned buffers, or decoder output).  An
+ * image may also be a view of a rectangle within another image (see
+ * img_view()), in which case img_x0 and img_y0 are the coordinates of its
+ * first pixel.  Pixel coordinates (including the bounding box) are always
+ * relative to the original image, so use img_pixel() to find a pixel rather
+ * than indexing img_pixels directly.  PPM images read from regular files point
+ * directly into a private mapping of the file (img_map), which lives as long as
+ * the image does.
+ */
 typedef struct img {
 	unsigned int	img_width;
 	unsigned int	img_height;
@@ -31,17 +60,111 @@ typedef struct img {
 	unsigned int	img_miny;
 	unsigned int	img_maxy;
 	img_pixel_t	*img_pixels;
+	img_planar_t	*img_planar;	/* planar source data, if any */
+	size_t		img_stride;	/* bytes from one row to the next */
+	unsigned int	img_x0;		/* coordinates of first pixel */
+	unsigned int	img_y0;
+	boolean_t	img_isview;	/* pixels belong to another image */
+	void		*img_map;	/* file mapping holding the pixels */
+	size_t		img_maplen;
 } img_t;
 
+#define	IMG_ALIGN	64		/* row alignment for img_alloc() */
+
+/*
+ * A mask converted to YUV for comparison against planar images.  Only the
+ * pixels that img_compare() would look at are included.
+ */
+typedef struct img_yuvpx {
+	unsigned short	iyp_x;		/* luma coordinates */
+	unsigned short	iyp_y;
+	unsigned short	iyp_cx;		/* chroma coordinates */
+	unsigned short	iyp_cy;
+	float		iyp_yuv[3];	/* mask value */
+} img_yuvpx_t;
+
+typedef struct img_yuvmask {
+	unsigned int	iym_hshift;	/* chroma subsampling */
+	unsigned int	iym_vshift;
+	unsigned int	iym_npixels;
+	img_yuvpx_t	*iym_pixels;
+} img_yuvmask_t;
+
+/*
+ * A binary signature of a mask for matching with img_sig_compare().  The
+ * signature covers the mask's compared (non-black) pixels, which we store as
+ * runs of consecutive pixels within a row.  IMG_SIG_LUMA contributes one bit per
+ * pixel (whether its luma is above the average over all the pixels) and
+ * IMG_SIG_GRAD one bit per pair of horizontally adjacent pixels within a run
+ * (whether luma increases from left to right).  Both are insensitive to the
+ * overall brightness of the frame.
+ */
+typedef enum {
+	IMG_SIG_LUMA = 0x1,
+	IMG_SIG_GRAD = 0x2,
+	IMG_SIG_BOTH = IMG_SIG_LUMA | IMG_SIG_GRAD,
+} img_sigtype_t;
+
+typedef struct img_sigrun {
+	unsigned short	isr_x;		/* first pixel */
+	unsigned short	isr_y;
+	unsigned short	isr_n;		/* number of pixels */
+} img_sigrun_t;
+
+typedef struct img_sig {
+	img_sigtype_t	isg_type;
+	unsigned int	isg_nruns;
+	img_sigrun_t	*isg_runs;
+	unsigned int	isg_npixels;
+	unsigned int	isg_nbits;
+	uint64_t	*isg_bits;	/* the mask's signature */
+	uint8_t		*isg_luma;	/* scratch space for frame luma */
+} img_sig_t;
+
+img_t *img_alloc(unsigned int, unsigned int);
+img_t *img_alloc_uninit(unsigned int, unsigned int);
+void img_pool_report(FILE *);
+img_t *img_copy(img_t *, img_t *);
+img_t *img_view(img_t *, unsigned int, unsigned int, unsigned int,
+    unsigned int);
+img_t *img_field(img_t *, unsigned int);
 img_t *img_read(const char *);
+img_t *img_read_reuse(const char *, img_t *);
 img_t *img_translatexy(img_t *, long, long);
+void img_relocate(img_t *, unsigned int, unsigned int);
+img_t *img_rescale(img_t *, long, long, unsigned int, unsigned int,
+    unsigned int, unsigned int);
 int img_write(img_t *, const char *);
 int img_write_ppm(img_t *, FILE *);
 int img_write_png(img_t *, FILE *);
+
+typedef struct img_writer img_writer_t;
+img_writer_t *img_writer_init(int, int, int);
+int img_writer_submit(img_writer_t *, img_t *, const char *);
+void img_writer_fini(img_writer_t *);
+
+typedef struct img_prefetch img_prefetch_t;
+img_prefetch_t *img_prefetch_init(char **, int, int, int);
+img_t *img_prefetch_next(img_prefetch_t *);
+void img_prefetch_release(img_prefetch_t *, img_t *);
+void img_prefetch_fini(img_prefetch_t *);
 void img_free(img_t *);
-#define	img_coord(image, x, y)	((x) + (image)->img_width * (y))
+#define	img_pixel(image, x, y)	\
+	((img_pixel_t *)((uint8_t *)(image)->img_pixels +		\
+	((y) - (image)->img_y0) * (image)->img_stride) + ((x) - (image)->img_x0))
 double img_compare(img_t *, img_t *, img_t **);
 void img_and(img_t *, img_t *);
+int img_materialize(img_t *);
+
+img_yuvmask_t *img_yuvmask(img_t *, unsigned int, unsigned int);
+void img_yuvmask_free(img_yuvmask_t *);
+double img_compare_planar(img_planar_t *, img_yuvmask_t *);
+void img_cellmeans(img_t *, unsigned int, unsigned int, unsigned int,
+    unsigned int, unsigned int, float (*)[3]);
+
+img_sig_t *img_sig(img_t *, img_sigtype_t);
+void img_sig_free(img_sig_t *);
+double img_sig_compare(img_t *, img_sig_t *);
 
 void img_pix_rgb2hsv(img_pixelhsv_t *, img_pixel_t *);
 
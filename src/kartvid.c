@@ -5,10 +5,12 @@
 #include <dirent.h>
 #include <err.h>
 #include <libgen.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 
 #include <png.h>
@@ -22,6 +24,7 @@ static void usage(const char *);
 static int cmd_and(int, char *[]);
 static int cmd_compare(int, char *[]);
 static int cmd_translatexy(int, char *[]);
+static int cmd_genkernels(int, char *[]);
 static int cmd_ident(int, char *[]);
 static int cmd_frames(int, char *[]);
 static int cmd_decode(int, char *[]);
@@ -33,8 +36,15 @@ static int check_start_frame(video_frame_t *, void *);
 static int cmd_rgb2hsv(int, char *[]);
 static int cmd_exportitems(int, char *[]);
 static int check_items(video_frame_t *, void *);
+static int cmd_recorder(int, char *[]);
 
-#define	MAX_FRAMES	16384
+/*
+ * "frames" reads images ahead of identification with a pool of this many
+ * threads by default, keeping at most FRAMES_READAHEAD frames in memory.
+ */
+#define	FRAMES_NREADERS		2
+#define	FRAMES_MAXREADERS	16
+#define	FRAMES_READAHEAD	16
 
 typedef struct {
 	const char 	 *kvc_name;
@@ -48,21 +58,31 @@ static kv_cmd_t kv_commands[] = {
       "logical-and pixel values of two images" },
     { "compare", cmd_compare, "[-s debugfile] image mask",
       "compute difference score for the given image and mask" },
-    { "decode", cmd_decode, "input output-dir",
+    { "decode", cmd_decode, "[-T] [-b bufsize] [-t threads] input output-dir",
       "decode a video into its constituent PPM images" },
     { "translatexy", cmd_translatexy, "input output x-offset y-offset",
       "shift the given image using the given x and y offsets" },
     { "ident", cmd_ident, "image",
       "report the current game state for the given image" },
-    { "frames", cmd_frames, "[-ij] dir_of_image_files", 
+    { "frames", cmd_frames, "[-cFij] [-E engines] [-e engines] [-g geometry] "
+      "[-M maskcache] [-n batch] [-R recorddir] [-s stride] [-t threads] "
+      "dir_of_image_files",
       "emit race events for a sequence of video frames" },
     { "rgb2hsv", cmd_rgb2hsv, "r g b", "convert rgb value to hsv" },
-    { "video", cmd_video, "[-ij] [-d debugdir] video_file",
+    { "genkernels", cmd_genkernels, "",
+      "emit C source for compiled mask kernels on stdout" },
+    { "video", cmd_video, "[-cFijLrTy] [-b bufsize] [-C clipdir] [-d debugdir] "
+      "[-E engines] [-e engines] [-g geometry] [-M maskcache] "
+      "[-R recorddir] [-S statsfile] [-s stride] [-t threads] [-w writers] "
+      "video_file",
       "emit race events for an entire video" },
-    { "starts", cmd_starts, "video_file",
+    { "starts", cmd_starts, "[-LTy] [-b bufsize] [-t threads] video_file",
       "only scan for \"race start\" events and emit them on stdout" },
-    { "exportitems", cmd_exportitems, "[-d dir] video_file",
+    { "exportitems", cmd_exportitems,
+      "[-T] [-b bufsize] [-d dir] [-t threads] video_file",
       "export all frames in a video with an item box" },
+    { "recorder", cmd_recorder, "dump_file ...",
+      "print the contents of flight recorder dumps (see -R)" },
 };
 
 static int kv_ncommands = sizeof (kv_commands) / sizeof (kv_commands[0]);
@@ -114,6 +134,11 @@ main(int argc, char *argv[])
 	if (status == EXIT_USAGE)
 		usage(NULL);
 
+	if (kv_debug > 0) {
+		img_pool_report(stderr);
+		kv_groups_report(stderr);
+	}
+
 	return (status);
 }
 
@@ -162,6 +187,75 @@ check_debugdir(const char *dbgdir)
 	return (0);
 }
 
+static void
+recorder_signal(int sig)
+{
+	kv_recorder_request();
+}
+
+/*
+ * Handle "-R": record identification decisions, dumping them into "dir" after
+ * anomalies and whenever we get SIGUSR1.
+ */
+static int
+start_recorder(kv_vidctx_t *kvp, const char *dir)
+{
+	if (kv_vidctx_recorder(kvp, dir) != 0) {
+		warnx("recorder directory name too long");
+		return (-1);
+	}
+
+	(void) signal(SIGUSR1, recorder_signal);
+	return (0);
+}
+
+/*
+ * Parse the argument to "-s": identify only every Nth frame while the game
+ * state is stable.
+ */
+static int
+parse_stride(const char *arg, int *stridep)
+{
+	char *q;
+	long stride;
+
+	stride = strtol(arg, &q, 0);
+	if (*q != '\0' || stride < 1 || stride > 16) {
+		warnx("stride must be an integer between 1 and 16");
+		return (-1);
+	}
+
+	*stridep = (int)stride;
+	return (0);
+}
+
+/*
+ * Parse the argument to "-w": "N[:level]" configures N threads for writing
+ * debug images (0 to write them synchronously) and the PNG compression level
+ * (0-9).
+ */
+static int
+parse_writers(const char *arg, int *nwritersp, int *levelp)
+{
+	char *q;
+	long nwriters, level = -1;
+
+	nwriters = strtol(arg, &q, 10);
+	if (q != arg && *q == ':')
+		level = strtol(q + 1, &q, 10);
+
+	if (q == arg || *q != '\0' || nwriters < 0 || nwriters > 16 ||
+	    level < -1 || level > 9) {
+		warnx("writers must be \"N[:level]\" with N between 0 and 16 "
+		    "and level between 0 and 9");
+		return (-1);
+	}
+
+	*nwritersp = (int)nwriters;
+	*levelp = (int)level;
+	return (0);
+}
+
 /*
  * compare image mask: compute a difference score for the given image and mask.
  */
@@ -319,6 +413,24 @@ cmd_ident(int argc, char *argv[])
 	return (EXIT_SUCCESS);
 }
 
+/*
+ * genkernels: emit C source for kernels specialized to the current masks.  The
+ * build compiles the output into kartvid (see kv_kernels_generate()).
+ */
+static int
+cmd_genkernels(int argc, char *argv[])
+{
+	if (kv_init(dirname((char *)kv_arg0)) != 0) {
+		warnx("failed to initialize masks");
+		return (EXIT_FAILURE);
+	}
+
+	if (kv_kernels_generate(stdout) != 0)
+		return (EXIT_FAILURE);
+
+	return (EXIT_SUCCESS);
+}
+
 static int
 qsort_strcmp(const void *vs1, const void *vs2)
 {
@@ -333,19 +445,58 @@ cmd_frames(int argc, char *argv[])
 {
 	DIR *dirp;
 	struct dirent *entp;
-	int nframes, rv, i, len;
+	int nframes, maxframes, rv, i, j, n, len;
 	kv_emit_f emit;
 	char c;
-	char *q;
+	char *q, **qq;
 	img_t *image;
+	img_prefetch_t *ipp;
 	kv_vidctx_t *kvp;
 	kv_flags_t flags = KVF_NONE;
-	char *framenames[MAX_FRAMES];
+	int stride = 1;
+	long nreaders = FRAMES_NREADERS;
+	long nbatch = 1;
+	char **framenames = NULL;
+	const char *bnames[KV_MAXBATCH];
+	int bframes[KV_MAXBATCH], btimes[KV_MAXBATCH];
+	img_t *bimages[KV_MAXBATCH], *bfull[KV_MAXBATCH];
+	kv_capgeom_t geom, *geomp = NULL;
+	const char *maskcache = NULL;
+	const char *recorddir = NULL;
+	const char *compare = NULL;
+	boolean_t fields = B_FALSE;
 
 	emit = kv_screen_print;
 
-	while ((c = getopt(argc, argv, "ij")) != -1) {
+	while ((c = getopt(argc, argv, "cE:e:Fg:ijM:n:R:s:t:")) != -1) {
 		switch (c) {
+		case 'c':
+			flags |= KVF_SCENES;
+			break;
+
+		case 'F':
+			fields = B_TRUE;
+			break;
+
+		case 'E':
+			compare = optarg;
+			break;
+
+		case 'e':
+			if (kv_engines(optarg) != 0)
+				return (EXIT_USAGE);
+			break;
+
+		case 'g':
+			if (kv_capgeom_parse(optarg, &geom) != 0)
+				return (EXIT_USAGE);
+			geomp = &geom;
+			break;
+
+		case 'M':
+			maskcache = optarg;
+			break;
+
 		case 'i':
 			flags |= KVF_COMPARE_ITEMSTATE;
 			break;
@@ -354,6 +505,35 @@ cmd_frames(int argc, char *argv[])
 			emit = kv_screen_json;
 			break;
 
+		case 'R':
+			recorddir = optarg;
+			break;
+
+		case 'n':
+			nbatch = strtol(optarg, &q, 10);
+			if (q == optarg || *q != '\0' || nbatch < 1 ||
+			    nbatch > KV_MAXBATCH) {
+				warnx("batch must be between 1 and %d",
+				    KV_MAXBATCH);
+				return (EXIT_USAGE);
+			}
+			break;
+
+		case 's':
+			if (parse_stride(optarg, &stride) != 0)
+				return (EXIT_USAGE);
+			break;
+
+		case 't':
+			nreaders = strtol(optarg, &q, 10);
+			if (q == optarg || *q != '\0' || nreaders < 0 ||
+			    nreaders > FRAMES_MAXREADERS) {
+				warnx("threads must be between 0 and %d",
+				    FRAMES_MAXREADERS);
+				return (EXIT_USAGE);
+			}
+			break;
+
 		case '?':
 		default:
 			return (EXIT_USAGE);
@@ -368,31 +548,64 @@ cmd_frames(int argc, char *argv[])
 		return (EXIT_USAGE);
 	}
 
+	if (recorddir != NULL && check_debugdir(recorddir) != 0)
+		return (EXIT_USAGE);
+
 	if ((kvp = kv_vidctx_init(dirname((char *)kv_arg0), emit, NULL,
 	    flags)) == NULL)
 		return (EXIT_FAILURE);
 
+	if (recorddir != NULL && start_recorder(kvp, recorddir) != 0) {
+		kv_vidctx_free(kvp);
+		return (EXIT_USAGE);
+	}
+
+	(void) kv_vidctx_stride(kvp, stride);
+	if (fields)
+		kv_vidctx_field(kvp);
+	if (kv_vidctx_geometry(kvp, geomp, maskcache) != 0) {
+		warnx("mask cache directory name too long");
+		kv_vidctx_free(kvp);
+		return (EXIT_USAGE);
+	}
+
+	if (compare != NULL && kv_vidctx_compare(kvp, compare) != 0) {
+		kv_vidctx_free(kvp);
+		return (EXIT_USAGE);
+	}
+
 	if ((dirp = opendir(argv[0])) == NULL) {
 		kv_vidctx_free(kvp);
 		warn("failed to opendir %s", argv[0]);
 		return (EXIT_USAGE);
 	}
 
+	/*
+	 * Frames are processed in name order, so we need the whole listing
+	 * before we can start, but there's no limit on its size.
+	 */
 	nframes = 0;
+	maxframes = 0;
 	rv = EXIT_FAILURE;
 	while ((entp = readdir(dirp)) != NULL) {
-		if (nframes >= MAX_FRAMES) {
-			warnx("max %d frames supported", MAX_FRAMES);
-			break;
-		}
-
-		if (strcmp(entp->d_name, ".") == 0 ||
-		    strcmp(entp->d_name, "..") == 0)
+		len = strlen(entp->d_name);
+		if (len < sizeof (".png") ||
+		    (strcmp(entp->d_name + len - sizeof (".png") + 1,
+		    ".png") != 0 &&
+		    strcmp(entp->d_name + len - sizeof (".ppm") + 1,
+		    ".ppm") != 0))
 			continue;
 
-		if (strcmp(entp->d_name + strlen(entp->d_name) -
-		    sizeof (".png") + 1, ".png") != 0)
-			continue;
+		if (nframes == maxframes) {
+			maxframes = maxframes == 0 ? 1024 : maxframes * 2;
+			if ((qq = realloc(framenames,
+			    maxframes * sizeof (framenames[0]))) == NULL) {
+				warn("realloc");
+				break;
+			}
+
+			framenames = qq;
+		}
 
 		len = snprintf(NULL, 0, "%s/%s", argv[0], entp->d_name);
 		if ((q = malloc(len + 1)) == NULL) {
@@ -409,27 +622,58 @@ cmd_frames(int argc, char *argv[])
 	if (entp != NULL)
 		goto out;
 
-	rv = EXIT_SUCCESS;
 	qsort(framenames, nframes, sizeof (framenames[0]), qsort_strcmp);
 
-	for (i = 0; i < nframes; i++) {
-		image = img_read(framenames[i]);
+	if ((ipp = img_prefetch_init(framenames, nframes, (int)nreaders,
+	    FRAMES_READAHEAD + (int)nbatch)) == NULL)
+		goto out;
 
-		if (image == NULL) {
-			warnx("failed to read %s", argv[i]);
-			continue;
+	/*
+	 * With -n, frames are identified in batches (see kv_vidctx_frames()).
+	 * With -F, only the second field of each frame is identified.
+	 */
+	rv = EXIT_SUCCESS;
+	for (i = 0; i < nframes; i = j) {
+		for (n = 0, j = i; j < nframes && n < nbatch; j++) {
+			image = img_prefetch_next(ipp);
+
+			if (image == NULL) {
+				warnx("failed to read %s", framenames[j]);
+				img_prefetch_release(ipp, NULL);
+				continue;
+			}
+
+			bfull[n] = image;
+			if (fields && (image = img_field(image, 1)) == NULL) {
+				warnx("failed to read field of %s",
+				    framenames[j]);
+				img_prefetch_release(ipp, bfull[n]);
+				continue;
+			}
+
+			bnames[n] = framenames[j];
+			bframes[n] = j;
+			btimes[n] = j / KV_FRAMERATE * MILLISEC;
+			bimages[n++] = image;
 		}
 
-		kv_vidctx_frame(framenames[i], i,
-		    i / KV_FRAMERATE * MILLISEC, image, kvp);
-		img_free(image);
+		kv_vidctx_frames(bnames, bframes, btimes, bimages, n, kvp);
+
+		for (n--; n >= 0; n--) {
+			if (fields)
+				img_free(bimages[n]);
+			img_prefetch_release(ipp, bfull[n]);
+		}
 	}
 
+	img_prefetch_fini(ipp);
+
 out:
 	kv_vidctx_free(kvp);
 
 	for (i = 0; i < nframes; i++)
 		free(framenames[i]);
+	free(framenames);
 
 	return (rv);
 }
@@ -438,17 +682,49 @@ static int
 cmd_decode(int argc, char *argv[])
 {
 	video_t *vp;
+	video_opts_t opts;
+	boolean_t timing = B_FALSE;
 	int rv;
+	char c;
+
+	bzero(&opts, sizeof (opts));
+
+	while ((c = getopt(argc, argv, "b:Tt:")) != -1) {
+		switch (c) {
+		case 'b':
+			if (video_parse_bufsize(optarg, &opts) != 0)
+				return (EXIT_USAGE);
+			break;
+
+		case 'T':
+			timing = B_TRUE;
+			break;
+
+		case 't':
+			if (video_parse_threads(optarg, &opts) != 0)
+				return (EXIT_USAGE);
+			break;
+
+		case '?':
+		default:
+			return (EXIT_USAGE);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
 
 	if (argc < 2) {
 		warnx("missing input file or output directory");
 		return (EXIT_USAGE);
 	}
 
-	if ((vp = video_open(argv[0])) == NULL)
+	if ((vp = video_open(argv[0], &opts)) == NULL)
 		return (EXIT_FAILURE);
 
 	rv = video_iter_frames(vp, write_frame, argv[1]);
+	if (timing)
+		video_report(vp, stderr);
 	video_free(vp);
 	return (rv);
 }
@@ -469,25 +745,233 @@ write_frame(video_frame_t *vfp, void *rawarg)
 	return (EXIT_SUCCESS);
 }
 
+typedef struct {
+	kv_vidctx_t	*vi_kvp;
+	boolean_t	vi_lowdemand;	/* reduce decoding work between races */
+	video_clipper_t	*vi_clipper;	/* race clips (-C) */
+	video_t		*vi_vp;
+	const char	*vi_statsfile;	/* progress file (-S) */
+	hrtime_t	vi_start;	/* when we started processing */
+	hrtime_t	vi_statsnext;	/* when to next write vi_statsfile */
+} vidident_t;
+
+static const char *stats_stages[] = {
+	"decode",		/* VS_DECODE */
+	"convert",		/* VS_CONVERT */
+	"identify",		/* VS_CONSUME */
+};
+
+/*
+ * With -S, we rewrite a JSON summary of our progress every STATS_INTERVAL_MS
+ * (and once more when we're done) so that whatever's running us can watch for
+ * stalls and slow machines.  The file is written under a temporary name and
+ * renamed into place, so readers always see a complete summary.
+ */
+#define	STATS_INTERVAL_MS	1000
+#define	STATS_TMPSUFFIX		".tmp"
+
+static void
+write_stats_hist(FILE *fp, uint32_t *hist)
+{
+	int i;
+	boolean_t first = B_TRUE;
+
+	(void) fprintf(fp, "{ ");
+	for (i = 0; i < VIDEO_NBUCKETS; i++) {
+		if (hist[i] == 0)
+			continue;
+
+		if (i == VIDEO_NBUCKETS - 1)
+			(void) fprintf(fp, "%s\"+Inf\": %u", first ? "" : ", ",
+			    hist[i]);
+		else
+			(void) fprintf(fp, "%s\"%lu\": %u", first ? "" : ", ",
+			    1UL << i, hist[i]);
+		first = B_FALSE;
+	}
+	(void) fprintf(fp, " }");
+}
+
+static void
+write_stats(vidident_t *vip, boolean_t done)
+{
+	video_stats_t vs;
+	char tmpfile[PATH_MAX];
+	FILE *fp;
+	hrtime_t now;
+	double elapsed, rate;
+	int i;
+
+	now = gethrtime();
+	vip->vi_statsnext = now + STATS_INTERVAL_MS * (NANOSEC / MILLISEC);
+	video_stats(vip->vi_vp, &vs);
+	elapsed = (double)(now - vip->vi_start) / NANOSEC;
+
+	if (snprintf(tmpfile, sizeof (tmpfile), "%s%s", vip->vi_statsfile,
+	    STATS_TMPSUFFIX) >= sizeof (tmpfile)) {
+		warnx("stats file name too long: %s", vip->vi_statsfile);
+		goto err;
+	}
+
+	if ((fp = fopen(tmpfile, "w")) == NULL) {
+		warn("fopen %s", tmpfile);
+		goto err;
+	}
+
+	(void) fprintf(fp, "{ \"done\": %s, \"updated\": %ld, "
+	    "\"elapsed\": %.3f,\n", done ? "true" : "false", (long)time(NULL),
+	    elapsed);
+	(void) fprintf(fp, "  \"position\": { \"frame\": %d, \"nframes\": %d, "
+	    "\"ms\": %.0f, \"bytes\": %llu, \"size\": %llu },\n",
+	    vs.vs_framenum, vs.vs_nframes, vs.vs_frametime,
+	    (unsigned long long)vs.vs_offset, (unsigned long long)vs.vs_size);
+
+	/*
+	 * Throughput is measured in video frames (including frames the decoder
+	 * skipped) rather than frames decoded, and the ETA is based on the
+	 * estimated number of frames or, failing that, the input size.
+	 */
+	rate = elapsed > 0 ? vs.vs_framenum / elapsed : 0;
+	(void) fprintf(fp, "  \"throughput\": { \"fps\": %.2f, "
+	    "\"speed\": %.3f, \"bytesps\": %.0f },\n", rate,
+	    elapsed > 0 ? vs.vs_frametime / MILLISEC / elapsed : 0,
+	    elapsed > 0 ? vs.vs_offset / elapsed : 0);
+
+	if (done)
+		(void) fprintf(fp, "  \"eta\": 0,\n");
+	else if (vs.vs_nframes > vs.vs_framenum && rate > 0)
+		(void) fprintf(fp, "  \"eta\": %.0f,\n",
+		    (vs.vs_nframes - vs.vs_framenum) / rate);
+	else if (vs.vs_size > vs.vs_offset && vs.vs_offset > 0)
+		(void) fprintf(fp, "  \"eta\": %.0f,\n",
+		    (vs.vs_size - vs.vs_offset) * elapsed / vs.vs_offset);
+	else
+		(void) fprintf(fp, "  \"eta\": null,\n");
+
+	(void) fprintf(fp, "  \"video\": { \"decoded\": %d", vs.vs_ndecoded);
+	for (i = 0; i < VS_NSTAGES; i++) {
+		(void) fprintf(fp, ",\n    \"%s\": { \"ms\": %.3f, \"us\": ",
+		    stats_stages[i], (double)vs.vs_time[i] / MICROSEC);
+		write_stats_hist(fp, vs.vs_hist[i]);
+		(void) fprintf(fp, " }");
+	}
+	(void) fprintf(fp, " },\n  \"ident\": ");
+	kv_vidctx_stats(vip->vi_kvp, fp);
+	(void) fprintf(fp, "\n}\n");
+
+	if (ferror(fp) != 0) {
+		warnx("failed to write %s", tmpfile);
+		(void) fclose(fp);
+		goto err;
+	}
+
+	if (fclose(fp) != 0) {
+		warn("fclose %s", tmpfile);
+		goto err;
+	}
+
+	if (rename(tmpfile, vip->vi_statsfile) != 0) {
+		warn("rename %s", tmpfile);
+		goto err;
+	}
+
+	return;
+
+err:
+	warnx("no longer writing %s", vip->vi_statsfile);
+	vip->vi_statsfile = NULL;
+}
+
+/*
+ * With -C, we encode a clip of each race (plus some lead-in and tail, as
+ * jobs/video-webm does) while we're identifying frames.  Clips start and end
+ * with the events we emit, so the emitter is wrapped to tell the clipper.
+ */
+#define	CLIP_LEADMS	10000
+#define	CLIP_TAILMS	10000
+
+static video_clipper_t *clip_clipper;
+static kv_emit_f clip_emit;
+
+static void
+emit_clips(const char *framename, int i, int timems, kv_screen_t *ksp,
+    kv_screen_t *raceksp, FILE *fp)
+{
+	clip_emit(framename, i, timems, ksp, raceksp, fp);
+
+	if (ksp->ks_events & KVE_RACE_START)
+		(void) video_clipper_start(clip_clipper, timems);
+	if (ksp->ks_events & KVE_RACE_DONE)
+		video_clipper_end(clip_clipper, timems);
+}
+
 static int
 cmd_video(int argc, char *argv[])
 {
+	vidident_t vi;
 	kv_vidctx_t *kvp;
 	video_t *vp;
 	int rv;
 	char c;
 	const char *dbgdir = NULL;
+	const char *clipdir = NULL;
 	kv_emit_f emit;
 	kv_flags_t flags = KVF_NONE;
+	int stride = 1;
+	int nwriters = 2, pnglevel = -1;
+	boolean_t planar = B_FALSE;
+	boolean_t timing = B_FALSE;
+	boolean_t fields = B_FALSE;
+	video_opts_t opts;
+	kv_capgeom_t geom, *geomp = NULL;
+	const char *maskcache = NULL;
+	const char *recorddir = NULL;
+	const char *statsfile = NULL;
+	const char *compare = NULL;
 
 	emit = kv_screen_print;
+	bzero(&vi, sizeof (vi));
+	bzero(&opts, sizeof (opts));
 
-	while ((c = getopt(argc, argv, "d:ij")) != -1) {
+	while ((c = getopt(argc, argv,
+	    "b:C:cd:E:e:Fg:ijLM:R:rS:s:Tt:w:y")) != -1) {
 		switch (c) {
+		case 'b':
+			if (video_parse_bufsize(optarg, &opts) != 0)
+				return (EXIT_USAGE);
+			break;
+
+		case 'C':
+			clipdir = optarg;
+			break;
+
+		case 'c':
+			flags |= KVF_SCENES;
+			break;
+
 		case 'd':
 			dbgdir = optarg;
 			break;
 
+		case 'E':
+			compare = optarg;
+			break;
+
+		case 'e':
+			if (kv_engines(optarg) != 0)
+				return (EXIT_USAGE);
+			break;
+
+		case 'F':
+			fields = B_TRUE;
+			break;
+
+		case 'g':
+			if (kv_capgeom_parse(optarg, &geom) != 0)
+				return (EXIT_USAGE);
+			geomp = &geom;
+			break;
+
 		case 'i':
 			flags |= KVF_COMPARE_ITEMSTATE;
 			break;
@@ -496,6 +980,49 @@ cmd_video(int argc, char *argv[])
 			emit = kv_screen_json;
 			break;
 
+		case 'L':
+			vi.vi_lowdemand = B_TRUE;
+			break;
+
+		case 'M':
+			maskcache = optarg;
+			break;
+
+		case 'R':
+			recorddir = optarg;
+			break;
+
+		case 'r':
+			flags |= KVF_REALTIME;
+			break;
+
+		case 'S':
+			statsfile = optarg;
+			break;
+
+		case 's':
+			if (parse_stride(optarg, &stride) != 0)
+				return (EXIT_USAGE);
+			break;
+
+		case 'T':
+			timing = B_TRUE;
+			break;
+
+		case 't':
+			if (video_parse_threads(optarg, &opts) != 0)
+				return (EXIT_USAGE);
+			break;
+
+		case 'w':
+			if (parse_writers(optarg, &nwriters, &pnglevel) != 0)
+				return (EXIT_USAGE);
+			break;
+
+		case 'y':
+			planar = B_TRUE;
+			break;
+
 		case '?':
 		default:
 			return (EXIT_USAGE);
@@ -513,25 +1040,103 @@ cmd_video(int argc, char *argv[])
 	if (dbgdir != NULL && check_debugdir(dbgdir) != 0)
 		return (EXIT_USAGE);
 
-	if ((vp = video_open(argv[0])) == NULL)
+	if (clipdir != NULL && check_debugdir(clipdir) != 0)
+		return (EXIT_USAGE);
+
+	if (recorddir != NULL && check_debugdir(recorddir) != 0)
+		return (EXIT_USAGE);
+
+	if (statsfile != NULL &&
+	    strlen(statsfile) + sizeof (STATS_TMPSUFFIX) > PATH_MAX) {
+		warnx("stats file name too long: %s", statsfile);
+		return (EXIT_USAGE);
+	}
+
+	/* Clips need every frame, including those between races. */
+	if (clipdir != NULL && vi.vi_lowdemand) {
+		warnx("ignoring -L because -C was specified");
+		vi.vi_lowdemand = B_FALSE;
+	}
+
+	if ((vp = video_open(argv[0], &opts)) == NULL)
 		return (EXIT_FAILURE);
 
+	if (planar && video_planar(vp) != 0) {
+		video_free(vp);
+		return (EXIT_FAILURE);
+	}
+
+	if (fields)
+		video_field(vp);
+
 	if (kv_debug > 0)
 		(void) fprintf(stderr, "framerate: %lf\n",
 		    video_framerate(vp));
 
+	if (clipdir != NULL) {
+		if ((vi.vi_clipper = video_clipper_init(vp, clipdir,
+		    CLIP_LEADMS, CLIP_TAILMS)) == NULL) {
+			video_free(vp);
+			return (EXIT_FAILURE);
+		}
+
+		clip_clipper = vi.vi_clipper;
+		clip_emit = emit;
+		emit = emit_clips;
+	}
+
 	if ((kvp = kv_vidctx_init(dirname((char *)kv_arg0), emit,
 	    dbgdir, flags)) == NULL) {
+		if (vi.vi_clipper != NULL)
+			video_clipper_fini(vi.vi_clipper);
 		video_free(vp);
 		return (EXIT_FAILURE);
 	}
 
-	if (emit == kv_screen_json)
+	(void) kv_vidctx_stride(kvp, stride);
+	(void) kv_vidctx_writers(kvp, nwriters, pnglevel);
+	if (fields)
+		kv_vidctx_field(kvp);
+	if (recorddir != NULL && start_recorder(kvp, recorddir) != 0) {
+		kv_vidctx_free(kvp);
+		if (vi.vi_clipper != NULL)
+			video_clipper_fini(vi.vi_clipper);
+		video_free(vp);
+		return (EXIT_USAGE);
+	}
+	if (kv_vidctx_geometry(kvp, geomp, maskcache) != 0) {
+		warnx("mask cache directory name too long");
+		kv_vidctx_free(kvp);
+		if (vi.vi_clipper != NULL)
+			video_clipper_fini(vi.vi_clipper);
+		video_free(vp);
+		return (EXIT_USAGE);
+	}
+
+	if (compare != NULL && kv_vidctx_compare(kvp, compare) != 0) {
+		kv_vidctx_free(kvp);
+		if (vi.vi_clipper != NULL)
+			video_clipper_fini(vi.vi_clipper);
+		video_free(vp);
+		return (EXIT_USAGE);
+	}
+
+	if (emit == kv_screen_json || clip_emit == kv_screen_json)
 		(void) printf("{ \"nframes\": %d, \"crtime\": \"%s\" }\n",
 		    video_nframes(vp), video_crtime(vp));
 
-	rv = video_iter_frames(vp, ident_frame, kvp);
+	vi.vi_kvp = kvp;
+	vi.vi_vp = vp;
+	vi.vi_statsfile = statsfile;
+	vi.vi_start = gethrtime();
+	rv = video_iter_frames(vp, ident_frame, &vi);
+	if (vi.vi_statsfile != NULL)
+		write_stats(&vi, B_TRUE);
 	kv_vidctx_free(kvp);
+	if (vi.vi_clipper != NULL)
+		video_clipper_fini(vi.vi_clipper);
+	if (timing)
+		video_report(vp, stderr);
 	video_free(vp);
 	return (rv);
 }
@@ -539,13 +1144,35 @@ cmd_video(int argc, char *argv[])
 static int
 ident_frame(video_frame_t *vp, void *rawarg)
 {
-	kv_vidctx_t *kvp = rawarg;
+	vidident_t *vip = rawarg;
+	kv_vidctx_t *kvp = vip->vi_kvp;
 	char framename[16];
 
+	/*
+	 * The clipper has to see each frame before it's identified so that
+	 * it's available if this frame starts a race.
+	 */
+	if (vip->vi_clipper != NULL)
+		(void) video_clipper_frame(vip->vi_clipper, vp);
+
 	(void) snprintf(framename, sizeof (framename),
 	    "frame %d", vp->vf_framenum);
 	kv_vidctx_frame(framename, vp->vf_framenum, (int)vp->vf_frametime,
 	    &vp->vf_image, kvp);
+
+	if (vip->vi_statsfile != NULL && gethrtime() >= vip->vi_statsnext)
+		write_stats(vip, B_FALSE);
+
+	/*
+	 * Between races we're only looking for the next start screen, so we
+	 * can get away with cheaper decoding.  As soon as a race starts, we go
+	 * back to full fidelity.  The start may be seen a few frames late, and
+	 * kv_vidctx_chars() has fewer frames to pick characters from (see the
+	 * README).
+	 */
+	if (vip->vi_lowdemand)
+		vp->vf_demand = kv_vidctx_racing(kvp) ? VD_FULL : VD_REDUCED;
+
 	return (0);
 }
 
@@ -570,11 +1197,59 @@ cmd_rgb2hsv(int argc, char *argv[])
 	return (EXIT_SUCCESS);
 }
 
+typedef struct {
+	int		ss_last;	/* time of last start (msec) */
+	boolean_t	ss_lowdemand;	/* only decode what we need */
+	unsigned int	ss_miny;	/* first row of start masks */
+	unsigned int	ss_maxy;	/* last row of start masks */
+} startscan_t;
+
 static int
 cmd_starts(int argc, char *argv[])
 {
 	video_t *vp;
-	int rv, last;
+	int rv;
+	char c;
+	startscan_t ss;
+	boolean_t planar = B_FALSE;
+	boolean_t timing = B_FALSE;
+	video_opts_t opts;
+
+	bzero(&ss, sizeof (ss));
+	bzero(&opts, sizeof (opts));
+
+	while ((c = getopt(argc, argv, "b:LTt:y")) != -1) {
+		switch (c) {
+		case 'b':
+			if (video_parse_bufsize(optarg, &opts) != 0)
+				return (EXIT_USAGE);
+			break;
+
+		case 'L':
+			ss.ss_lowdemand = B_TRUE;
+			break;
+
+		case 'T':
+			timing = B_TRUE;
+			break;
+
+		case 't':
+			if (video_parse_threads(optarg, &opts) != 0)
+				return (EXIT_USAGE);
+			break;
+
+		case 'y':
+			planar = B_TRUE;
+			break;
+
+		case '?':
+		default:
+			return (EXIT_USAGE);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
 
 	if (kv_init(dirname((char *)kv_arg0)) != 0) {
 		warnx("failed to initialize masks");
@@ -586,11 +1261,18 @@ cmd_starts(int argc, char *argv[])
 		return (EXIT_USAGE);
 	}
 
-	if ((vp = video_open(argv[0])) == NULL)
+	if ((vp = video_open(argv[0], &opts)) == NULL)
 		return (EXIT_FAILURE);
 
-	last = 0;
-	rv = video_iter_frames(vp, check_start_frame, &last);
+	if (planar && video_planar(vp) != 0) {
+		video_free(vp);
+		return (EXIT_FAILURE);
+	}
+
+	kv_mask_bounds(KV_IDENT_START, &ss.ss_miny, &ss.ss_maxy);
+	rv = video_iter_frames(vp, check_start_frame, &ss);
+	if (timing)
+		video_report(vp, stderr);
 	video_free(vp);
 	return (rv);
 }
@@ -599,15 +1281,24 @@ static int
 check_start_frame(video_frame_t *vp, void *rawarg)
 {
 	kv_screen_t ks;
-	int *lastp = rawarg;
+	startscan_t *ssp = rawarg;
 
-	if (*lastp > 0 && vp->vf_frametime - *lastp < 3000)
+	/*
+	 * With -L, we only need the rows covered by the start masks.
+	 */
+	if (ssp->ss_lowdemand) {
+		vp->vf_demand = VD_MINIMAL;
+		vp->vf_miny = ssp->ss_miny;
+		vp->vf_maxy = ssp->ss_maxy;
+	}
+
+	if (ssp->ss_last > 0 && vp->vf_frametime - ssp->ss_last < 3000)
 		return (0);
 
 	kv_ident(&vp->vf_image, &ks, KV_IDENT_START);
 	if (ks.ks_events & KVE_RACE_START) {
-		*lastp = vp->vf_frametime;
-		(void) printf("%d\n", (int) (*lastp / 1000));
+		ssp->ss_last = vp->vf_frametime;
+		(void) printf("%d\n", (int) (ssp->ss_last / 1000));
 		(void) fflush(stdout);
 	}
 
@@ -627,16 +1318,33 @@ cmd_exportitems(int argc, char *argv[])
 	char c;
 	int rv;
 	expitem_t state;
+	video_opts_t opts;
+	boolean_t timing = B_FALSE;
 
 	state.ew_state = B_FALSE;
 	state.ew_dbgdir = NULL;
+	bzero(&opts, sizeof (opts));
 
-	while ((c = getopt(argc, argv, "jd:")) != -1) {
+	while ((c = getopt(argc, argv, "b:jd:Tt:")) != -1) {
 		switch (c) {
+		case 'b':
+			if (video_parse_bufsize(optarg, &opts) != 0)
+				return (EXIT_USAGE);
+			break;
+
 		case 'd':
 			state.ew_dbgdir = optarg;
 			break;
 
+		case 'T':
+			timing = B_TRUE;
+			break;
+
+		case 't':
+			if (video_parse_threads(optarg, &opts) != 0)
+				return (EXIT_USAGE);
+			break;
+
 		case '?':
 		default:
 			return (EXIT_USAGE);
@@ -667,10 +1375,12 @@ cmd_exportitems(int argc, char *argv[])
 	if (state.ew_mask == NULL)
 		return (EXIT_FAILURE);
 
-	if ((vp = video_open(argv[0])) == NULL)
+	if ((vp = video_open(argv[0], &opts)) == NULL)
 		return (EXIT_FAILURE);
 
 	rv = video_iter_frames(vp, check_items, &state);
+	if (timing)
+		video_report(vp, stderr);
 	video_free(vp);
 	return (rv);
 }
@@ -682,7 +1392,8 @@ check_items(video_frame_t *vp, void *rawarg)
 	boolean_t fstate;
 	kv_screen_t ks;
 
-	kv_ident(&vp->vf_image, &ks, KV_IDENT_ITEM);
+	/* Item matches need the number of players, which positions give. */
+	kv_ident(&vp->vf_image, &ks, KV_IDENT_ITEM | KV_IDENT_POS);
 	fstate = (ks.ks_players[0].kp_item != KVI_NONE);
 	if (statep->ew_state && !fstate)
 		(void) printf("box disappears: %d\n",
@@ -701,3 +1412,25 @@ check_items(video_frame_t *vp, void *rawarg)
 	}
 	return (0);
 }
+
+/*
+ * recorder file ...: print flight recorder dumps written by "frames -R" and
+ * "video -R"
+ */
+static int
+cmd_recorder(int argc, char *argv[])
+{
+	int i;
+
+	if (argc < 1) {
+		warnx("missing dump file name");
+		return (EXIT_USAGE);
+	}
+
+	for (i = 0; i < argc; i++) {
+		if (kv_recorder_print(argv[i], stdout) != 0)
+			return (EXIT_FAILURE);
+	}
+
+	return (EXIT_SUCCESS);
+}
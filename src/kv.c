@@ -5,29 +5,189 @@
 #include <assert.h>
 #include <dirent.h>
 #include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <strings.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
 
 #include "kv.h"
+#include "probes.h"
 extern int kv_debug;
 
+#define	MIN(x, y)	((x) < (y) ? (x) : (y))
+#define	MAX(x, y)	((x) > (y) ? (x) : (y))
+
+/*
+ * Masks fall into these categories, each of which may use a different matching
+ * engine (see kv_engines()).
+ */
+typedef enum {
+	KVC_POS,
+	KVC_CHAR,
+	KVC_ITEM,
+	KVC_LAKITU,
+	KVC_TRACK,
+	KVC_NCATEGORIES
+} kv_category_t;
+
+static const char *kv_category_labels[] = {
+	"pos",			/* KVC_POS */
+	"char",			/* KVC_CHAR */
+	"item",			/* KVC_ITEM */
+	"start",		/* KVC_LAKITU */
+	"track",		/* KVC_TRACK */
+};
+
+static const char *kv_engine_labels[] = {
+	"color",		/* KVM_COLOR */
+	"luma",			/* KVM_LUMA */
+	"grad",			/* KVM_GRAD */
+	"sig",			/* KVM_SIG */
+	"ref",			/* KVM_REF */
+};
+
+static kv_engine_t kv_engine[KVC_NCATEGORIES];	/* engine for each category */
+
+/*
+ * Thresholds for the signature engines, by category.  These were chosen to
+ * best reproduce the color engine's matches on the test frames.  A threshold of
+ * 0 means the engine can't be used for that category.  The signature engines
+ * can't tell the position digits apart from the scenery behind them: on the
+ * sample race, they agreed with the color engine about a player's position in
+ * at most 61 of 200 cases at any threshold, so the race's positions and finish
+ * came out wrong.
+ */
+static const double kv_sigthresholds[KVM_NENGINES][KVC_NCATEGORIES] = {
+	/* pos	char	item	start	track */
+	{ 0,	0,	0,	0,	0 },		/* KVM_COLOR (unused) */
+	{ 0,	0.33,	0.10,	0.15,	0.195 },	/* KVM_LUMA */
+	{ 0,	0.425,	0.115,	0.20,	0.265 },	/* KVM_GRAD */
+	{ 0,	0.365,	0.14,	0.18,	0.29 },		/* KVM_SIG */
+	{ 0,	0,	0,	0,	0 },		/* KVM_REF (unused) */
+};
+
+#define	KV_ENGINE_USABLE(e, c)	\
+	(!KVM_SIGNATURE(e) || kv_sigthresholds[(e)][(c)] != 0)
+
+/*
+ * Features of a mask for the mask index (see kv_index_build()): the mean color
+ * of each cell of the square's feature grid that the mask mostly covers.
+ */
+typedef struct {
+	unsigned int	kf_ncells;
+	unsigned int	*kf_cells;	/* cell index within the grid */
+	float		(*kf_rgb)[3];	/* mean sprite color in that cell */
+} kv_feat_t;
+
 /*
  * All masks are loaded by kv_init() and cached in kv_masks.
  */
 typedef struct {
 	char		km_name[64];
+	kv_category_t	km_category;
 	img_t		*km_image;
+	img_t		*km_source;	/* original mask, if rescaled */
+	img_yuvmask_t	*km_yuv;	/* for planar frames (created lazily) */
+	const kv_kernel_t *km_kernel;	/* compiled kernel, if any */
+	img_sig_t	*km_sig[KVM_NENGINES];	/* signatures (created lazily) */
+	kv_feat_t	*km_feat;	/* index features, if any */
+	unsigned int	km_square;	/* square (from 1), if any */
+	struct kv_group	*km_group;	/* exclusivity group, if any */
 } kv_mask_t;
 
 kv_item_t kv_mask_item(const char *mask);
 int kv_mask_compare(const kv_mask_t *, const kv_mask_t *);
+static uint32_t kv_mask_hash(img_t *);
+static int kv_engines_parse(const char *, kv_engine_t *);
+static void kv_compare_emit(kv_vidctx_t *, int, kv_screen_t *);
+static void kv_compare_frame(const char *, int, int, img_t *, kv_vidctx_t *);
+static void kv_compare_fini(kv_vidctx_t *);
+static unsigned int kv_mask_square(kv_mask_t *);
 
 
 #define	KV_MAX_MASKS	256
 static kv_mask_t kv_masks[KV_MAX_MASKS];
 static int kv_nmasks = 0;
 
+/* capture geometry the masks are currently scaled for (see kv_geometry()) */
+static kv_capgeom_t kv_geom = { KV_MASK_WIDTH, KV_MASK_HEIGHT, 0, 0,
+    KV_MASK_WIDTH, KV_MASK_HEIGHT };
+#define	KV_GEOMCACHE_INDEX	"masks.txt"
+
+/*
+ * Room a mask cache directory name needs after it for a geometry directory
+ * ("/WIDTHxHEIGHT_WIDTHxHEIGHT+X+Y", at most 66 characters) and a file in that.
+ */
+#define	KV_GEOMCACHE_PATHLEN	(66 + 1 + 64)
+
+/*
+ * Comparing every character mask (8 characters at 2 zoom levels for each
+ * square) and every position mask (4 positions, most with a "final" variant,
+ * for each square) is expensive, so we index them instead.  For each category,
+ * each square has a feature grid covering all of its masks, made of
+ * KV_IDXCELL-pixel cells.  To identify a square, we downsample the frame onto
+ * the grid once, rank the masks by how closely their features match it, and
+ * only compare the best KV_IDXCANDS masks in full.  Cells are scaled with the
+ * width of the masks for other capture geometries.  The position masks in a
+ * square differ by rank and by whether the race is over, so this classifies
+ * both in one pass over the numeral's region.
+ */
+#define	KV_IDXCELL	4
+#define	KV_IDXCANDS	2
+#define	KV_IDXMAXCELLS	1024
+#define	KV_IDXMAXMASKS	32
+
+typedef struct {
+	unsigned int	ki_x0, ki_y0;		/* top-left of the grid */
+	unsigned int	ki_cols, ki_rows;	/* grid dimensions, in cells */
+	unsigned int	ki_cell;		/* cell size, in pixels */
+	int		ki_nmasks;
+	int		ki_masks[KV_IDXMAXMASKS];	/* indexes into kv_masks */
+} kv_index_t;
+
+static kv_index_t kv_index[KVC_NCATEGORIES][KV_MAXPLAYERS];
+
+static void kv_index_build(kv_category_t);
+static void kv_index_rank(img_t *, kv_category_t, uint8_t *);
+
+/*
+ * Position and character masks for the same square are mutually exclusive: a
+ * square shows one position numeral and one character at a time, and
+ * kv_ident_matches() keeps only the best match for each.  These masks are
+ * grouped by category and square.  kv_ident_batch() evaluates each group's most
+ * recent winner first, and once a mask in a group scores under the category's
+ * "confident" score, it skips the rest of the group.  Item masks aren't grouped
+ * because kv_ident_matches() doesn't just keep the best-scoring item: a specific
+ * item replaces "none" or "unknown" whatever the scores.
+ */
+typedef struct kv_group {
+	kv_category_t	kg_category;
+	unsigned int	kg_square;
+	int		kg_nmasks;
+	int		kg_last;	/* most recent winner, or -1 */
+	unsigned long	kg_nevals;	/* masks evaluated */
+	unsigned long	kg_nskipped;	/* masks skipped */
+	unsigned long	kg_nconfident;	/* evaluations stopped early */
+} kv_group_t;
+
+static kv_group_t kv_groups[KVC_NCATEGORIES][KV_MAXPLAYERS];
+
+/*
+ * Per-frame state of a group within kv_ident_batch().
+ */
+typedef struct {
+	double		kgs_first;	/* score of kg_last, if evaluated */
+	double		kgs_best;	/* best matching score */
+	int		kgs_winner;	/* mask with that score, or -1 */
+	boolean_t	kgs_done;	/* skip the rest of the group */
+} kv_groupstate_t;
+
 #define KV_MASK_CHAR(s)		(s[0] == 'c')
 #define KV_MASK_TRACK(s)	(s[0] == 't')
 #define	KV_MASK_LAKITU(s)	(s[0] == 'l')
@@ -35,6 +195,41 @@ static int kv_nmasks = 0;
 #define	KV_MASK_POS(s)		(s[0] == 'p')
 
 #define	KV_STARTFRAMES	90
+#define	KV_MAXSTRIDE	16
+#define	KV_MAXWRITERS	16	/* max debug image writer threads */
+#define	KV_WRITEQ	32	/* max debug images queued for writing */
+
+/*
+ * A frame we haven't identified yet because we're only sampling every Nth frame
+ * (see kv_vidctx_frame()).
+ */
+typedef struct {
+	char		kd_name[PATH_MAX];	/* frame name */
+	int		kd_frame;		/* frame number */
+	int		kd_timems;		/* frame time */
+	img_t		*kd_image;		/* copy of frame image */
+} kv_deferred_t;
+
+/*
+ * What kv_vidctx_frame() and kv_vidctx_process() decided to do with each frame
+ * (see kv_vidctx_decide()).
+ */
+typedef enum {
+	KFD_UNCALIBRATED,	/* no mask geometry yet */
+	KFD_SCENE,		/* not a race scene (b = kv_scene_t) */
+	KFD_DEFERRED,		/* saved until the next sample */
+	KFD_BACKTRACK,		/* sample changed (b = frames deferred) */
+	KFD_SKIPPED,		/* sample unchanged (b = frames skipped) */
+	KFD_HOLDOFF,		/* too soon after the race start */
+	KFD_START,		/* race started */
+	KFD_ABORTED,		/* race started during another race */
+	KFD_IDLE,		/* not in a race */
+	KFD_INVALID,		/* invalid screen (b = kv_invalid_t) */
+	KFD_ITEMFIX,		/* invalid, but items changed (b = ditto) */
+	KFD_UNCHANGED,		/* no logical change */
+	KFD_EMIT,		/* state emitted (c = events) */
+	KFD_NDECISIONS
+} kv_frdecision_t;
 
 struct kv_vidctx {
 	kv_screen_t 	kv_frame;	/* current frame state */
@@ -46,6 +241,69 @@ struct kv_vidctx {
 	kv_emit_f	kv_emit;
 	double		kv_framerate;
 	char		kv_dbgdir[PATH_MAX];
+
+	/* debug images (see kv_vidctx_writers()) */
+	img_writer_t	*kv_writer;	/* writer pool (created lazily) */
+	int		kv_nwriters;	/* writer threads (0 = synchronous) */
+	int		kv_pnglevel;	/* PNG compression level */
+
+	/* realtime mode (see kv_vidctx_deadline()) */
+	hrtime_t	kv_rt_origin;	/* time at which kv_rt_frame was due */
+	int		kv_rt_frame;	/* frame number due at kv_rt_origin */
+	hrtime_t	kv_rt_maxlag;	/* worst lag seen */
+	kv_degrade_t	kv_rt_level;	/* current degradation level */
+	int		kv_rt_nframes[KVD_NLEVELS];	/* frames per level */
+
+	/* frame decimation (see kv_vidctx_frame()) */
+	int		kv_stride;	/* sample every Nth frame when stable */
+	int		kv_ndeferred;	/* frames deferred since last sample */
+	kv_deferred_t	kv_deferred[KV_MAXSTRIDE - 1];
+	int		kv_nsampled;	/* frames sampled */
+	int		kv_nskipped;	/* frames never identified */
+	int		kv_nbacktracks;	/* samples that found a change */
+
+	/* scene classification (see kv_scene_classify()) */
+	int		kv_nscenes[KVSC_NCLASSES];	/* frames per class */
+
+	/* capture geometry (see kv_vidctx_calibrate()) */
+	boolean_t	kv_calibrated;	/* masks match the frames */
+	boolean_t	kv_geomfailed;	/* couldn't rescale the masks */
+	boolean_t	kv_geomforced;	/* use kv_geom rather than detecting */
+	kv_capgeom_t	kv_geom;
+	unsigned int	kv_yscale;	/* captured rows per frame row */
+	char		kv_maskcache[PATH_MAX];	/* rescaled mask cache */
+	int		kv_nuncalibrated;	/* frames before calibration */
+
+	/* flight recorder (see kv_vidctx_recorder()) */
+	char		kv_frdir[PATH_MAX];	/* dump directory, if recording */
+	int		kv_frdumpat;	/* frame at which to dump, or -1 */
+	int		kv_frevent;	/* frame of the anomaly being dumped */
+	const char	*kv_frreason;	/* what the anomaly was */
+	int		kv_frndumps;	/* automatic dumps so far */
+	int		kv_frninvalid;	/* consecutive invalid frames */
+
+	/* statistics (see kv_vidctx_stats()) */
+	int		kv_nframes;	/* frames seen */
+	int		kv_nidentified;	/* frames identified */
+	uint64_t	kv_nmasks;	/* masks compared */
+	int		kv_ndecisions[KFD_NDECISIONS];
+
+	/* engine comparison (see kv_vidctx_compare()) */
+	struct kv_compare *kv_cmp;
+	int		kv_cmpside;	/* 0 for the original context */
+};
+
+static const char *kv_scene_labels[] = {
+	"race",			/* KVSC_RACE */
+	"black",		/* KVSC_BLACK */
+	"other",		/* KVSC_OTHER */
+};
+
+static const char *kv_degrade_labels[] = {
+	"full",			/* KVD_FULL */
+	"nodebug",		/* KVD_NODEBUG */
+	"halfitems",		/* KVD_HALFITEMS */
+	"minimal",		/* KVD_MINIMAL */
 };
 
 int
@@ -58,6 +316,7 @@ kv_init(const char *dirname)
 	char *p;
 	char maskname[PATH_MAX];
 	char maskdirname[PATH_MAX];
+	int i, j, nkernels;
 
 	if (kv_nmasks > 0)
 		/* already initialized */
@@ -111,6 +370,17 @@ kv_init(const char *dirname)
 		kmp->km_image = mask;
 		(void) strncpy(kmp->km_name, entp->d_name, sizeof (kmp->km_name));
 
+		if (KV_MASK_POS(kmp->km_name))
+			kmp->km_category = KVC_POS;
+		else if (KV_MASK_CHAR(kmp->km_name))
+			kmp->km_category = KVC_CHAR;
+		else if (KV_MASK_ITEM(kmp->km_name))
+			kmp->km_category = KVC_ITEM;
+		else if (KV_MASK_LAKITU(kmp->km_name))
+			kmp->km_category = KVC_LAKITU;
+		else
+			kmp->km_category = KVC_TRACK;
+
 		if (kv_debug > 2)
 			(void) printf("bounded [%d, %d] to [%d, %d]\n",
 			    mask->img_minx, mask->img_miny, mask->img_maxx,
@@ -125,6 +395,54 @@ kv_init(const char *dirname)
 	 */
 	qsort(kv_masks, kv_nmasks, sizeof (kv_masks[0]),
 	    (int (*)(const void *, const void *))kv_mask_compare);
+
+	/*
+	 * Use compiled kernels for masks that haven't changed since the kernels
+	 * were generated.
+	 */
+	for (i = 0, nkernels = 0; i < kv_nmasks; i++) {
+		kmp = &kv_masks[i];
+		for (j = 0; j < kv_nkernels; j++) {
+			if (strcmp(kv_kernels[j].kk_name, kmp->km_name) != 0)
+				continue;
+
+			if (kv_kernels[j].kk_hash == kv_mask_hash(kmp->km_image)) {
+				kmp->km_kernel = &kv_kernels[j];
+				nkernels++;
+			} else if (kv_debug > 0) {
+				(void) fprintf(stderr, "mask %s has changed "
+				    "since its kernel was generated\n",
+				    kmp->km_name);
+			}
+
+			break;
+		}
+	}
+
+	if (kv_debug > 0)
+		(void) fprintf(stderr, "using compiled kernels for %d of %d "
+		    "masks\n", nkernels, kv_nmasks);
+
+	/*
+	 * Now that the masks are in their final order, assign them to squares
+	 * and exclusivity groups and build the indexes.
+	 */
+	for (i = 0; i < kv_nmasks; i++) {
+		kmp = &kv_masks[i];
+		if ((kmp->km_square = kv_mask_square(kmp)) == 0 ||
+		    kmp->km_category == KVC_ITEM)
+			continue;
+
+		kmp->km_group = &kv_groups[kmp->km_category]
+		    [kmp->km_square - 1];
+		kmp->km_group->kg_category = kmp->km_category;
+		kmp->km_group->kg_square = kmp->km_square;
+		kmp->km_group->kg_nmasks++;
+		kmp->km_group->kg_last = -1;
+	}
+
+	kv_index_build(KVC_POS);
+	kv_index_build(KVC_CHAR);
 	return (0);
 }
 
@@ -140,811 +458,3541 @@ kv_mask_compare(const kv_mask_t *m1, const kv_mask_t *m2)
 	return (strcmp(m1->km_name, m2->km_name));
 }
 
-void
-kv_ident(img_t *image, kv_screen_t *ksp, kv_ident_t which)
+/*
+ * Select the matching engine for each category of masks.  "spec" is a
+ * comma-separated list of either an engine name (which applies to all
+ * categories that it can be used for) or "category=engine".  Categories not
+ * mentioned keep their current engines.
+ */
+int
+kv_engines(const char *spec)
 {
-	int i, ndone;
-	double score, checkthresh;
-	kv_mask_t *kmp;
+	return (kv_engines_parse(spec, kv_engine));
+}
 
-	bzero(ksp, sizeof (*ksp));
+static int
+kv_engines_parse(const char *spec, kv_engine_t *engines)
+{
+	char buf[128];
+	char *item, *eq, *lasts;
+	int c, e;
 
-	for (i = 0; i < kv_nmasks; i++) {
-		kmp = &kv_masks[i];
+	if (strlen(spec) >= sizeof (buf)) {
+		warnx("engine list too long");
+		return (-1);
+	}
 
-		if (!(which & KV_IDENT_CHARS) && KV_MASK_CHAR(kmp->km_name))
-			continue;
+	(void) strcpy(buf, spec);
+	for (item = strtok_r(buf, ",", &lasts); item != NULL;
+	    item = strtok_r(NULL, ",", &lasts)) {
+		if ((eq = strchr(item, '=')) != NULL)
+			*eq++ = '\0';
 
-		if (!(which & KV_IDENT_START) && KV_MASK_LAKITU(kmp->km_name))
-			continue;
+		for (e = 0; e < KVM_NENGINES; e++) {
+			if (strcmp(eq != NULL ? eq : item,
+			    kv_engine_labels[e]) == 0)
+				break;
+		}
 
-		if (!(which & KV_IDENT_TRACK) && KV_MASK_TRACK(kmp->km_name))
-			continue;
+		if (e == KVM_NENGINES) {
+			warnx("unknown engine \"%s\" (expected \"color\", "
+			    "\"luma\", \"grad\", \"sig\", or \"ref\")",
+			    eq != NULL ? eq : item);
+			return (-1);
+		}
 
-		if (!(which & KV_IDENT_ITEM) && KV_MASK_ITEM(kmp->km_name))
+		if (eq == NULL) {
+			for (c = 0; c < KVC_NCATEGORIES; c++) {
+				if (KV_ENGINE_USABLE(e, c))
+					engines[c] = e;
+			}
 			continue;
+		}
 
-		score = img_compare(image, kmp->km_image, NULL);
+		for (c = 0; c < KVC_NCATEGORIES; c++) {
+			if (strcmp(item, kv_category_labels[c]) == 0)
+				break;
+		}
 
-		if (kv_debug > 1)
-			(void) printf("mask %s: %f\n", kmp->km_name, score);
+		if (c == KVC_NCATEGORIES) {
+			warnx("unknown mask category \"%s\" (expected \"pos\", "
+			    "\"char\", \"item\", \"start\", or \"track\")", item);
+			return (-1);
+		}
 
-		if (KV_MASK_CHAR(kmp->km_name))
-			checkthresh = KV_THRESHOLD_CHAR;
-		else if (KV_MASK_LAKITU(kmp->km_name))
-			checkthresh = KV_THRESHOLD_LAKITU;
-		else if (KV_MASK_ITEM(kmp->km_name) &&
-		    strstr(kmp->km_name, "box_frame") != NULL)
-			checkthresh = KV_THRESHOLD_ITEMFRAME;
-		else if (KV_MASK_ITEM(kmp->km_name))
-			checkthresh = KV_THRESHOLD_ITEM;
-		else
-			checkthresh = KV_THRESHOLD_TRACK;
+		if (!KV_ENGINE_USABLE(e, c)) {
+			warnx("engine \"%s\" can't be used for \"%s\" masks",
+			    kv_engine_labels[e], kv_category_labels[c]);
+			return (-1);
+		}
 
-		if (score > checkthresh)
-			continue;
+		engines[c] = e;
+	}
+
+	return (0);
+}
+
+/*
+ * Describe a set of engines in the form accepted by kv_engines().
+ */
+static void
+kv_engines_describe(const kv_engine_t *engines, char *buf, size_t len)
+{
+	int c;
+	size_t n;
 
-		kv_ident_matches(ksp, kmp->km_name, score);
+	for (c = 1; c < KVC_NCATEGORIES; c++) {
+		if (engines[c] != engines[0])
+			break;
 	}
 
-	ndone = 0;
-	for (i = 0; i < ksp->ks_nplayers; i++) {
-		if (ksp->ks_players[i].kp_lapnum == 4)
-			ndone++;
+	if (c == KVC_NCATEGORIES) {
+		(void) snprintf(buf, len, "%s", kv_engine_labels[engines[0]]);
+		return;
 	}
 
-	if (ndone >= ksp->ks_nplayers - 1)
-		ksp->ks_events |= KVE_RACE_DONE;
+	buf[0] = '\0';
+	for (c = 0, n = 0; c < KVC_NCATEGORIES && n < len; c++)
+		n += snprintf(buf + n, len - n, "%s%s=%s", c == 0 ? "" : ",",
+		    kv_category_labels[c], kv_engine_labels[engines[c]]);
 }
 
 /*
- * Update the screen state (ksp) to reflect that a mask matched this frame.
+ * Returns the score below which a mask matches, which depends on its category
+ * and the engine it uses.
  */
-void
-kv_ident_matches(kv_screen_t *ksp, const char *mask, double score)
+static double
+kv_mask_threshold(kv_mask_t *kmp)
 {
-	unsigned int pos, square;
-	char *p;
-	kv_player_t *kpp;
-	kv_item_t item;
-	char buf[64];
-
-	if (kv_debug > 1)
-		(void) printf("%s matches\n", mask);
-
-	(void) strncpy(buf, mask, sizeof (buf));
+	if (KVM_SIGNATURE(kv_engine[kmp->km_category]))
+		return (kv_sigthresholds[kv_engine[kmp->km_category]]
+		    [kmp->km_category]);
+
+	switch (kmp->km_category) {
+	case KVC_CHAR:
+		return (KV_THRESHOLD_CHAR);
+	case KVC_LAKITU:
+		return (KV_THRESHOLD_LAKITU);
+	case KVC_ITEM:
+		if (strstr(kmp->km_name, "box_frame") != NULL)
+			return (KV_THRESHOLD_ITEMFRAME);
+		return (KV_THRESHOLD_ITEM);
+	default:
+		return (KV_THRESHOLD_TRACK);
+	}
+}
 
-	if (strncmp(buf, "track_", sizeof ("track_") - 1) == 0) {
-		if (ksp->ks_track[0] != '\0' && ksp->ks_trackscore < score)
-			return;
+/*
+ * Compare a mask against an image using the signature engine.  The signature
+ * is computed the first time the mask is used.
+ */
+static double
+kv_mask_sigscore(img_t *image, kv_mask_t *kmp)
+{
+	kv_engine_t engine = kv_engine[kmp->km_category];
+	img_sigtype_t type;
 
-		(void) strtok(buf + sizeof ("track_"), "_.");
-		(void) strncpy(ksp->ks_track, buf + sizeof ("track_") - 1,
-		    sizeof (ksp->ks_track));
-		ksp->ks_trackscore = score;
-		return;
+	switch (engine) {
+	case KVM_LUMA:
+		type = IMG_SIG_LUMA;
+		break;
+	case KVM_GRAD:
+		type = IMG_SIG_GRAD;
+		break;
+	default:
+		type = IMG_SIG_BOTH;
+		break;
 	}
 
-	if (sscanf(buf, "pos%u_square%u", &pos, &square) == 2 &&
-	    pos <= KV_MAXPLAYERS && square <= KV_MAXPLAYERS) {
-		kpp = &ksp->ks_players[square - 1];
+	if (kmp->km_sig[engine] == NULL &&
+	    (kmp->km_sig[engine] = img_sig(kmp->km_image, type)) == NULL) {
+		warn("failed to compute signature for mask %s", kmp->km_name);
+		return (1);
+	}
 
-		if (square > ksp->ks_nplayers)
-			ksp->ks_nplayers = square;
-		else if (kpp->kp_place != 0 && kpp->kp_placescore < score)
-			return;
+	return (img_sig_compare(image, kmp->km_sig[engine]));
+}
 
-		ksp->ks_players[square - 1].kp_place = pos;
-		kpp->kp_placescore = score;
+/*
+ * Score a mask with its compiled kernel: the same computation as img_compare(),
+ * in the same order, but visiting only the runs of pixels it would compare.
+ */
+static double
+kv_kernel_score(img_t *image, kv_mask_t *kmp)
+{
+	const kv_kernel_t *kkp = kmp->km_kernel;
+	const kv_kernrun_t *krp;
+	img_pixel_t *imgpx, *maskpx;
+	unsigned int i, j, dr, dg, db, dz2;
+	double sum = 0;
+
+	for (i = 0; i < kkp->kk_nruns; i++) {
+		krp = &kkp->kk_runs[i];
+		imgpx = img_pixel(image, krp->kkr_x, krp->kkr_y);
+		maskpx = img_pixel(kmp->km_image, krp->kkr_x, krp->kkr_y);
+		for (j = 0; j < krp->kkr_n; j++) {
+			dr = maskpx[j].r - imgpx[j].r;
+			dg = maskpx[j].g - imgpx[j].g;
+			db = maskpx[j].b - imgpx[j].b;
+			dz2 = dr * dr + dg * dg + db * db;
+			if (dz2 != 0)
+				sum += sqrt(dz2);
+		}
+	}
 
-		if (strcmp(buf + sizeof ("pos1_square1") - 1,
-		    "_final.png") == 0)
-			kpp->kp_lapnum = 4;
-		else if (kpp->kp_lapnum == 4)
-			kpp->kp_lapnum = 0;
+	return ((sum / sqrt(255 * 255 * 3)) / (double)kkp->kk_npixels);
+}
 
-		return;
+/*
+ * Compare a mask against an image.  For images backed by planar YUV data, we
+ * compare against the planes directly using a YUV version of the mask, which we
+ * create the first time we see a frame with the given chroma layout.
+ */
+static double
+kv_mask_score(img_t *image, kv_mask_t *kmp)
+{
+	img_planar_t *ip = image->img_planar;
+
+	if (KVM_SIGNATURE(kv_engine[kmp->km_category]))
+		return (kv_mask_sigscore(image, kmp));
+
+	if (kv_engine[kmp->km_category] == KVM_REF)
+		return (img_compare(image, kmp->km_image, NULL));
+
+	if (ip == NULL) {
+		if (kmp->km_kernel == NULL || kmp->km_source != NULL ||
+		    kv_debug > 3)
+			return (img_compare(image, kmp->km_image, NULL));
+
+		assert(kmp->km_image->img_minx >= image->img_x0 &&
+		    kmp->km_image->img_maxx <= image->img_x0 +
+		    image->img_width);
+		assert(kmp->km_image->img_miny >= image->img_y0 &&
+		    kmp->km_image->img_maxy <= image->img_y0 +
+		    image->img_height);
+		return (kv_kernel_score(image, kmp));
 	}
 
-	if (strncmp(buf, "char_", sizeof ("char_") - 1) == 0) {
-		p = strchr(buf + sizeof ("char_") - 1, '_');
-		if (p == NULL)
-			return;
+	if (kmp->km_yuv != NULL && (kmp->km_yuv->iym_hshift != ip->ip_hshift ||
+	    kmp->km_yuv->iym_vshift != ip->ip_vshift)) {
+		img_yuvmask_free(kmp->km_yuv);
+		kmp->km_yuv = NULL;
+	}
 
-		*p = '\0';
-		if (sscanf(p + 1, "%u", &square) != 1 ||
-		    square > KV_MAXPLAYERS)
-			return;
+	if (kmp->km_yuv == NULL && (kmp->km_yuv = img_yuvmask(kmp->km_image,
+	    ip->ip_hshift, ip->ip_vshift)) == NULL) {
+		warn("failed to convert mask %s", kmp->km_name);
+		return (img_compare(image, kmp->km_image, NULL));
+	}
 
-		kpp = &ksp->ks_players[square - 1];
+	return (img_compare_planar(ip, kmp->km_yuv));
+}
 
-		if (kpp->kp_character[0] != '\0' && kpp->kp_charscore < score)
-			return;
+/*
+ * Like img_compare(), masks ignore nearly-black pixels.
+ */
+#define	KV_MASK_IGNORED(px)	((px)->r < 2 && (px)->g < 2 && (px)->b < 2)
 
-		if (square > ksp->ks_nplayers)
-			ksp->ks_nplayers = square;
+/*
+ * Hash the pixels of a mask that img_compare() would compare (and their
+ * coordinates), using 32-bit FNV-1a.
+ */
+static uint32_t
+kv_mask_hash(img_t *mask)
+{
+	uint32_t hash = 2166136261u;
+	unsigned int x, y;
+	img_pixel_t *px;
+
+#define	KV_HASH(v)	(hash = (hash ^ (uint32_t)(v)) * 16777619u)
+	KV_HASH(mask->img_minx);
+	KV_HASH(mask->img_maxx);
+	KV_HASH(mask->img_miny);
+	KV_HASH(mask->img_maxy);
+
+	for (y = mask->img_miny; y < mask->img_maxy; y++) {
+		for (x = mask->img_minx; x < mask->img_maxx; x++) {
+			px = img_pixel(mask, x, y);
+			if (KV_MASK_IGNORED(px))
+				continue;
 
-		(void) strncpy(kpp->kp_character, buf + sizeof ("char_") - 1,
-		    sizeof (kpp->kp_character));
-		kpp->kp_charscore = score;
-		return;
+			KV_HASH(x);
+			KV_HASH(y);
+			KV_HASH(px->r);
+			KV_HASH(px->g);
+			KV_HASH(px->b);
+		}
 	}
+#undef	KV_HASH
 
-	if (strncmp(buf, "lakitu_start", sizeof ("lakitu_start") - 1) == 0) {
-		ksp->ks_events |= KVE_RACE_START;
-		return;
-	}
+	return (hash);
+}
 
-	if (strncmp(buf, "item_", sizeof ("item_") - 1) == 0) {
-		p = strrchr(buf, '_');
-		if (p == buf + sizeof ("item_") - 1)
-			return;
+/*
+ * Compute the index features of a mask on the given square's grid.  We only
+ * keep cells that the mask covers at least half of, since the rest of those
+ * cells in a frame is whatever happens to be behind the sprite or numeral.
+ */
+static kv_feat_t *
+kv_feat(img_t *mask, kv_index_t *kip)
+{
+	kv_feat_t *kfp;
+	float (*sums)[3];
+	unsigned int *counts;
+	unsigned int x, y, c, ncells;
+	img_pixel_t *px;
+
+	ncells = kip->ki_cols * kip->ki_rows;
+	sums = calloc(ncells, sizeof (sums[0]));
+	counts = calloc(ncells, sizeof (counts[0]));
+	kfp = calloc(1, sizeof (*kfp));
+
+	if (sums == NULL || counts == NULL || kfp == NULL ||
+	    (kfp->kf_cells = calloc(ncells, sizeof (kfp->kf_cells[0]))) ==
+	    NULL || (kfp->kf_rgb = calloc(ncells, sizeof (kfp->kf_rgb[0]))) ==
+	    NULL) {
+		if (kfp != NULL)
+			free(kfp->kf_cells);
+		free(kfp);
+		free(sums);
+		free(counts);
+		return (NULL);
+	}
 
-		*p = '\0';
-		if (sscanf(p + 1, "%u", &square) != 1 || square > KV_MAXPLAYERS)
-			return;
+	for (y = mask->img_miny; y < mask->img_maxy; y++) {
+		for (x = mask->img_minx; x < mask->img_maxx; x++) {
+			px = img_pixel(mask, x, y);
+			if (KV_MASK_IGNORED(px))
+				continue;
 
-		if (square > ksp->ks_nplayers)
-			return;
+			c = (y - kip->ki_y0) / kip->ki_cell * kip->ki_cols +
+			    (x - kip->ki_x0) / kip->ki_cell;
+			sums[c][0] += px->r;
+			sums[c][1] += px->g;
+			sums[c][2] += px->b;
+			counts[c]++;
+		}
+	}
 
-		/*
-		 * We only want to take the KVI_UNKNOWN match if there's no
-		 * more specific item match (regardless of the score).
-		 */
-		kpp = &ksp->ks_players[square - 1];
-		item = kv_mask_item(buf + sizeof ("item_") - 1);
-		if (item == KVI_UNKNOWN && kpp->kp_item != KVI_NONE)
-			return;
+	for (c = 0; c < ncells; c++) {
+		if (counts[c] * 2 < kip->ki_cell * kip->ki_cell)
+			continue;
 
-		/*
-		 * If we have a non-blank item with a worse score than what
-		 * we've already got (and that's not just because the existing
-		 * item is NONE or UNKNOWN), then we'll defer to what we've
-		 * already got.
-		 */
-		if (kpp->kp_itemscore < score &&
-		    (kpp->kp_item != KVI_NONE && kpp->kp_item != KVI_UNKNOWN))
-			return;
+		kfp->kf_cells[kfp->kf_ncells] = c;
+		kfp->kf_rgb[kfp->kf_ncells][0] = sums[c][0] / counts[c];
+		kfp->kf_rgb[kfp->kf_ncells][1] = sums[c][1] / counts[c];
+		kfp->kf_rgb[kfp->kf_ncells][2] = sums[c][2] / counts[c];
+		kfp->kf_ncells++;
+	}
 
-		kpp->kp_item = kv_mask_item(buf + sizeof ("item_") - 1);
-		kpp->kp_itemscore = score;
+	free(sums);
+	free(counts);
+	return (kfp);
+}
 
-		if (kv_debug > 2)
-			(void) printf("player %d: taking item %s\n",
-			    square, kv_item_label(kpp->kp_item));
+static void
+kv_feat_free(kv_feat_t *kfp)
+{
+	if (kfp == NULL)
 		return;
-	}
+
+	free(kfp->kf_cells);
+	free(kfp->kf_rgb);
+	free(kfp);
 }
 
 /*
- * Returns whether the given screen is invalid for the same race as pksp.  This
- * is used to skip frames that show transient invalid state.
+ * Returns the square (starting from 1) that a position, character, or item
+ * mask applies to, or 0 if the name doesn't say.  See kv_ident_matches().
  */
-int
-kv_screen_invalid(kv_screen_t *ksp, kv_screen_t *pksp, kv_screen_t *raceksp)
+static unsigned int
+kv_mask_square(kv_mask_t *kmp)
+{
+	const char *p;
+	unsigned int square;
+
+	switch (kmp->km_category) {
+	case KVC_POS:
+		if (sscanf(kmp->km_name, "pos%*u_square%u", &square) != 1)
+			return (0);
+		break;
+	case KVC_CHAR:
+		p = strchr(kmp->km_name + sizeof ("char_") - 1, '_');
+		if (p == NULL || sscanf(p + 1, "%u", &square) != 1)
+			return (0);
+		break;
+	case KVC_ITEM:
+		p = strrchr(kmp->km_name, '_');
+		if (p == kmp->km_name + sizeof ("item_") - 2 ||
+		    sscanf(p + 1, "%u", &square) != 1)
+			return (0);
+		break;
+	default:
+		return (0);
+	}
+
+	return (square <= KV_MAXPLAYERS ? square : 0);
+}
+
+/*
+ * Build the index for the loaded masks of the given category.  A square whose
+ * masks can't be indexed is left out, and its masks are always compared in
+ * full.
+ */
+static void
+kv_index_build(kv_category_t category)
+{
+	kv_index_t *kip;
+	kv_mask_t *kmp;
+	img_t *mask;
+	unsigned int square, x1[KV_MAXPLAYERS], y1[KV_MAXPLAYERS];
+	int i, j, nindexed;
+
+	for (j = 0; j < KV_MAXPLAYERS; j++) {
+		kip = &kv_index[category][j];
+		kip->ki_x0 = kip->ki_y0 = UINT_MAX;
+		kip->ki_nmasks = 0;
+		x1[j] = y1[j] = 0;
+	}
+
+	for (i = 0; i < kv_nmasks; i++) {
+		kmp = &kv_masks[i];
+		if (kmp->km_category != category ||
+		    (square = kmp->km_square) == 0)
+			continue;
+
+		kip = &kv_index[category][square - 1];
+		if (kip->ki_nmasks++ >= KV_IDXMAXMASKS)
+			continue;
+
+		kip->ki_masks[kip->ki_nmasks - 1] = i;
+		mask = kmp->km_image;
+		kip->ki_x0 = MIN(kip->ki_x0, mask->img_minx);
+		kip->ki_y0 = MIN(kip->ki_y0, mask->img_miny);
+		x1[square - 1] = MAX(x1[square - 1], mask->img_maxx);
+		y1[square - 1] = MAX(y1[square - 1], mask->img_maxy);
+	}
+
+	for (j = 0, nindexed = 0; j < KV_MAXPLAYERS; j++) {
+		kip = &kv_index[category][j];
+		if (kip->ki_nmasks == 0)
+			continue;
+
+		kip->ki_cell = MAX(1, (KV_IDXCELL * kv_geom.kcg_maskwidth +
+		    KV_MASK_WIDTH / 2) / KV_MASK_WIDTH);
+		kip->ki_cols = (x1[j] - kip->ki_x0 + kip->ki_cell - 1) /
+		    kip->ki_cell;
+		kip->ki_rows = (y1[j] - kip->ki_y0 + kip->ki_cell - 1) /
+		    kip->ki_cell;
+
+		if (kip->ki_nmasks > KV_IDXMAXMASKS ||
+		    kip->ki_cols * kip->ki_rows > KV_IDXMAXCELLS) {
+			if (kv_debug > 0)
+				(void) fprintf(stderr, "not indexing %s masks "
+				    "in square %d\n",
+				    kv_category_labels[category], j + 1);
+			kip->ki_nmasks = 0;
+			continue;
+		}
+
+		for (i = 0; i < kip->ki_nmasks; i++) {
+			kmp = &kv_masks[kip->ki_masks[i]];
+			kmp->km_feat = kv_feat(kmp->km_image, kip);
+			if (kmp->km_feat == NULL || kmp->km_feat->kf_ncells == 0)
+				break;
+		}
+
+		if (i < kip->ki_nmasks) {
+			warnx("failed to index %s masks in square %d",
+			    kv_category_labels[category], j + 1);
+			for (i = 0; i < kip->ki_nmasks; i++) {
+				kmp = &kv_masks[kip->ki_masks[i]];
+				kv_feat_free(kmp->km_feat);
+				kmp->km_feat = NULL;
+			}
+			kip->ki_nmasks = 0;
+			continue;
+		}
+
+		nindexed += kip->ki_nmasks;
+	}
+
+	if (kv_debug > 0)
+		(void) fprintf(stderr, "indexed %d %s masks\n", nindexed,
+		    kv_category_labels[category]);
+}
+
+/*
+ * Rank the indexed masks of a category in each square against the given frame,
+ * setting "confirm[i]" for each of the KV_IDXCANDS best candidates (by their
+ * index "i" in kv_masks).  Candidates are ranked by the mean distance between
+ * the color of each of their cells and that of the frame.
+ */
+static void
+kv_index_rank(img_t *image, kv_category_t category, uint8_t *confirm)
+{
+	float grid[KV_IDXMAXCELLS][3];
+	double dist[KV_IDXCANDS], d, e;
+	int cand[KV_IDXCANDS];
+	kv_index_t *kip;
+	kv_feat_t *kfp;
+	float *fp;
+	unsigned int c;
+	int i, j, k, ncands;
+
+	for (j = 0; j < KV_MAXPLAYERS; j++) {
+		kip = &kv_index[category][j];
+		if (kip->ki_nmasks == 0)
+			continue;
+
+		img_cellmeans(image, kip->ki_x0, kip->ki_y0, kip->ki_cols,
+		    kip->ki_rows, kip->ki_cell, grid);
+
+		for (i = 0, ncands = 0; i < kip->ki_nmasks; i++) {
+			kfp = kv_masks[kip->ki_masks[i]].km_feat;
+			for (c = 0, d = 0; c < kfp->kf_ncells; c++) {
+				fp = grid[kfp->kf_cells[c]];
+				e = (fp[0] - kfp->kf_rgb[c][0]) *
+				    (fp[0] - kfp->kf_rgb[c][0]) +
+				    (fp[1] - kfp->kf_rgb[c][1]) *
+				    (fp[1] - kfp->kf_rgb[c][1]) +
+				    (fp[2] - kfp->kf_rgb[c][2]) *
+				    (fp[2] - kfp->kf_rgb[c][2]);
+				d += sqrt(e);
+			}
+
+			d /= kfp->kf_ncells * sqrt(255 * 255 * 3);
+
+			if (kv_debug > 2)
+				(void) printf("mask %s: feature distance %f\n",
+				    kv_masks[kip->ki_masks[i]].km_name, d);
+
+			/* Insert this mask into the sorted candidate list. */
+			for (k = ncands; k > 0 && dist[k - 1] > d; k--) {
+				if (k < KV_IDXCANDS) {
+					dist[k] = dist[k - 1];
+					cand[k] = cand[k - 1];
+				}
+			}
+
+			if (k < KV_IDXCANDS) {
+				dist[k] = d;
+				cand[k] = kip->ki_masks[i];
+				if (ncands < KV_IDXCANDS)
+					ncands++;
+			}
+		}
+
+		for (k = 0; k < ncands; k++)
+			confirm[cand[k]] = 1;
+	}
+}
+
+/*
+ * Emit C source for a kernel for each loaded mask: a table of the runs of
+ * pixels that img_compare() would compare, in the order it compares them (see
+ * kv_kernel_score()).  The pixels' colors come from the mask itself at runtime.
+ */
+int
+kv_kernels_generate(FILE *out)
+{
+	int i, n;
+	unsigned int x, y, x0;
+	unsigned int npixels[KV_MAX_MASKS], nruns[KV_MAX_MASKS];
+	kv_mask_t *kmp;
+	img_t *mask;
+
+	(void) fprintf(out, "/*\n"
+	    " * kv_kernels.c: compiled mask kernels\n"
+	    " *\n"
+	    " * This file is generated by \"kartvid genkernels\".  "
+	    "Do not edit.\n"
+	    " */\n\n"
+	    "#include \"kv.h\"\n");
+
+	for (i = 0; i < kv_nmasks; i++) {
+		kmp = &kv_masks[i];
+		mask = kmp->km_image;
+
+		(void) fprintf(out, "\n/* %s */\n"
+		    "static const kv_kernrun_t kvk_%d[] = {", kmp->km_name, i);
+		npixels[i] = nruns[i] = 0;
+		for (y = mask->img_miny; y < mask->img_maxy; y++) {
+			for (x = mask->img_minx; x < mask->img_maxx; ) {
+				if (KV_MASK_IGNORED(img_pixel(mask, x, y))) {
+					x++;
+					continue;
+				}
+
+				for (x0 = x; x < mask->img_maxx &&
+				    !KV_MASK_IGNORED(img_pixel(mask, x, y)); x++)
+					continue;
+
+				(void) fprintf(out, "%s{ %u, %u, %u },",
+				    nruns[i] % 4 == 0 ? "\n\t" : " ",
+				    x0, y, x - x0);
+				npixels[i] += x - x0;
+				nruns[i]++;
+			}
+		}
+
+		/* Avoid an empty initializer for a mask with no pixels. */
+		if (nruns[i] == 0)
+			(void) fprintf(out, " { 0, 0, 0 }");
+
+		(void) fprintf(out, "\n};\n");
+	}
+
+	(void) fprintf(out, "\nconst kv_kernel_t kv_kernels[] = {\n");
+	for (i = 0; i < kv_nmasks; i++) {
+		kmp = &kv_masks[i];
+		(void) fprintf(out, "\t{ \"%s\", 0x%08xu, %u, %u, kvk_%d },\n",
+		    kmp->km_name, kv_mask_hash(kmp->km_image), npixels[i],
+		    nruns[i], i);
+	}
+
+	n = fprintf(out, "};\n\n"
+	    "const int kv_nkernels = sizeof (kv_kernels) / "
+	    "sizeof (kv_kernels[0]);\n");
+
+	if (n < 0 || fflush(out) != 0) {
+		warn("failed to write kernels");
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Returns whether kv_ident() should check the given mask.
+ */
+static boolean_t
+kv_ident_wants(kv_ident_t which, kv_mask_t *kmp)
+{
+	switch (kmp->km_category) {
+	case KVC_CHAR:
+		return ((which & KV_IDENT_CHARS) != 0);
+	case KVC_LAKITU:
+		return ((which & KV_IDENT_START) != 0);
+	case KVC_TRACK:
+		return ((which & KV_IDENT_TRACK) != 0);
+	case KVC_ITEM:
+		return ((which & KV_IDENT_ITEM) != 0);
+	case KVC_POS:
+		return ((which & KV_IDENT_POS) != 0);
+	default:
+		return (B_TRUE);
+	}
+}
+
+/*
+ * Returns whether to compare a mask only if the mask index picks it as a
+ * candidate (see kv_index_rank()).
+ */
+static boolean_t
+kv_mask_indexed(kv_mask_t *kmp)
+{
+	return (kmp->km_feat != NULL && kv_engine[kmp->km_category] != KVM_REF);
+}
+
+/*
+ * Returns the score below which a mask is a confident match, meaning no other
+ * mask in its group could match (see kv_group_t), or 0 if there's no such
+ * score.  These were only measured for the color engine.
+ */
+static double
+kv_mask_confident(kv_mask_t *kmp)
+{
+	if (kmp->km_group == NULL || kv_engine[kmp->km_category] != KVM_COLOR)
+		return (0);
+
+	switch (kmp->km_category) {
+	case KVC_POS:
+		return (KV_CONFIDENT_POS);
+	case KVC_CHAR:
+		return (KV_CONFIDENT_CHAR);
+	default:
+		return (0);
+	}
+}
+
+void
+kv_groups_report(FILE *fp)
+{
+	int c, k;
+	kv_group_t *kgp;
+
+	for (c = 0; c < KVC_NCATEGORIES; c++) {
+		for (k = 0; k < KV_MAXPLAYERS; k++) {
+			kgp = &kv_groups[c][k];
+			if (kgp->kg_nmasks == 0)
+				continue;
+
+			(void) fprintf(fp, "kv_groups: %s square %d (%d masks): "
+			    "%lu evaluated, %lu skipped, %lu confident\n",
+			    kv_category_labels[c], k + 1, kgp->kg_nmasks,
+			    kgp->kg_nevals, kgp->kg_nskipped,
+			    kgp->kg_nconfident);
+		}
+	}
+}
+
+/*
+ * Flight recorder.  Diagnosing a misdetection with "-d -d -d" means printing
+ * every mask score, which is slow enough to change how the video is processed.
+ * Instead, when enabled with kv_vidctx_recorder(), we record each mask score
+ * and each decision the video context makes about a frame as a fixed-size
+ * binary record in a ring buffer, which costs a handful of stores per record.
+ * kv_recorder_dump() writes out the ring (oldest records first) and
+ * kv_recorder_print() renders a dump as text.  Dumps are native-endian, so
+ * decode them on the same kind of machine that wrote them.
+ */
+#define	KV_FR_NRECS	(1 << 18)	/* records in the ring (power of 2) */
+#define	KV_FR_MAGIC	"KVFR"
+#define	KV_FR_VERSION	1
+#define	KV_FR_AFTER	60	/* frames to record after an anomaly */
+#define	KV_FR_INVALIDRUN 150	/* invalid frames in a row are an anomaly */
+#define	KV_FR_MAXDUMPS	16	/* automatic dumps per video */
+
+typedef enum {
+	KFR_IDENT = 1,		/* frame identified (a = kv_ident_t) */
+	KFR_SCORE,		/* mask scored (b = mask, a = matched) */
+	KFR_DECISION,		/* frame handled (a = kv_frdecision_t) */
+	KFR_ITEM,		/* item state (a = player, b = item, */
+				/* c = old state << 8 | new state) */
+} kv_frtype_t;
+
+typedef struct {
+	uint8_t		kfr_type;	/* kv_frtype_t */
+	uint8_t		kfr_a;
+	uint16_t	kfr_b;
+	int32_t		kfr_frame;	/* frame number */
+	int32_t		kfr_c;
+	float		kfr_score;
+} kv_frrec_t;
+
+typedef struct {
+	char		kfh_magic[4];	/* KV_FR_MAGIC */
+	uint32_t	kfh_version;	/* KV_FR_VERSION */
+	uint32_t	kfh_nmasks;	/* mask names that follow */
+	uint32_t	kfh_nrecs;	/* records that follow the names */
+	uint64_t	kfh_total;	/* records ever recorded */
+} kv_frhdr_t;
+
+static kv_frrec_t kv_fr_ring[KV_FR_NRECS];
+static uint64_t kv_fr_next;		/* total records recorded */
+static boolean_t kv_fr_enabled;
+static int kv_fr_frames[KV_MAXBATCH];	/* frame number of each batch slot */
+static volatile sig_atomic_t kv_fr_requested;
+
+static const char *kv_frdecision_labels[] = {
+	"uncalibrated",		/* KFD_UNCALIBRATED */
+	"scene",		/* KFD_SCENE */
+	"deferred",		/* KFD_DEFERRED */
+	"backtrack",		/* KFD_BACKTRACK */
+	"skipped",		/* KFD_SKIPPED */
+	"holdoff",		/* KFD_HOLDOFF */
+	"race start",		/* KFD_START */
+	"race aborted",		/* KFD_ABORTED */
+	"idle",			/* KFD_IDLE */
+	"invalid",		/* KFD_INVALID */
+	"itemfix",		/* KFD_ITEMFIX */
+	"unchanged",		/* KFD_UNCHANGED */
+	"emit",			/* KFD_EMIT */
+};
+
+static const char *kv_invalid_labels[] = {
+	"valid",				/* KVV_VALID */
+	"wrong number of players",		/* KVV_NPLAYERS */
+	"missing position",			/* KVV_NOPLACE */
+	"nobody finished",			/* KVV_NOTDONE */
+	"lap number lost",			/* KVV_LAPLOST */
+	"position out of range",		/* KVV_BADPLACE */
+	"duplicate position",			/* KVV_DUPPLACE */
+	"finished out of order",		/* KVV_FINISHORDER */
+};
+
+static const char *kv_itemstate_labels[] = {
+	"none",			/* KVS_NONE */
+	"slot machine",		/* KVS_SLOTMACHINE */
+	"waiting for item",	/* KVS_WAIT_ITEM */
+	"have item",		/* KVS_HAVE_ITEM */
+	"waiting for use",	/* KVS_WAIT_USE */
+};
+
+static void
+kv_fr_record(kv_frtype_t type, int frame, unsigned int a, unsigned int b,
+    int c, double score)
+{
+	kv_frrec_t *krp;
+
+	if (!kv_fr_enabled)
+		return;
+
+	krp = &kv_fr_ring[kv_fr_next++ & (KV_FR_NRECS - 1)];
+	krp->kfr_type = type;
+	krp->kfr_a = a;
+	krp->kfr_b = b;
+	krp->kfr_frame = frame;
+	krp->kfr_c = c;
+	krp->kfr_score = score;
+}
+
+/*
+ * Ask for the recorder to be dumped at the next frame.  This is safe to call
+ * from a signal handler.
+ */
+void
+kv_recorder_request(void)
+{
+	kv_fr_requested = 1;
+}
+
+/*
+ * Write the contents of the recorder to the given file.
+ */
+int
+kv_recorder_dump(const char *filename)
+{
+	FILE *fp;
+	kv_frhdr_t hdr;
+	uint64_t first, n;
+	size_t start, len;
+	int i, rv;
+
+	if ((fp = fopen(filename, "w")) == NULL) {
+		warn("fopen %s", filename);
+		return (-1);
+	}
+
+	first = kv_fr_next > KV_FR_NRECS ? kv_fr_next - KV_FR_NRECS : 0;
+
+	bzero(&hdr, sizeof (hdr));
+	bcopy(KV_FR_MAGIC, hdr.kfh_magic, sizeof (hdr.kfh_magic));
+	hdr.kfh_version = KV_FR_VERSION;
+	hdr.kfh_nmasks = kv_nmasks;
+	hdr.kfh_nrecs = kv_fr_next - first;
+	hdr.kfh_total = kv_fr_next;
+
+	rv = fwrite(&hdr, sizeof (hdr), 1, fp) == 1 ? 0 : -1;
+	for (i = 0; rv == 0 && i < kv_nmasks; i++) {
+		if (fwrite(kv_masks[i].km_name, sizeof (kv_masks[i].km_name),
+		    1, fp) != 1)
+			rv = -1;
+	}
+
+	/* Write the records oldest first, wrapping around the ring. */
+	for (n = first; rv == 0 && n < kv_fr_next; n += len) {
+		start = n & (KV_FR_NRECS - 1);
+		len = MIN(kv_fr_next - n, KV_FR_NRECS - start);
+		if (fwrite(&kv_fr_ring[start], sizeof (kv_fr_ring[0]), len,
+		    fp) != len)
+			rv = -1;
+	}
+
+	if (fclose(fp) != 0)
+		rv = -1;
+
+	if (rv != 0)
+		warn("write %s", filename);
+
+	return (rv);
+}
+
+#define	KV_FR_LABEL(labels, i)	\
+	((i) < sizeof (labels) / sizeof (labels[0]) ? labels[i] : "?")
+
+static void
+kv_recorder_print_rec(kv_frrec_t *krp,
+    char (*names)[sizeof (kv_masks[0].km_name)], uint32_t nmasks, FILE *out)
+{
+	unsigned int from, to;
+
+	(void) fprintf(out, "frame %6d  ", krp->kfr_frame);
+
+	switch (krp->kfr_type) {
+	case KFR_IDENT:
+		(void) fprintf(out, "ident    %s%s%s%s%s\n",
+		    krp->kfr_a & KV_IDENT_START ? " start" : "",
+		    krp->kfr_a & KV_IDENT_TRACK ? " track" : "",
+		    krp->kfr_a & KV_IDENT_CHARS ? " chars" : "",
+		    krp->kfr_a & KV_IDENT_ITEM ? " items" : "",
+		    krp->kfr_a & KV_IDENT_POS ? " positions" : "");
+		break;
+
+	case KFR_SCORE:
+		(void) fprintf(out, "score     %-32s %f%s\n",
+		    krp->kfr_b < nmasks ? names[krp->kfr_b] : "?",
+		    krp->kfr_score, krp->kfr_a ? "  match" : "");
+		break;
+
+	case KFR_DECISION:
+		(void) fprintf(out, "%s", KV_FR_LABEL(kv_frdecision_labels,
+		    krp->kfr_a));
+
+		switch (krp->kfr_a) {
+		case KFD_SCENE:
+			(void) fprintf(out, " %s", KV_FR_LABEL(
+			    kv_scene_labels, krp->kfr_b));
+			break;
+		case KFD_BACKTRACK:
+		case KFD_SKIPPED:
+			(void) fprintf(out, " %u frames", krp->kfr_b);
+			break;
+		case KFD_INVALID:
+		case KFD_ITEMFIX:
+			(void) fprintf(out, " %s", KV_FR_LABEL(
+			    kv_invalid_labels, krp->kfr_b));
+			break;
+		case KFD_EMIT:
+			(void) fprintf(out, "%s%s",
+			    krp->kfr_c & KVE_RACE_START ? " start" : "",
+			    krp->kfr_c & KVE_RACE_DONE ? " done" : "");
+			break;
+		default:
+			break;
+		}
+
+		(void) fprintf(out, "\n");
+		break;
+
+	case KFR_ITEM:
+		from = (krp->kfr_c >> 8) & 0xff;
+		to = krp->kfr_c & 0xff;
+		(void) fprintf(out, "item      player %u: %s -> %s (%s)\n",
+		    krp->kfr_a, KV_FR_LABEL(kv_itemstate_labels, from),
+		    KV_FR_LABEL(kv_itemstate_labels, to),
+		    kv_item_label(krp->kfr_b));
+		break;
+
+	default:
+		(void) fprintf(out, "unknown record type %u\n",
+		    krp->kfr_type);
+		break;
+	}
+}
+
+/*
+ * Render a recorder dump written by kv_recorder_dump() as text.
+ */
+int
+kv_recorder_print(const char *filename, FILE *out)
+{
+	FILE *fp;
+	kv_frhdr_t hdr;
+	kv_frrec_t rec;
+	char (*names)[sizeof (kv_masks[0].km_name)];
+	uint32_t i;
+	int rv = -1;
+
+	if ((fp = fopen(filename, "r")) == NULL) {
+		warn("fopen %s", filename);
+		return (-1);
+	}
+
+	names = NULL;
+	if (fread(&hdr, sizeof (hdr), 1, fp) != 1 ||
+	    bcmp(hdr.kfh_magic, KV_FR_MAGIC, sizeof (hdr.kfh_magic)) != 0) {
+		warnx("%s: not a recorder dump", filename);
+		goto out;
+	}
+
+	if (hdr.kfh_version != KV_FR_VERSION) {
+		warnx("%s: unsupported version %u", filename, hdr.kfh_version);
+		goto out;
+	}
+
+	if (hdr.kfh_nmasks > KV_MAX_MASKS ||
+	    (names = calloc(hdr.kfh_nmasks + 1, sizeof (names[0]))) == NULL ||
+	    fread(names, sizeof (names[0]), hdr.kfh_nmasks, fp) !=
+	    hdr.kfh_nmasks) {
+		warnx("%s: bad mask table", filename);
+		goto out;
+	}
+
+	for (i = 0; i < hdr.kfh_nmasks; i++)
+		names[i][sizeof (names[i]) - 1] = '\0';
+
+	(void) fprintf(out, "%u records (of %llu recorded), %u masks\n",
+	    hdr.kfh_nrecs, (unsigned long long)hdr.kfh_total, hdr.kfh_nmasks);
+
+	for (i = 0; i < hdr.kfh_nrecs; i++) {
+		if (fread(&rec, sizeof (rec), 1, fp) != 1) {
+			warnx("%s: truncated after %u records", filename, i);
+			goto out;
+		}
+
+		kv_recorder_print_rec(&rec, names, hdr.kfh_nmasks, out);
+	}
+
+	rv = 0;
+
+out:
+	free(names);
+	(void) fclose(fp);
+	return (rv);
+}
+
+/*
+ * Engine comparison (see kv_vidctx_compare()).  A second video context
+ * identifies each frame with a different set of engines.  The engines, like
+ * the hints that let each exclusivity group try its last winner first, are
+ * global to the mask set, so we swap in the second context's copy of them
+ * (kc_state) around each frame it processes.  Meanwhile, kv_ident_batch()
+ * saves each mask's score in kv_cmpscores so we can compare the engines' scores
+ * mask by mask.
+ */
+#define	KV_CMP_MAXEMITS	64	/* emitted states awaiting comparison */
+
+typedef struct {
+	kv_engine_t	kes_engine[KVC_NCATEGORIES];
+	int		kes_last[KVC_NCATEGORIES][KV_MAXPLAYERS];
+} kv_engstate_t;
+
+typedef struct {
+	float		kcs_score;
+	boolean_t	kcs_matched;	/* score was under the threshold */
+	boolean_t	kcs_set;	/* mask was scored for this frame */
+} kv_cmpscore_t;
+
+typedef struct {
+	unsigned long	kcm_n;		/* frames both engines scored */
+	double		kcm_sum;	/* total absolute difference */
+	double		kcm_max;	/* largest absolute difference */
+	unsigned long	kcm_ndisagree;	/* frames only one engine matched */
+} kv_cmpmask_t;
+
+typedef struct {
+	int		kce_frame;
+	kv_screen_t	kce_screen;
+} kv_cmpemit_t;
+
+typedef struct kv_compare {
+	kv_vidctx_t	*kc_other;	/* context using the other engines */
+	kv_engstate_t	kc_state;	/* its engines, while not in use */
+	boolean_t	kc_busy;	/* processing a frame */
+	char		kc_labels[2][128];	/* each context's engines */
+	hrtime_t	kc_time[2];	/* time spent in each context */
+	int		kc_nframes;	/* frames processed */
+	int		kc_ndiffer;	/* frames identified differently */
+	kv_cmpscore_t	kc_scores[2][KV_MAX_MASKS];
+	kv_cmpmask_t	kc_masks[KV_MAX_MASKS];
+	kv_cmpemit_t	kc_emits[2][KV_CMP_MAXEMITS];	/* unmatched */
+	int		kc_nemits[2];
+	int		kc_nemitted[2];	/* states emitted */
+	int		kc_nmismatched;	/* emitted states that don't match */
+	int		kc_diverged;	/* first mismatch, or -1 */
+	char		kc_divergence[128];	/* what it was */
+} kv_compare_t;
+
+static kv_cmpscore_t *kv_cmpscores;
+
+void
+kv_ident(img_t *image, kv_screen_t *ksp, kv_ident_t which)
+{
+	kv_ident_batch(&image, ksp, 1, which);
+}
+
+/*
+ * Identify the state of each of "nimages" frames, as kv_ident() would, storing
+ * the results in the corresponding entries of "ksps".  We compare each mask
+ * against all of the frames before moving on to the next mask, which keeps the
+ * mask in cache while the frames stream past it.  Each frame still sees the
+ * masks in the same order, so the results are identical to calling kv_ident()
+ * on each frame.
+ */
+void
+kv_ident_batch(img_t **images, kv_screen_t *ksps, int nimages,
+    kv_ident_t which)
+{
+	int i, j, c, k, ndone;
+	double score, checkthresh, confident;
+	kv_mask_t *kmp;
+	kv_screen_t *ksp;
+	kv_group_t *kgp;
+	kv_groupstate_t *kgsp;
+	uint8_t confirm[KV_MAXBATCH][KV_MAX_MASKS];
+	kv_groupstate_t groups[KV_MAXBATCH][KVC_NCATEGORIES][KV_MAXPLAYERS];
+	boolean_t indexed, grouped;
+
+	assert(nimages <= KV_MAXBATCH);
+	bzero(ksps, nimages * sizeof (ksps[0]));
+
+	/*
+	 * Use the index to pick the position and character masks worth
+	 * comparing, and skip the rest of each group once we've found a
+	 * confident match, unless we're debugging at a level where we want to
+	 * see every mask.
+	 */
+	indexed = grouped = kv_debug <= 3;
+	for (j = 0; indexed && j < nimages; j++) {
+		bzero(confirm[j], sizeof (confirm[j]));
+		if (which & KV_IDENT_POS)
+			kv_index_rank(images[j], KVC_POS, confirm[j]);
+		if (which & KV_IDENT_CHARS)
+			kv_index_rank(images[j], KVC_CHAR, confirm[j]);
+	}
+
+	/*
+	 * Evaluate each group's most recent winner first.  When the screen is
+	 * steady, that's the match, and it's usually a confident one.
+	 */
+	for (j = 0; grouped && j < nimages; j++) {
+		for (c = 0; c < KVC_NCATEGORIES; c++) {
+			for (k = 0; k < KV_MAXPLAYERS; k++) {
+				kgp = &kv_groups[c][k];
+				kgsp = &groups[j][c][k];
+				kgsp->kgs_first = -1;
+				kgsp->kgs_winner = -1;
+				kgsp->kgs_done = B_FALSE;
+
+				if (kgp->kg_nmasks == 0 || kgp->kg_last == -1)
+					continue;
+
+				kmp = &kv_masks[kgp->kg_last];
+				if (!kv_ident_wants(which, kmp) ||
+				    (indexed && kv_mask_indexed(kmp) &&
+				    !confirm[j][kgp->kg_last]))
+					continue;
+
+				kgsp->kgs_first = kv_mask_score(images[j], kmp);
+				kgp->kg_nevals++;
+				ksps[j].ks_nmasks++;
+				if (kgsp->kgs_first < kv_mask_confident(kmp)) {
+					kgsp->kgs_done = B_TRUE;
+					kgp->kg_nconfident++;
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < kv_nmasks; i++) {
+		kmp = &kv_masks[i];
+
+		if (!kv_ident_wants(which, kmp))
+			continue;
+
+		checkthresh = kv_mask_threshold(kmp);
+		confident = kv_mask_confident(kmp);
+		kgp = grouped ? kmp->km_group : NULL;
+
+		for (j = 0; j < nimages; j++) {
+			if (indexed && kv_mask_indexed(kmp) && !confirm[j][i])
+				continue;
+
+			if (kgp == NULL) {
+				kgsp = NULL;
+				score = kv_mask_score(images[j], kmp);
+				ksps[j].ks_nmasks++;
+			} else {
+				kgsp = &groups[j][kgp->kg_category]
+				    [kgp->kg_square - 1];
+				if (i == kgp->kg_last && kgsp->kgs_first >= 0) {
+					score = kgsp->kgs_first;
+				} else if (kgsp->kgs_done) {
+					kgp->kg_nskipped++;
+					continue;
+				} else {
+					score = kv_mask_score(images[j], kmp);
+					kgp->kg_nevals++;
+					ksps[j].ks_nmasks++;
+					if (score < confident) {
+						kgsp->kgs_done = B_TRUE;
+						kgp->kg_nconfident++;
+					}
+				}
+			}
+
+			if (kv_debug > 1) {
+				if (nimages > 1)
+					(void) printf("frame %d: ", j);
+				(void) printf("mask %s: %f\n", kmp->km_name,
+				    score);
+			}
+
+			kv_fr_record(KFR_SCORE, kv_fr_frames[j],
+			    score <= checkthresh, i, 0, score);
+
+			if (kv_cmpscores != NULL) {
+				kv_cmpscores[i].kcs_score = score;
+				kv_cmpscores[i].kcs_matched =
+				    score <= checkthresh;
+				kv_cmpscores[i].kcs_set = B_TRUE;
+			}
+
+			if (score > checkthresh)
+				continue;
+
+			if (kgsp != NULL && (kgsp->kgs_winner == -1 ||
+			    score < kgsp->kgs_best)) {
+				kgsp->kgs_winner = i;
+				kgsp->kgs_best = score;
+			}
+
+			PROBE3(mask__match, kmp->km_name, PROBE_SCORE(score),
+			    j);
+			kv_ident_matches(&ksps[j], kmp->km_name, score);
+		}
+	}
+
+	for (j = 0; grouped && j < nimages; j++) {
+		for (c = 0; c < KVC_NCATEGORIES; c++) {
+			for (k = 0; k < KV_MAXPLAYERS; k++) {
+				if (groups[j][c][k].kgs_winner != -1)
+					kv_groups[c][k].kg_last =
+					    groups[j][c][k].kgs_winner;
+			}
+		}
+	}
+
+	for (j = 0; j < nimages; j++) {
+		ksp = &ksps[j];
+		ndone = 0;
+		for (i = 0; i < ksp->ks_nplayers; i++) {
+			if (ksp->ks_players[i].kp_lapnum == 4)
+				ndone++;
+		}
+
+		if (ndone >= ksp->ks_nplayers - 1)
+			ksp->ks_events |= KVE_RACE_DONE;
+	}
+}
+
+/*
+ * Returns the range of rows [*minyp, *maxyp) covered by the masks in the
+ * categories selected by "which".
+ */
+void
+kv_mask_bounds(kv_ident_t which, unsigned int *minyp, unsigned int *maxyp)
+{
+	int i;
+	kv_mask_t *kmp;
+	unsigned int miny = UINT_MAX, maxy = 0;
+
+	for (i = 0; i < kv_nmasks; i++) {
+		kmp = &kv_masks[i];
+
+		if (KV_MASK_CHAR(kmp->km_name) && !(which & KV_IDENT_CHARS))
+			continue;
+		if (KV_MASK_LAKITU(kmp->km_name) && !(which & KV_IDENT_START))
+			continue;
+		if (KV_MASK_TRACK(kmp->km_name) && !(which & KV_IDENT_TRACK))
+			continue;
+		if (KV_MASK_ITEM(kmp->km_name) && !(which & KV_IDENT_ITEM))
+			continue;
+		if (KV_MASK_POS(kmp->km_name) && !(which & KV_IDENT_POS))
+			continue;
+
+		if (kmp->km_image->img_miny < miny)
+			miny = kmp->km_image->img_miny;
+		if (kmp->km_image->img_maxy > maxy)
+			maxy = kmp->km_image->img_maxy;
+	}
+
+	*minyp = miny == UINT_MAX ? 0 : miny;
+	*maxyp = maxy;
+}
+
+/*
+ * Returns the approximate luma (0-255) of the given pixel.
+ */
+static unsigned int
+kv_luma(img_t *image, unsigned int x, unsigned int y)
+{
+	img_planar_t *ip = image->img_planar;
+	img_pixel_t *px;
+	int luma;
+
+	if (ip != NULL) {
+		luma = ip->ip_data[0][y * ip->ip_linesize[0] + x];
+		luma = (luma - 16) * 255 / 219;
+		return (luma < 0 ? 0 : luma > 255 ? 255 : luma);
+	}
+
+	px = img_pixel(image, x, y);
+	return ((77 * px->r + 150 * px->g + 29 * px->b) >> 8);
+}
+
+/*
+ * Cheaply classify a frame based on a few global statistics so that we can
+ * skip mask matching on frames that can't possibly be part of a race.  We
+ * sample the frame on a coarse grid to compute its average luma, and we sample
+ * the black bar that divides the screen into top and bottom halves during a
+ * multiplayer race.  (3P and 4P races also have a vertical bar, but 2P races
+ * don't, so we don't look for it.)  A frame that's nearly black is a
+ * transition.  A frame whose divider is dark but which is otherwise noticeably
+ * brighter is a race.  Anything else (menus, character and track selection,
+ * replays) is "other".  Positions
+ * are computed relative to the 640x480 frames the masks were made from, mapped
+ * onto the frame by the current capture geometry.
+ */
+kv_scene_t
+kv_scene_classify(img_t *image)
+{
+	unsigned int x, y, x0, y0, x1, y1, w, h, n, sum, divsum, divn;
+	unsigned int divy, lum, divlum;
+	int ox, oy;
+
+	if (image->img_width == kv_geom.kcg_width &&
+	    image->img_height == kv_geom.kcg_height) {
+		ox = kv_geom.kcg_x0;
+		oy = kv_geom.kcg_y0;
+		w = kv_geom.kcg_maskwidth;
+		h = kv_geom.kcg_maskheight;
+	} else {
+		ox = oy = 0;
+		w = image->img_width;
+		h = image->img_height;
+	}
+
+	x0 = MAX(ox, 0);
+	y0 = MAX(oy, 0);
+	x1 = MIN(ox + (int)w, (int)image->img_width);
+	y1 = MIN(oy + (int)h, (int)image->img_height);
+
+	n = sum = 0;
+	for (y = y0 + 4; y < y1; y += 8) {
+		for (x = x0 + 4; x < x1; x += 8) {
+			sum += kv_luma(image, x, y);
+			n++;
+		}
+	}
+
+	if (n == 0)
+		return (KVSC_OTHER);
+
+	lum = sum / n;
+	if (lum < KV_SCENE_BLACK)
+		return (KVSC_BLACK);
+
+	/* The divider covers rows 236-241. */
+	divn = divsum = 0;
+	for (divy = oy + 237 * h / 480; divy < oy + 241 * h / 480 &&
+	    divy < y1; divy++) {
+		for (x = x0; x < x1; x += 4) {
+			divsum += kv_luma(image, x, divy);
+			divn++;
+		}
+	}
+
+	divlum = divn == 0 ? 255 : divsum / divn;
+	if (kv_debug > 2)
+		(void) printf("scene: luma %u, divider luma %u\n", lum, divlum);
+
+	if (divlum < KV_SCENE_DIVIDER && lum >= divlum + KV_SCENE_CONTRAST)
+		return (KVSC_RACE);
+
+	return (KVSC_OTHER);
+}
+
+const char *
+kv_scene_label(kv_scene_t scene)
+{
+	return (kv_scene_labels[scene]);
+}
+
+/*
+ * Work out the capture geometry of a frame by finding the game's picture in it:
+ * the range of rows and columns that aren't black on average.  Comparing that
+ * with where the picture sits in the mask geometry tells us how to map the
+ * masks onto the frame, whatever the capture's resolution and letterboxing.
+ * This fails for frames too dark to find the picture in, or in which it has an
+ * implausible shape, in which case the caller should try a later frame.  640x480
+ * frames are assumed to be in the mask geometry already.  "yscale" is the
+ * number of captured rows per row of the frame: 2 if the frame is a single
+ * field of interlaced video, and 1 otherwise.
+ */
+int
+kv_calibrate(img_t *image, unsigned int yscale, kv_capgeom_t *kcgp)
+{
+	unsigned int x, y, w, h, n, sum, px0, py0, px1, py1, pw, ph;
+
+	w = image->img_width;
+	h = image->img_height;
+	kcgp->kcg_width = w;
+	kcgp->kcg_height = h;
+
+	if (w == KV_MASK_WIDTH && h * yscale == KV_MASK_HEIGHT) {
+		kcgp->kcg_x0 = 0;
+		kcgp->kcg_y0 = 0;
+		kcgp->kcg_maskwidth = KV_MASK_WIDTH;
+		kcgp->kcg_maskheight = KV_MASK_HEIGHT / yscale;
+		return (0);
+	}
+
+	px0 = py0 = UINT_MAX;
+	px1 = py1 = 0;
+
+	for (y = 0; y < h; y++) {
+		for (x = 2, n = sum = 0; x < w; x += 4, n++)
+			sum += kv_luma(image, x, y);
+		if (n == 0 || sum / n <= KV_SCENE_BLACK)
+			continue;
+		py0 = MIN(py0, y);
+		py1 = y + 1;
+	}
+
+	for (x = 0; x < w; x++) {
+		for (y = 2, n = sum = 0; y < h; y += 4, n++)
+			sum += kv_luma(image, x, y);
+		if (n == 0 || sum / n <= KV_SCENE_BLACK)
+			continue;
+		px0 = MIN(px0, x);
+		px1 = x + 1;
+	}
+
+	if (px0 == UINT_MAX || py0 == UINT_MAX)
+		return (-1);
+
+	/*
+	 * The picture should cover most of the frame and have roughly the
+	 * shape of a TV picture, possibly stretched to widescreen.
+	 */
+	pw = px1 - px0;
+	ph = py1 - py0;
+	if (pw * ph < w * h / 2 || pw * 10 < ph * yscale * 12 ||
+	    pw * 10 > ph * yscale * 18)
+		return (-1);
+
+	kcgp->kcg_maskwidth = (pw * KV_MASK_WIDTH + KV_PICTURE_WIDTH / 2) /
+	    KV_PICTURE_WIDTH;
+	kcgp->kcg_maskheight = (ph * KV_MASK_HEIGHT + KV_PICTURE_HEIGHT / 2) /
+	    KV_PICTURE_HEIGHT;
+	kcgp->kcg_x0 = (int)px0 - (int)((pw * KV_PICTURE_X0 +
+	    KV_PICTURE_WIDTH / 2) / KV_PICTURE_WIDTH);
+	kcgp->kcg_y0 = (int)py0 - (int)((ph * KV_PICTURE_Y0 +
+	    KV_PICTURE_HEIGHT / 2) / KV_PICTURE_HEIGHT);
+	return (0);
+}
+
+/*
+ * Parse a mask geometry of the form "WIDTHxHEIGHT+X+Y" (X and Y may be
+ * negative), describing where the 640x480 mask geometry falls within frames.
+ * The frame size is filled in from the frames themselves.
+ */
+int
+kv_capgeom_parse(const char *str, kv_capgeom_t *kcgp)
+{
+	int end = -1;
+
+	bzero(kcgp, sizeof (*kcgp));
+	if (sscanf(str, "%ux%u%d%d%n", &kcgp->kcg_maskwidth,
+	    &kcgp->kcg_maskheight, &kcgp->kcg_x0, &kcgp->kcg_y0, &end) != 4 ||
+	    end != strlen(str) || (str[strcspn(str, "+-")] == '\0') ||
+	    kcgp->kcg_maskwidth == 0 || kcgp->kcg_maskheight == 0) {
+		warnx("invalid geometry \"%s\" (expected WIDTHxHEIGHT+X+Y)",
+		    str);
+		return (-1);
+	}
+
+	return (0);
+}
+
+static const char *
+kv_mask_ext(const char *name, const char *ext, char *buf, size_t bufsz)
+{
+	const char *p;
+
+	p = strrchr(name, '.');
+	(void) snprintf(buf, bufsz, "%.*s%s",
+	    (int)(p == NULL ? strlen(name) : p - name), name, ext);
+	return (buf);
+}
+
+/*
+ * Returns the hash of a mask as it was loaded, before any rescaling.  The mask
+ * cache records this for each mask it was built from.
+ */
+static uint32_t
+kv_mask_source_hash(kv_mask_t *kmp)
+{
+	return (kv_mask_hash(kmp->km_source != NULL ?
+	    kmp->km_source : kmp->km_image));
+}
+
+/*
+ * Load a mask set previously saved by kv_geometry_save() into "images", in the
+ * order of kv_masks.  The set must cover every mask we've loaded, and each one
+ * must have been rescaled from the same mask we've loaded, so a cache built
+ * from since-changed masks is ignored.
+ */
+static int
+kv_geometry_load(const char *dir, img_t **images)
+{
+	FILE *fp;
+	char path[PATH_MAX], name[64], file[64];
+	unsigned int hash, x0, y0;
+	int i, nloaded = 0;
+
+	if (snprintf(path, sizeof (path), "%s/%s", dir,
+	    KV_GEOMCACHE_INDEX) >= sizeof (path) ||
+	    (fp = fopen(path, "r")) == NULL)
+		return (-1);
+
+	bzero(images, kv_nmasks * sizeof (images[0]));
+	while (fscanf(fp, "%63s %x %u %u", name, &hash, &x0, &y0) == 4) {
+		for (i = 0; i < kv_nmasks; i++) {
+			if (strcmp(kv_masks[i].km_name, name) == 0)
+				break;
+		}
+
+		if (i == kv_nmasks || images[i] != NULL)
+			continue;
+
+		if (hash != kv_mask_source_hash(&kv_masks[i])) {
+			if (kv_debug > 0)
+				(void) fprintf(stderr, "mask %s has changed "
+				    "since %s was saved\n", name, dir);
+			break;
+		}
+
+		if (snprintf(path, sizeof (path), "%s/%s", dir,
+		    kv_mask_ext(name, ".ppm", file, sizeof (file))) >=
+		    sizeof (path) || (images[i] = img_read(path)) == NULL)
+			break;
+
+		img_relocate(images[i], x0, y0);
+		nloaded++;
+	}
+
+	(void) fclose(fp);
+
+	if (nloaded == kv_nmasks)
+		return (0);
+
+	if (kv_debug > 0)
+		(void) fprintf(stderr, "ignoring stale or incomplete mask "
+		    "cache %s\n", dir);
+
+	for (i = 0; i < kv_nmasks; i++)
+		img_free(images[i]);
+
+	return (-1);
+}
+
+/*
+ * Save a rescaled mask set, as PPM images (which are quick to read back) and an
+ * index recording where each one goes and the hash of the mask it was rescaled
+ * from.  The index is written last, so that an interrupted save is never used.
+ */
+static void
+kv_geometry_save(const char *cachedir, const char *dir, img_t **images)
+{
+	FILE *fp;
+	char path[PATH_MAX], tmppath[PATH_MAX], file[64];
+	int i;
+
+	if ((mkdir(cachedir, 0777) != 0 && errno != EEXIST) ||
+	    (mkdir(dir, 0777) != 0 && errno != EEXIST)) {
+		warn("failed to create mask cache %s", dir);
+		return;
+	}
+
+	for (i = 0; i < kv_nmasks; i++) {
+		if (snprintf(path, sizeof (path), "%s/%s", dir,
+		    kv_mask_ext(kv_masks[i].km_name, ".ppm", file,
+		    sizeof (file))) >= sizeof (path)) {
+			warnx("mask cache path too long: %s", dir);
+			return;
+		}
+
+		if (img_write(images[i], path) != 0)
+			return;
+	}
+
+	if (snprintf(path, sizeof (path), "%s/%s", dir,
+	    KV_GEOMCACHE_INDEX) >= sizeof (path) ||
+	    snprintf(tmppath, sizeof (tmppath), "%s.tmp", path) >=
+	    sizeof (tmppath)) {
+		warnx("mask cache path too long: %s", dir);
+		return;
+	}
+
+	if ((fp = fopen(tmppath, "w")) == NULL) {
+		warn("failed to write %s", tmppath);
+		return;
+	}
+
+	for (i = 0; i < kv_nmasks; i++)
+		(void) fprintf(fp, "%s %08x %u %u\n", kv_masks[i].km_name,
+		    kv_mask_source_hash(&kv_masks[i]),
+		    images[i]->img_x0, images[i]->img_y0);
+
+	if (fclose(fp) != 0 || rename(tmppath, path) != 0) {
+		warn("failed to write %s", path);
+		(void) unlink(tmppath);
+	}
+}
+
+/*
+ * Rescale and translate the masks (once) for frames with the given capture
+ * geometry.  The masks' caches and the mask index are rebuilt to match, and
+ * compiled kernels are only used in the original geometry.  If "cachedir" isn't
+ * NULL, we look there for a mask set already rescaled for this geometry (say,
+ * by an earlier run on a video from the same capture device), and save the
+ * set there otherwise.
+ */
+int
+kv_geometry(const kv_capgeom_t *kcgp, const char *cachedir)
+{
+	img_t *images[KV_MAX_MASKS];
+	char dir[PATH_MAX];
+	kv_mask_t *kmp;
+	boolean_t native;
+	int i, j;
+
+	if (kcgp->kcg_width == kv_geom.kcg_width &&
+	    kcgp->kcg_height == kv_geom.kcg_height &&
+	    kcgp->kcg_x0 == kv_geom.kcg_x0 && kcgp->kcg_y0 == kv_geom.kcg_y0 &&
+	    kcgp->kcg_maskwidth == kv_geom.kcg_maskwidth &&
+	    kcgp->kcg_maskheight == kv_geom.kcg_maskheight)
+		return (0);
+
+	native = kcgp->kcg_x0 == 0 && kcgp->kcg_y0 == 0 &&
+	    kcgp->kcg_maskwidth == KV_MASK_WIDTH &&
+	    kcgp->kcg_maskheight == KV_MASK_HEIGHT &&
+	    kcgp->kcg_width >= KV_MASK_WIDTH &&
+	    kcgp->kcg_height >= KV_MASK_HEIGHT;
+
+	if (!native) {
+		if (snprintf(dir, sizeof (dir), "%s/%ux%u_%ux%u%+d%+d",
+		    cachedir != NULL ? cachedir : ".", kcgp->kcg_width,
+		    kcgp->kcg_height, kcgp->kcg_maskwidth,
+		    kcgp->kcg_maskheight, kcgp->kcg_x0, kcgp->kcg_y0) >=
+		    sizeof (dir)) {
+			warnx("mask cache directory name too long: %s",
+			    cachedir);
+			return (-1);
+		}
+
+		if (cachedir != NULL && kv_geometry_load(dir, images) == 0) {
+			if (kv_debug > 0)
+				(void) fprintf(stderr, "using masks from %s\n",
+				    dir);
+		} else {
+			for (i = 0; i < kv_nmasks; i++) {
+				kmp = &kv_masks[i];
+				images[i] = img_rescale(kmp->km_source != NULL ?
+				    kmp->km_source : kmp->km_image,
+				    kcgp->kcg_x0, kcgp->kcg_y0,
+				    kcgp->kcg_maskwidth, kcgp->kcg_maskheight,
+				    kcgp->kcg_width, kcgp->kcg_height);
+				if (images[i] == NULL)
+					break;
+			}
+
+			if (i < kv_nmasks) {
+				warn("failed to rescale mask %s",
+				    kv_masks[i].km_name);
+				while (--i >= 0)
+					img_free(images[i]);
+				return (-1);
+			}
+
+			if (cachedir != NULL)
+				kv_geometry_save(cachedir, dir, images);
+		}
+	}
+
+	for (i = 0; i < kv_nmasks; i++) {
+		kmp = &kv_masks[i];
+		if (kmp->km_source != NULL) {
+			img_free(kmp->km_image);
+			kmp->km_image = kmp->km_source;
+			kmp->km_source = NULL;
+		}
+
+		if (!native) {
+			kmp->km_source = kmp->km_image;
+			kmp->km_image = images[i];
+		}
+
+		img_yuvmask_free(kmp->km_yuv);
+		kmp->km_yuv = NULL;
+		for (j = 0; j < KVM_NENGINES; j++) {
+			img_sig_free(kmp->km_sig[j]);
+			kmp->km_sig[j] = NULL;
+		}
+		kv_feat_free(kmp->km_feat);
+		kmp->km_feat = NULL;
+	}
+
+	kv_geom = *kcgp;
+	kv_index_build(KVC_POS);
+	kv_index_build(KVC_CHAR);
+
+	if (kv_debug > 0)
+		(void) fprintf(stderr, "masks scaled to %ux%u%+d%+d for "
+		    "%ux%u frames\n", kv_geom.kcg_maskwidth,
+		    kv_geom.kcg_maskheight, kv_geom.kcg_x0, kv_geom.kcg_y0,
+		    kv_geom.kcg_width, kv_geom.kcg_height);
+
+	return (0);
+}
+
+/*
+ * Update the screen state (ksp) to reflect that a mask matched this frame.
+ */
+void
+kv_ident_matches(kv_screen_t *ksp, const char *mask, double score)
+{
+	unsigned int pos, square;
+	char *p;
+	kv_player_t *kpp;
+	kv_item_t item;
+	char buf[64];
+
+	if (kv_debug > 1)
+		(void) printf("%s matches\n", mask);
+
+	(void) strncpy(buf, mask, sizeof (buf));
+
+	if (strncmp(buf, "track_", sizeof ("track_") - 1) == 0) {
+		if (ksp->ks_track[0] != '\0' && ksp->ks_trackscore < score)
+			return;
+
+		(void) strtok(buf + sizeof ("track_"), "_.");
+		(void) strncpy(ksp->ks_track, buf + sizeof ("track_") - 1,
+		    sizeof (ksp->ks_track));
+		ksp->ks_trackscore = score;
+		return;
+	}
+
+	if (sscanf(buf, "pos%u_square%u", &pos, &square) == 2 &&
+	    pos <= KV_MAXPLAYERS && square <= KV_MAXPLAYERS) {
+		kpp = &ksp->ks_players[square - 1];
+
+		if (square > ksp->ks_nplayers)
+			ksp->ks_nplayers = square;
+		else if (kpp->kp_place != 0 && kpp->kp_placescore < score)
+			return;
+
+		ksp->ks_players[square - 1].kp_place = pos;
+		kpp->kp_placescore = score;
+
+		if (strcmp(buf + sizeof ("pos1_square1") - 1,
+		    "_final.png") == 0)
+			kpp->kp_lapnum = 4;
+		else if (kpp->kp_lapnum == 4)
+			kpp->kp_lapnum = 0;
+
+		return;
+	}
+
+	if (strncmp(buf, "char_", sizeof ("char_") - 1) == 0) {
+		p = strchr(buf + sizeof ("char_") - 1, '_');
+		if (p == NULL)
+			return;
+
+		*p = '\0';
+		if (sscanf(p + 1, "%u", &square) != 1 ||
+		    square > KV_MAXPLAYERS)
+			return;
+
+		kpp = &ksp->ks_players[square - 1];
+
+		if (kpp->kp_character[0] != '\0' && kpp->kp_charscore < score)
+			return;
+
+		if (square > ksp->ks_nplayers)
+			ksp->ks_nplayers = square;
+
+		(void) strncpy(kpp->kp_character, buf + sizeof ("char_") - 1,
+		    sizeof (kpp->kp_character));
+		kpp->kp_charscore = score;
+		return;
+	}
+
+	if (strncmp(buf, "lakitu_start", sizeof ("lakitu_start") - 1) == 0) {
+		ksp->ks_events |= KVE_RACE_START;
+		return;
+	}
+
+	if (strncmp(buf, "item_", sizeof ("item_") - 1) == 0) {
+		p = strrchr(buf, '_');
+		if (p == buf + sizeof ("item_") - 1)
+			return;
+
+		*p = '\0';
+		if (sscanf(p + 1, "%u", &square) != 1 || square > KV_MAXPLAYERS)
+			return;
+
+		if (square > ksp->ks_nplayers)
+			return;
+
+		/*
+		 * We only want to take the KVI_UNKNOWN match if there's no
+		 * more specific item match (regardless of the score).
+		 */
+		kpp = &ksp->ks_players[square - 1];
+		item = kv_mask_item(buf + sizeof ("item_") - 1);
+		if (item == KVI_UNKNOWN && kpp->kp_item != KVI_NONE)
+			return;
+
+		/*
+		 * If we have a non-blank item with a worse score than what
+		 * we've already got (and that's not just because the existing
+		 * item is NONE or UNKNOWN), then we'll defer to what we've
+		 * already got.
+		 */
+		if (kpp->kp_itemscore < score &&
+		    (kpp->kp_item != KVI_NONE && kpp->kp_item != KVI_UNKNOWN))
+			return;
+
+		kpp->kp_item = kv_mask_item(buf + sizeof ("item_") - 1);
+		kpp->kp_itemscore = score;
+
+		if (kv_debug > 2)
+			(void) printf("player %d: taking item %s\n",
+			    square, kv_item_label(kpp->kp_item));
+		return;
+	}
+}
+
+/*
+ * Returns whether the given screen is invalid for the same race as pksp (and if
+ * so, why).  This is used to skip frames that show transient invalid state.
+ */
+kv_invalid_t
+kv_screen_invalid(kv_screen_t *ksp, kv_screen_t *pksp, kv_screen_t *raceksp)
 {
 	int i, j;
 
 	/*
-	 * The number of players shouldn't actually change during a race, but we
-	 * can fail to detect the correct number of players when the position
-	 * numerals are transitioning.
+	 * The number of players shouldn't actually change during a race, but we
+	 * can fail to detect the correct number of players when the position
+	 * numerals are transitioning.
+	 */
+	if (ksp->ks_nplayers != pksp->ks_nplayers)
+		return (KVV_NPLAYERS);
+
+	/*
+	 * On most tracks, we ignore frames where we couldn't detect any
+	 * players' ranks, but this would prohibit reporting results for Yoshi
+	 * Valley until all players are done.  On the other hand, on Yoshi
+	 * Valley, we ignore all frames until someone's finished.
+	 */
+	if (raceksp->ks_track[0] != 'y') {
+		for (i = 0; i < ksp->ks_nplayers; i++) {
+			if (ksp->ks_players[i].kp_place == 0)
+				return (KVV_NOPLACE);
+		}
+	} else {
+		for (i = 0; i < ksp->ks_nplayers; i++) {
+			if (ksp->ks_players[i].kp_lapnum == 4)
+				break;
+		}
+
+		if (i == ksp->ks_nplayers)
+			return (KVV_NOTDONE);
+	}
+
+	for (i = 0; i < ksp->ks_nplayers; i++) {
+		if (pksp->ks_players[i].kp_lapnum != 0 &&
+		    ksp->ks_players[i].kp_lapnum == 0)
+			return (KVV_LAPLOST);
+	}
+
+	for (i = 0; i < ksp->ks_nplayers; i++) {
+		if (raceksp->ks_track[0] == 'y' &&
+		    ksp->ks_players[i].kp_place == 0)
+			continue;
+
+		if (ksp->ks_players[i].kp_place > ksp->ks_nplayers)
+			return (KVV_BADPLACE);
+
+		for (j = i + 1; j < ksp->ks_nplayers; j++) {
+			if (ksp->ks_players[i].kp_place ==
+			    ksp->ks_players[j].kp_place)
+				return (KVV_DUPPLACE);
+		}
+	}
+
+	/*
+	 * In some courses, it's possible to see a yellow sky and mistake that
+	 * for a final lap number, indicating that someone has completed the
+	 * race.  Ignore frames where a player in rank X has not finished, but a
+	 * player in rank Y > X has.
+	 */
+	int mindone = ksp->ks_nplayers;
+
+	for (i = 0; i < ksp->ks_nplayers; i++) {
+		if (ksp->ks_players[i].kp_lapnum != 4 &&
+		    ksp->ks_players[i].kp_place > 0 &&
+		    ksp->ks_players[i].kp_place < mindone)
+			mindone = ksp->ks_players[i].kp_place;
+	}
+
+	for (i = 0; i < ksp->ks_nplayers; i++) {
+		if (ksp->ks_players[i].kp_lapnum == 4 &&
+		    ksp->ks_players[i].kp_place > mindone)
+			return (KVV_FINISHORDER);
+	}
+
+	return (KVV_VALID);
+}
+
+/*
+ * Returns true if the two game states are logically different.  Two game states
+ * are different if the players' positions or lap numbers have changed.  We
+ * ignore changes in the track and characters, since those are only sometimes
+ * detected properly.  Higher-level code should be checking whether the race has
+ * changed by looking for the race start event.
+ */
+int
+kv_screen_compare(kv_screen_t *ksp, kv_screen_t *pksp, kv_screen_t *raceksp,
+    kv_flags_t flags)
+{
+	int i;
+	kv_player_t *kpp, *pkpp;
+
+	for (i = 0; i < ksp->ks_nplayers; i++) {
+		kpp = &ksp->ks_players[i];
+		pkpp = &pksp->ks_players[i];
+
+		/*
+		 * Ignore position changes in Yoshi Valley.
+		 */
+		if (kpp->kp_lapnum != pkpp->kp_lapnum ||
+		    (raceksp->ks_track[0] != 'y' &&
+		    kpp->kp_place != pkpp->kp_place))
+			return (1);
+
+		if ((flags & KVF_COMPARE_ITEMS) != 0) {
+			if (kpp->kp_item != pkpp->kp_item)
+				return (1);
+		}
+
+	}
+
+	return (0);
+}
+
+static int
+kv_screen_compare_items(kv_screen_t *ksp, kv_screen_t *pksp, kv_flags_t flags)
+{
+	int i;
+	kv_player_t *kpp, *pkpp;
+	kv_itemstate_t state, pstate;
+
+	for (i = 0; i < ksp->ks_nplayers; i++) {
+		kpp = &ksp->ks_players[i];
+		pkpp = &pksp->ks_players[i];
+
+		if (kv_debug > 2)
+			(void) printf("player %d: pstate %d, state %d\n",
+			    i + 1, pkpp->kp_itemstate, kpp->kp_itemstate);
+
+		if ((flags & KVF_COMPARE_ITEMSTATE) != 0) {
+			pstate = pkpp->kp_itemstate;
+			if (pstate == KVS_WAIT_ITEM)
+				pstate = KVS_SLOTMACHINE;
+			if (pstate == KVS_WAIT_USE)
+				pstate = KVS_NONE;
+
+			state = kpp->kp_itemstate;
+			if (state == KVS_WAIT_ITEM)
+				state = KVS_SLOTMACHINE;
+			if (state == KVS_WAIT_USE)
+				state = KVS_NONE;
+
+			if (state != pstate)
+				return (1);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Print a given frame state.  If raceksp is specified, it will be used to print
+ * values that are unknown in the current frame.
+ */
+void
+kv_screen_print(const char *source, int frame, int msec, kv_screen_t *ksp,
+    kv_screen_t *raceksp, FILE *out)
+{
+	int i;
+	kv_player_t *kpp;
+	char *trackname, *charname;
+
+	assert(ksp->ks_nplayers <= KV_MAXPLAYERS);
+
+	(void) fprintf(out, "%s (time %dm:%02d.%03ds): ", source,
+	    msec / MILLISEC / 60, msec / MILLISEC % 60, msec % MILLISEC);
+
+	if (ksp->ks_events & KVE_RACE_START)
+		(void) fprintf(out, "Race starting!\n");
+	if (ksp->ks_events & KVE_RACE_DONE)
+		(void) fprintf(out, "Race has finished.\n");
+
+	trackname = ksp->ks_track;
+	if (trackname[0] == '\0' && raceksp != NULL)
+		trackname = raceksp->ks_track;
+	if (trackname[0] == '\0')
+		trackname = "Unknown Track";
+
+	(void) fprintf(out, "%d players: %s\n", ksp->ks_nplayers, trackname);
+
+	if (ksp->ks_nplayers == 0)
+		return;
+
+	(void) fprintf(out, "%-8s    %-32s    %-4s    %-7s    %-4s\n", "",
+	    "Character", "Posn", "Lap", "Item");
+
+	for (i = 0; i < ksp->ks_nplayers; i++) {
+		(void) fprintf(out, "Player %d    ", i + 1);
+
+		kpp = &ksp->ks_players[i];
+		charname = kpp->kp_character;
+		if (charname[0] == '\0' && raceksp != NULL)
+			charname = raceksp->ks_players[i].kp_character;
+		if (charname[0] == '\0')
+			charname = "?";
+
+		(void) fprintf(out, "%-32s    ", charname);
+
+		switch (kpp->kp_place) {
+		case 0:
+			(void) fprintf(out, "?   ");
+			break;
+		case 1:
+			(void) fprintf(out, "1st ");
+			break;
+		case 2:
+			(void) fprintf(out, "2nd ");
+			break;
+		case 3:
+			(void) fprintf(out, "3rd ");
+			break;
+		case 4:
+			(void) fprintf(out, "4th ");
+			break;
+		default:
+			assert(0 && "invalid position");
+		}
+
+		(void) fprintf(out, "    ");
+
+		switch (kpp->kp_lapnum) {
+		case 0:
+			(void) fprintf(out, "%-7s", "");
+			break;
+		case 4:
+			(void) fprintf(out, "%-7s", "Done");
+			break;
+		default:
+			assert(kpp->kp_lapnum > 0 && kpp->kp_lapnum < 4);
+			(void) fprintf(out, "Lap %d/3", kpp->kp_lapnum);
+		}
+
+		(void) fprintf(out, "    ");
+
+		switch (kpp->kp_itemstate) {
+		case KVS_NONE:
+		case KVS_WAIT_USE:
+			(void) fprintf(out, "-");
+			break;
+		case KVS_SLOTMACHINE:
+		case KVS_WAIT_ITEM:
+			(void) fprintf(out, "slotmachine");
+			break;
+		case KVS_HAVE_ITEM:
+			(void) fprintf(out, "got %s",
+			    kv_item_label(kpp->kp_item));
+			break;
+		default:
+			assert(0 && "invalid player flags");
+		}
+
+		if (kv_debug > 0)
+			(void) fprintf(out, " (%s)",
+			    kv_item_label(kpp->kp_item));
+		(void) fprintf(out, "\n");
+	}
+
+	(void) fflush(out);
+}
+
+/*
+ * Like kv_screen_print, but emits JSON.
+ */
+void
+kv_screen_json(const char *source, int frame, int msec, kv_screen_t *ksp,
+    kv_screen_t *raceksp, FILE *out)
+{
+	int i;
+	kv_player_t *kpp;
+	char *trackname, *charname;
+
+	assert(ksp->ks_nplayers <= KV_MAXPLAYERS);
+
+	(void) fprintf(out, "{ \"source\": \"%s\", \"time\": %d, \"frame\": %d, ",
+	    source, msec, frame);
+
+	if (ksp->ks_events & KVE_RACE_START)
+		(void) fprintf(out, "\"start\": true, ");
+	if (ksp->ks_events & KVE_RACE_DONE)
+		(void) fprintf(out, "\"done\": true, ");
+
+	trackname = ksp->ks_track;
+	if (trackname[0] == '\0' && raceksp != NULL)
+		trackname = raceksp->ks_track;
+	if (trackname[0] == '\0')
+		trackname = "Unknown Track";
+
+	if (ksp->ks_nplayers > 0)
+		(void) fprintf(out, "\"players\": [ ");
+
+	for (i = 0; i < ksp->ks_nplayers; i++) {
+		kpp = &ksp->ks_players[i];
+		if (raceksp != NULL)
+			charname = raceksp->ks_players[i].kp_character;
+		else if (kpp->kp_character)
+			charname = kpp->kp_character;
+		else
+			charname = "?";
+
+		(void) fprintf(out, "{ ");
+
+		if (kpp->kp_place != 0)
+			(void) fprintf(out, "\"position\": %d, ",
+			    kpp->kp_place);
+
+		if (kpp->kp_lapnum != 0)
+			(void) fprintf(out, "\"lap\": %d, ", kpp->kp_lapnum);
+
+		if (kpp->kp_itemstate == KVS_SLOTMACHINE ||
+		    kpp->kp_itemstate == KVS_WAIT_ITEM)
+			(void) fprintf(out, "\"itemstate\": \"slotmachine\", ");
+		else if (kpp->kp_itemstate == KVS_HAVE_ITEM)
+			(void) fprintf(out, "\"itemstate\": \"%s\", ",
+			    kv_item_label(kpp->kp_item));
+
+		(void) fprintf(out, "\"character\": \"%s\" }", charname);
+
+		if (i != ksp->ks_nplayers - 1)
+			(void) fprintf(out, ", ");
+	}
+
+	if (ksp->ks_nplayers > 0)
+		(void) fprintf(out, "], ");
+
+	(void) fprintf(out, " \"track\": \"%s\" }\n", trackname);
+	(void) fflush(out);
+}
+
+kv_vidctx_t *
+kv_vidctx_init(const char *rootdir, kv_emit_f emit, const char *dbgdir,
+    kv_flags_t flags)
+{
+	kv_vidctx_t *kvp;
+
+	if (kv_init(rootdir) != 0) {
+		warnx("failed to initialize masks");
+		return (NULL);
+	}
+
+	if ((kvp = calloc(1, sizeof (*kvp))) == NULL) {
+		warn("calloc");
+		return (NULL);
+	}
+
+	kvp->kv_last_start = -1;
+	kvp->kv_nwriters = 2;
+	kvp->kv_pnglevel = -1;
+	kvp->kv_yscale = 1;
+	kvp->kv_frdumpat = -1;
+	kvp->kv_emit = emit;
+	kvp->kv_flags = flags;
+	if (dbgdir != NULL)
+		(void) strncpy(kvp->kv_dbgdir, dbgdir, sizeof (kvp->kv_dbgdir));
+	return (kvp);
+}
+
+/*
+ * While processing frames outside a race, we store a ringbuffer of the last
+ * KV_STARTFRAMES worth of frame details in kv_startbuffer.  When we do finally
+ * see a start frame, we call this function to look back at the recent frames
+ * and pick the best character match for each square among all of the recent
+ * frames.  This technique is important to be able to identify characters in the
+ * face of things like smoke that distort their images.
+ */
+static void
+kv_vidctx_chars(kv_vidctx_t *kvp, kv_screen_t *ksp, int i)
+{
+	kv_screen_t *pksp;
+	int j, k;
+
+	for (j = (i + 1) % KV_STARTFRAMES; j != (i % KV_STARTFRAMES);
+	    j = (j + 1) % KV_STARTFRAMES) {
+		pksp = &kvp->kv_startbuffer[j];
+
+		for (k = 0; k < KV_MAXPLAYERS; k++) {
+			if (pksp->ks_players[k].kp_character[0] == '\0' ||
+			    (ksp->ks_players[k].kp_charscore > 0 &&
+			    pksp->ks_players[k].kp_charscore >
+			    ksp->ks_players[k].kp_charscore))
+				continue;
+
+			if (k > ksp->ks_nplayers)
+				ksp->ks_nplayers = k;
+
+			bcopy(&pksp->ks_players[k], &ksp->ks_players[k],
+			    sizeof (pksp->ks_players[k]));
+		}
+	}
+}
+
+/*
+ * Record identification in the flight recorder (see kv_fr_record()), writing
+ * dumps into "dir".  Besides dumps requested with kv_recorder_request(), we
+ * dump automatically KV_FR_AFTER frames after an anomaly: an aborted race, an
+ * unexpected item state transition, or a long run of invalid frames.
+ */
+int
+kv_vidctx_recorder(kv_vidctx_t *kvp, const char *dir)
+{
+	if (strlen(dir) >= sizeof (kvp->kv_frdir))
+		return (-1);
+
+	(void) strcpy(kvp->kv_frdir, dir);
+	kv_fr_next = 0;
+	kv_fr_enabled = B_TRUE;
+	return (0);
+}
+
+/*
+ * Note an anomaly at frame "i", to be dumped once we've recorded what follows.
+ */
+static void
+kv_vidctx_anomaly(kv_vidctx_t *kvp, int i, const char *reason)
+{
+	if (kvp->kv_frdir[0] == '\0' || kvp->kv_frdumpat != -1 ||
+	    kvp->kv_frndumps == KV_FR_MAXDUMPS)
+		return;
+
+	kvp->kv_frdumpat = i + KV_FR_AFTER;
+	kvp->kv_frevent = i;
+	kvp->kv_frreason = reason;
+	if (++kvp->kv_frndumps == KV_FR_MAXDUMPS)
+		warnx("recorder: no more automatic dumps after this one");
+}
+
+/*
+ * Called before processing frame "i" to write any dump that's due.
+ */
+static void
+kv_vidctx_recorder_check(kv_vidctx_t *kvp, int i)
+{
+	char buf[PATH_MAX];
+	int len;
+
+	if (kvp->kv_frdir[0] == '\0')
+		return;
+
+	if (kv_fr_requested) {
+		kv_fr_requested = 0;
+		len = snprintf(buf, sizeof (buf), "%s/request-%d.kvfr",
+		    kvp->kv_frdir, i);
+	} else if (kvp->kv_frdumpat != -1 && i >= kvp->kv_frdumpat) {
+		len = snprintf(buf, sizeof (buf), "%s/%s-%d.kvfr",
+		    kvp->kv_frdir, kvp->kv_frreason, kvp->kv_frevent);
+		kvp->kv_frdumpat = -1;
+	} else {
+		return;
+	}
+
+	if (len >= sizeof (buf)) {
+		warnx("recorder: dump file name too long in %s",
+		    kvp->kv_frdir);
+		return;
+	}
+
+	if (kv_recorder_dump(buf) == 0)
+		(void) fprintf(stderr, "recorder: wrote %s\n", buf);
+}
+
+/*
+ * Note what we decided to do with frame "i", for kv_vidctx_stats() and the
+ * flight recorder.
+ */
+static void
+kv_vidctx_decide(kv_vidctx_t *kvp, int i, kv_frdecision_t decision,
+    unsigned int b, int c)
+{
+	kvp->kv_ndecisions[decision]++;
+	kv_fr_record(KFR_DECISION, i, decision, b, c, 0);
+}
+
+static void
+kv_vidctx_items(kv_vidctx_t *kvp, int frame, kv_screen_t *ksp,
+    kv_screen_t *pksp, int i)
+{
+	kv_player_t *pkpp, *kpp;
+	kv_item_t item;
+	kv_itemstate_t state;
+	
+	pkpp = &pksp->ks_players[i];
+	kpp = &ksp->ks_players[i];
+	item = kpp->kp_item;
+	state = pkpp->kp_itemstate;
+
+	switch (pkpp->kp_itemstate) {
+	case KVS_NONE:
+		if (item != KVI_NONE && item != KVI_BLANK) {
+			state = KVS_SLOTMACHINE;
+		}
+		break;
+
+	case KVS_SLOTMACHINE:
+		if (item == KVI_NONE) {
+			state = KVS_NONE;
+			kv_vidctx_anomaly(kvp, frame, "item");
+			if (kv_debug > 0)
+				warnx("unexpected transition transition from "
+				    "waiting for item box to no item box");
+		} else if (item == KVI_BLANK) {
+			state = KVS_WAIT_ITEM;
+		}
+		break;
+
+	case KVS_WAIT_ITEM:
+		if (item == KVI_NONE) {
+			state = KVS_NONE;
+			kv_vidctx_anomaly(kvp, frame, "item");
+			if (kv_debug > 0)
+				warnx("unexpected transition transition from "
+				    "waiting for item to no item box");
+		} else if (item >= KVI_REALITEM_MIN) {
+			state = KVS_HAVE_ITEM;
+		}
+		break;
+
+	case KVS_HAVE_ITEM:
+		state = KVS_WAIT_USE;
+		break;
+
+	case KVS_WAIT_USE:
+		if (item == KVI_NONE)
+			state = KVS_NONE;
+		break;
+
+	default:
+		assert(0 && "invalid item state");
+	}
+
+	if (pkpp->kp_itemstate != state) {
+		PROBE3(state__change, i + 1, pkpp->kp_itemstate, state);
+		kv_fr_record(KFR_ITEM, frame, i + 1, item,
+		    pkpp->kp_itemstate << 8 | state, 0);
+		if (kv_debug > 0)
+			(void) printf("player %d: got item %s in state %d "
+			    "=> state %d\n", i + 1, kv_item_label(item),
+			    pkpp->kp_itemstate, state);
+	}
+	kpp->kp_itemstate = state;
+}
+
+/*
+ * In realtime mode, frame "i" is due (i - kv_rt_frame) frame-times after
+ * kv_rt_origin.  If we're ahead of that, we'd just be waiting on the input, so
+ * we move the origin up to now.  If we're behind, we pick a degradation level
+ * based on how many frames behind we are.  We escalate immediately, but only
+ * step back down one level per frame once we've caught up, so that one slow
+ * frame doesn't leave us thrashing between levels.
+ */
+static void
+kv_vidctx_deadline(kv_vidctx_t *kvp, int i)
+{
+	hrtime_t now, budget, lag;
+	kv_degrade_t target;
+
+	now = gethrtime();
+	budget = (hrtime_t)(NANOSEC / KV_FRAMERATE);
+
+	if (kvp->kv_rt_origin == 0) {
+		kvp->kv_rt_origin = now;
+		kvp->kv_rt_frame = i;
+	}
+
+	lag = now - (kvp->kv_rt_origin + (i - kvp->kv_rt_frame) * budget);
+	if (lag < 0) {
+		kvp->kv_rt_origin = now;
+		kvp->kv_rt_frame = i;
+		lag = 0;
+	}
+
+	if (lag > kvp->kv_rt_maxlag)
+		kvp->kv_rt_maxlag = lag;
+
+	if (lag >= KV_LAG_MINIMAL * budget)
+		target = KVD_MINIMAL;
+	else if (lag >= KV_LAG_HALFITEMS * budget)
+		target = KVD_HALFITEMS;
+	else if (lag >= KV_LAG_NODEBUG * budget)
+		target = KVD_NODEBUG;
+	else
+		target = KVD_FULL;
+
+	if (target > kvp->kv_rt_level) {
+		if (kv_debug > 0)
+			(void) printf("realtime: %lld ms behind, level %s\n",
+			    lag / (NANOSEC / MILLISEC),
+			    kv_degrade_labels[target]);
+		kvp->kv_rt_level = target;
+	} else if (target == KVD_FULL && kvp->kv_rt_level > KVD_FULL) {
+		kvp->kv_rt_level--;
+	}
+
+	kvp->kv_rt_nframes[kvp->kv_rt_level]++;
+}
+
+/*
+ * Write a debug image.  Unless configured otherwise, images are handed off to a
+ * pool of writer threads so that identification doesn't wait for PNG encoding.
+ */
+static void
+kv_vidctx_debugwrite(kv_vidctx_t *kvp, img_t *img, const char *filename)
+{
+	if (kvp->kv_writer == NULL && kvp->kv_nwriters > 0) {
+		kvp->kv_writer = img_writer_init(kvp->kv_nwriters,
+		    KV_WRITEQ, kvp->kv_pnglevel);
+		if (kvp->kv_writer == NULL) {
+			warnx("writing debug images synchronously");
+			kvp->kv_nwriters = 0;
+		}
+	}
+
+	if (kvp->kv_writer != NULL)
+		(void) img_writer_submit(kvp->kv_writer, img, filename);
+	else
+		(void) img_write(img, filename);
+}
+
+void
+kv_vidctx_frame_emit(kv_vidctx_t *kvp, const char *framename, int i, int timems,
+    img_t *img, kv_screen_t *ksp, kv_screen_t *raceksp, FILE *fp)
+{
+	PROBE3(event__emit, i, timems, ksp->ks_events);
+	kv_vidctx_decide(kvp, i, KFD_EMIT, 0, ksp->ks_events);
+	if (kvp->kv_cmp != NULL)
+		kv_compare_emit(kvp, i, ksp);
+	kvp->kv_emit(framename, i, timems, ksp, raceksp, fp);
+
+	/*
+	 * When we've fallen behind, skip writing debug images, except for the
+	 * start and end of each race.
+	 */
+	if (kvp->kv_dbgdir[0] != '\0' &&
+	    (kvp->kv_rt_level < KVD_NODEBUG || ksp->ks_events != 0)) {
+		char buf[PATH_MAX];
+		(void) snprintf(buf, sizeof (buf), "%s/%s.png", kvp->kv_dbgdir,
+		    framename);
+		kv_vidctx_debugwrite(kvp, img, buf);
+	}
+}
+
+/*
+ * Identify frame "i" with kv_ident(), firing the ident-start and ident-done
+ * probes around it.
+ */
+static void
+kv_vidctx_ident(kv_vidctx_t *kvp, int i, img_t *image, kv_screen_t *ksp,
+    kv_ident_t which)
+{
+	PROBE2(ident__start, i, which);
+	kv_fr_frames[0] = i;
+	kv_fr_record(KFR_IDENT, i, which, 0, 0, 0);
+	kv_ident(image, ksp, which);
+	PROBE2(ident__done, i, ksp->ks_nmasks);
+	kvp->kv_nidentified++;
+	kvp->kv_nmasks += ksp->ks_nmasks;
+}
+
+/*
+ * Process a single frame.  If "sampled" is non-NULL, it contains the result of
+ * kv_ident(image, ..., KV_IDENT_NOTRACK) for this frame, which the caller has
+ * already computed.
+ */
+static void
+kv_vidctx_process(kv_vidctx_t *kvp, const char *framename, int i, int timems,
+    img_t *image, kv_screen_t *sampled)
+{
+	int j;
+	kv_screen_t *ksp, *pksp, *raceksp;
+	kv_screen_t ipks;
+	kv_ident_t which;
+	kv_invalid_t invalid;
+	boolean_t itemsdiff;
+
+	ksp = &kvp->kv_frame;
+	pksp = &kvp->kv_pframe;
+	raceksp = &kvp->kv_raceframe;
+
+	/*
+	 * As we process video frames, we go through a simple state machine:
+	 *
+	 * (1) We start out waiting for the first RACE_START frame.  We're in
+	 *     this state while last_start == -1.  When we see RACE_START, we
+	 *     set last_frame to this frame number.
+	 *
+	 * (2) We ignore the first KV_MIN_RACE_FRAMES after a RACE_START frame
+	 *     to avoid catching what may look like multiple start frames right
+	 *     next to each other.  This also avoids pointless changes in player
+	 *     position in the first few seconds.
+	 *
+	 * (3) While the race is ongoing, we track player positions until we see
+	 *     a RACE_DONE frame (indicating the race was completed) or another
+	 *     RACE_START frame (indicating that the race was aborted and
+	 *     another race was started).  If we see a normal RACE_DONE frame,
+	 *     we go back to the first state, waiting for another RACE_START
+	 *     frame.
 	 */
-	if (ksp->ks_nplayers != pksp->ks_nplayers)
-		return (1);
+	if (kvp->kv_last_start != -1 &&
+	    i - kvp->kv_last_start < KV_MIN_RACE_FRAMES) {
+		/* Skip the first frames after a start. See above. */
+		kv_vidctx_decide(kvp, i, KFD_HOLDOFF, 0, 0);
+		return;
+	}
+
+	bcopy(ksp, &ipks, sizeof (ipks));
+	if (kv_debug > 0)
+		(void) printf("%s\n", framename);
+	/* XXX why would this include characters? */
+	which = KV_IDENT_NOTRACK;
+	if (sampled != NULL) {
+		*ksp = *sampled;
+	} else {
+		if (kvp->kv_rt_level >= KVD_HALFITEMS && i % 2 != 0)
+			which &= ~KV_IDENT_ITEM;
+		/*
+		 * Before a race starts, the start buffer needs characters for
+		 * kv_vidctx_chars(), so keep those even at the minimal level.
+		 */
+		if (kvp->kv_rt_level >= KVD_MINIMAL)
+			which = KV_IDENT_START | KV_IDENT_POS |
+			    (kvp->kv_last_start == -1 ? KV_IDENT_CHARS : 0);
+		kv_vidctx_ident(kvp, i, image, ksp, which);
+	}
 
 	/*
-	 * On most tracks, we ignore frames where we couldn't detect any
-	 * players' ranks, but this would prohibit reporting results for Yoshi
-	 * Valley until all players are done.  On the other hand, on Yoshi
-	 * Valley, we ignore all frames until someone's finished.
+	 * If we skipped the item masks, assume the item boxes haven't changed
+	 * rather than feeding "no item" into the item state machine.
 	 */
-	if (raceksp->ks_track[0] != 'y') {
-		for (i = 0; i < ksp->ks_nplayers; i++) {
-			if (ksp->ks_players[i].kp_place == 0)
-				return (1);
+	if ((which & KV_IDENT_ITEM) == 0) {
+		for (j = 0; j < KV_MAXPLAYERS; j++) {
+			ksp->ks_players[j].kp_item =
+			    ipks.ks_players[j].kp_item;
+			ksp->ks_players[j].kp_itemscore =
+			    ipks.ks_players[j].kp_itemscore;
 		}
-	} else {
-		for (i = 0; i < ksp->ks_nplayers; i++) {
-			if (ksp->ks_players[i].kp_lapnum == 4)
-				break;
+	}
+
+	if (ksp->ks_events & KVE_RACE_START) {
+		if (kvp->kv_last_start != -1) {
+			(void) fprintf(stderr, "%s (time %dm:%02ds): "
+			    "new race begun (previous one aborted)",
+			    framename, (int)((double)timems / MILLISEC) / 60,
+			    timems % 60);
+			kv_vidctx_decide(kvp, i, KFD_ABORTED, 0, 0);
+			kv_vidctx_anomaly(kvp, i, "aborted");
 		}
 
-		if (i == ksp->ks_nplayers)
-			return (1);
+		kv_vidctx_decide(kvp, i, KFD_START, 0, 0);
+		kvp->kv_frninvalid = 0;
+
+		kv_vidctx_ident(kvp, i, image, ksp, KV_IDENT_ALL);
+		bcopy(ksp, &kvp->kv_startbuffer[i % KV_STARTFRAMES],
+		    sizeof (ksp));
+		kv_vidctx_chars(kvp, ksp, i);
+		kvp->kv_last_start = i;
+		*pksp = *ksp;
+		*raceksp = *ksp;
+		kv_vidctx_frame_emit(kvp, framename, i, timems, image,
+		    ksp, NULL, stdout);
+		bzero(&kvp->kv_startbuffer[0], sizeof (kvp->kv_startbuffer));
+		return;
 	}
 
-	for (i = 0; i < ksp->ks_nplayers; i++) {
-		if (pksp->ks_players[i].kp_lapnum != 0 &&
-		    ksp->ks_players[i].kp_lapnum == 0)
-			return (1);
+	/*
+	 * Skip frames if we're not currently inside a race.
+	 */
+	if (kvp->kv_last_start == -1) {
+		kv_vidctx_decide(kvp, i, KFD_IDLE, 0, 0);
+		bcopy(ksp, &kvp->kv_startbuffer[i % KV_STARTFRAMES],
+		    sizeof (*ksp));
+		return;
 	}
 
-	for (i = 0; i < ksp->ks_nplayers; i++) {
-		if (raceksp->ks_track[0] == 'y' &&
-		    ksp->ks_players[i].kp_place == 0)
-			continue;
+	/*
+	 * kv_screen_invalid() ignores screens that have a different number of
+	 * players than the initial race screen.  This is rare, since on most
+	 * tracks we use the rank numerals in each square to reliably report the
+	 * number of players.  On such tracks, a wrong number of players
+	 * indicates a numeral in transition, in which case the frame can just
+	 * be ignored.  However, on Yoshi Valley, we only have numerals for
+	 * players who have finished the race, so the number of players can
+	 * easily be wrong until the race is over (even after some players have
+	 * finished).  In order to get the correct race times, we must not
+	 * ignore such frames.  We fix this by simply bumping up the number of
+	 * players on that track.  That's sufficient, since the later player
+	 * fields will be initialized to the "unknown" values.  Of course,
+	 * consumers need to be able to handle them.
+	 */
+	if (ksp->ks_nplayers > 1 &&
+	    ksp->ks_nplayers < raceksp->ks_nplayers &&
+	    raceksp->ks_track[0] == 'y')
+		ksp->ks_nplayers = raceksp->ks_nplayers;
 
-		if (ksp->ks_players[i].kp_place > ksp->ks_nplayers)
-			return (1);
+	/*
+	 * Update item box state.  This always operates on the immediately
+	 * previous frame (saved at the start of this function), rather than the
+	 * representative frame for the current game state, because there are
+	 * item changes with each frame that don't represent logically different
+	 * game states.  That's also why we do this every frame, not just those
+	 * that we save.
+	 */
+	for (j = 0; j < ksp->ks_nplayers; j++)
+		kv_vidctx_items(kvp, i, ksp, &ipks, j);
 
-		for (j = i + 1; j < ksp->ks_nplayers; j++) {
-			if (ksp->ks_players[i].kp_place ==
-			    ksp->ks_players[j].kp_place)
-				return (1);
+	itemsdiff = kv_screen_compare_items(ksp, pksp, kvp->kv_flags) != 0;
+	invalid = kv_screen_invalid(ksp, pksp, raceksp);
+
+	/*
+	 * Normally we would omit invalid frames, but item detection is
+	 * sensitive to dropping individual frames, and we want to emit state
+	 * changes as soon as they happen, even if the rest of the frame would
+	 * have been invalid.  But we still don't want to emit an invalid frame,
+	 * so for this very specific case, we fake up the state based on the
+	 * last one we saw, but ignoring any events (which are generally
+	 * one-frame-only).
+	 */
+	if (itemsdiff && invalid != KVV_VALID) {
+		kv_vidctx_decide(kvp, i, KFD_ITEMFIX, invalid, 0);
+		ksp->ks_events = 0;
+		ksp->ks_nplayers = pksp->ks_nplayers;
+		for (j = 0; j < ksp->ks_nplayers; j++) {
+			ksp->ks_players[j].kp_place =
+			    pksp->ks_players[j].kp_place;
+			ksp->ks_players[j].kp_lapnum =
+			    pksp->ks_players[j].kp_lapnum;
 		}
+
+		invalid = KVV_VALID;
 	}
 
 	/*
-	 * In some courses, it's possible to see a yellow sky and mistake that
-	 * for a final lap number, indicating that someone has completed the
-	 * race.  Ignore frames where a player in rank X has not finished, but a
-	 * player in rank Y > X has.
+	 * A long run of invalid frames during a race usually means we've
+	 * stopped recognizing something, so it's worth a look.
 	 */
-	int mindone = ksp->ks_nplayers;
+	if (invalid != KVV_VALID) {
+		kv_vidctx_decide(kvp, i, KFD_INVALID, invalid, 0);
+		if (++kvp->kv_frninvalid == KV_FR_INVALIDRUN)
+			kv_vidctx_anomaly(kvp, i, "invalid");
+		return;
+	}
 
-	for (i = 0; i < ksp->ks_nplayers; i++) {
-		if (ksp->ks_players[i].kp_lapnum != 4 &&
-		    ksp->ks_players[i].kp_place > 0 &&
-		    ksp->ks_players[i].kp_place < mindone)
-			mindone = ksp->ks_players[i].kp_place;
+	kvp->kv_frninvalid = 0;
+	if (itemsdiff == 0 &&
+	    kv_screen_compare(ksp, pksp, raceksp, kvp->kv_flags) == 0) {
+		kv_vidctx_decide(kvp, i, KFD_UNCHANGED, 0, 0);
+		return;
 	}
 
-	for (i = 0; i < ksp->ks_nplayers; i++) {
-		if (ksp->ks_players[i].kp_lapnum == 4 &&
-		    ksp->ks_players[i].kp_place > mindone)
-			return (1);
+	/*
+	 * In Yoshi Valley (and only this rare case), we must explicitly fill in
+	 * the last place finisher, since we usually won't have detected it by
+	 * itself.
+	 */
+	if (raceksp->ks_track[0] == 'y' && ksp->ks_events & KVE_RACE_DONE) {
+		for (j = 0; j < ksp->ks_nplayers; j++) {
+			if (ksp->ks_players[j].kp_place == 0) {
+				ksp->ks_players[j].kp_place =
+				    ksp->ks_nplayers;
+				ksp->ks_players[j].kp_placescore = 0.0001;
+				break;
+			}
+		}
 	}
 
-	return (0);
+	kv_vidctx_frame_emit(kvp, framename, i, timems, image, ksp,
+	    raceksp, stdout);
+	*pksp = *ksp;
+
+	if (ksp->ks_events & KVE_RACE_DONE)
+		kvp->kv_last_start = -1;
 }
 
 /*
- * Returns true if the two game states are logically different.  Two game states
- * are different if the players' positions or lap numbers have changed.  We
- * ignore changes in the track and characters, since those are only sometimes
- * detected properly.  Higher-level code should be checking whether the race has
- * changed by looking for the race start event.
+ * Returns true if the current state is one in which we can get away with
+ * sampling frames.  We only sample during a race: before the race starts, every
+ * frame goes into the start buffer used to pick out characters.  Item boxes
+ * change every frame while a player's item box is spinning, and the item state
+ * machine needs to see each of those frames, so we also only sample while
+ * nobody's item is in flux.
  */
-int
-kv_screen_compare(kv_screen_t *ksp, kv_screen_t *pksp, kv_screen_t *raceksp,
-    kv_flags_t flags)
+static boolean_t
+kv_vidctx_stable(kv_vidctx_t *kvp, int i)
 {
-	int i;
-	kv_player_t *kpp, *pkpp;
+	int j;
+	kv_itemstate_t state;
 
-	for (i = 0; i < ksp->ks_nplayers; i++) {
-		kpp = &ksp->ks_players[i];
-		pkpp = &pksp->ks_players[i];
+	if (kvp->kv_last_start == -1 ||
+	    i - kvp->kv_last_start < KV_MIN_RACE_FRAMES)
+		return (B_FALSE);
 
-		/*
-		 * Ignore position changes in Yoshi Valley.
-		 */
-		if (kpp->kp_lapnum != pkpp->kp_lapnum ||
-		    (raceksp->ks_track[0] != 'y' &&
-		    kpp->kp_place != pkpp->kp_place))
-			return (1);
+	for (j = 0; j < kvp->kv_frame.ks_nplayers; j++) {
+		state = kvp->kv_frame.ks_players[j].kp_itemstate;
+		if (state != KVS_NONE && state != KVS_WAIT_USE)
+			return (B_FALSE);
+	}
 
-		if ((flags & KVF_COMPARE_ITEMS) != 0) {
-			if (kpp->kp_item != pkpp->kp_item)
-				return (1);
-		}
+	return (B_TRUE);
+}
+
+/*
+ * Returns true if a sampled frame looks different from the last frame we
+ * processed, in which case the change may have happened in any of the frames
+ * we skipped over.
+ */
+static boolean_t
+kv_vidctx_changed(kv_vidctx_t *kvp, kv_screen_t *ksp)
+{
+	int j;
+	kv_player_t *kpp, *pkpp;
+
+	if (ksp->ks_events != 0 ||
+	    ksp->ks_nplayers != kvp->kv_frame.ks_nplayers)
+		return (B_TRUE);
+
+	for (j = 0; j < ksp->ks_nplayers; j++) {
+		kpp = &ksp->ks_players[j];
+		pkpp = &kvp->kv_frame.ks_players[j];
 
+		if (kpp->kp_place != pkpp->kp_place ||
+		    kpp->kp_lapnum != pkpp->kp_lapnum ||
+		    kpp->kp_item != pkpp->kp_item)
+			return (B_TRUE);
 	}
 
-	return (0);
+	return (B_FALSE);
 }
 
-static int
-kv_screen_compare_items(kv_screen_t *ksp, kv_screen_t *pksp, kv_flags_t flags)
+/*
+ * Process all deferred frames, in order.
+ */
+static void
+kv_vidctx_backtrack(kv_vidctx_t *kvp)
 {
-	int i;
-	kv_player_t *kpp, *pkpp;
-	kv_itemstate_t state, pstate;
+	int j;
+	kv_deferred_t *kdp;
 
-	for (i = 0; i < ksp->ks_nplayers; i++) {
-		kpp = &ksp->ks_players[i];
-		pkpp = &pksp->ks_players[i];
+	for (j = 0; j < kvp->kv_ndeferred; j++) {
+		kdp = &kvp->kv_deferred[j];
+		kv_vidctx_process(kvp, kdp->kd_name, kdp->kd_frame,
+		    kdp->kd_timems, kdp->kd_image, NULL);
+	}
 
-		if (kv_debug > 2)
-			(void) printf("player %d: pstate %d, state %d\n",
-			    i + 1, pkpp->kp_itemstate, kpp->kp_itemstate);
+	kvp->kv_ndeferred = 0;
+}
 
-		if ((flags & KVF_COMPARE_ITEMSTATE) != 0) {
-			pstate = pkpp->kp_itemstate;
-			if (pstate == KVS_WAIT_ITEM)
-				pstate = KVS_SLOTMACHINE;
-			if (pstate == KVS_WAIT_USE)
-				pstate = KVS_NONE;
+/*
+ * Returns true if we're currently inside a race.  Outside a race, we're only
+ * looking for the start of the next one.
+ */
+boolean_t
+kv_vidctx_racing(kv_vidctx_t *kvp)
+{
+	return (kvp->kv_last_start != -1);
+}
+
+/*
+ * Configure how debug images are written: "nwriters" background threads (or 0
+ * to write them synchronously), using the given zlib compression level (0-9,
+ * or -1 for the default).
+ */
+int
+kv_vidctx_writers(kv_vidctx_t *kvp, int nwriters, int level)
+{
+	if (nwriters < 0 || nwriters > KV_MAXWRITERS || level < -1 ||
+	    level > 9 || kvp->kv_writer != NULL)
+		return (-1);
+
+	kvp->kv_nwriters = nwriters;
+	kvp->kv_pnglevel = level;
+	return (0);
+}
 
-			state = kpp->kp_itemstate;
-			if (state == KVS_WAIT_ITEM)
-				state = KVS_SLOTMACHINE;
-			if (state == KVS_WAIT_USE)
-				state = KVS_NONE;
+/*
+ * Set the mask geometry for this video's frames (if "kcgp" isn't NULL) rather
+ * than detecting it, and the directory in which to cache rescaled mask sets (if
+ * "cachedir" isn't NULL).  Fails if the paths of files in the cache wouldn't
+ * fit in PATH_MAX.
+ */
+int
+kv_vidctx_geometry(kv_vidctx_t *kvp, const kv_capgeom_t *kcgp,
+    const char *cachedir)
+{
+	if (kcgp != NULL) {
+		kvp->kv_geom = *kcgp;
+		kvp->kv_geomforced = B_TRUE;
+		kvp->kv_calibrated = B_FALSE;
+	}
 
-			if (state != pstate)
-				return (1);
-		}
+	if (cachedir != NULL) {
+		if (strlen(cachedir) + KV_GEOMCACHE_PATHLEN >=
+		    sizeof (kvp->kv_maskcache))
+			return (-1);
+		(void) strcpy(kvp->kv_maskcache, cachedir);
 	}
 
 	return (0);
 }
 
 /*
- * Print a given frame state.  If raceksp is specified, it will be used to print
- * values that are unknown in the current frame.
+ * Frames are single fields of interlaced video: every other row of what was
+ * captured.  Geometry given to kv_vidctx_geometry() still describes the whole
+ * capture, and the masks are halved in height to match the frames.
  */
 void
-kv_screen_print(const char *source, int frame, int msec, kv_screen_t *ksp,
-    kv_screen_t *raceksp, FILE *out)
+kv_vidctx_field(kv_vidctx_t *kvp)
 {
-	int i;
-	kv_player_t *kpp;
-	char *trackname, *charname;
-
-	assert(ksp->ks_nplayers <= KV_MAXPLAYERS);
-
-	(void) fprintf(out, "%s (time %dm:%02d.%03ds): ", source,
-	    msec / MILLISEC / 60, msec / MILLISEC % 60, msec % MILLISEC);
-
-	if (ksp->ks_events & KVE_RACE_START)
-		(void) fprintf(out, "Race starting!\n");
-	if (ksp->ks_events & KVE_RACE_DONE)
-		(void) fprintf(out, "Race has finished.\n");
+	kvp->kv_yscale = 2;
+	kvp->kv_calibrated = B_FALSE;
+}
 
-	trackname = ksp->ks_track;
-	if (trackname[0] == '\0' && raceksp != NULL)
-		trackname = raceksp->ks_track;
-	if (trackname[0] == '\0')
-		trackname = "Unknown Track";
+/*
+ * Make sure the masks match the geometry of the video's frames, calibrating on
+ * the first frame that allows it.  Returns whether this frame can be
+ * identified: frames before calibration succeeds are skipped.
+ */
+static boolean_t
+kv_vidctx_calibrate(kv_vidctx_t *kvp, img_t *image)
+{
+	kv_capgeom_t geom;
 
-	(void) fprintf(out, "%d players: %s\n", ksp->ks_nplayers, trackname);
+	if (kvp->kv_calibrated && image->img_width == kv_geom.kcg_width &&
+	    image->img_height == kv_geom.kcg_height)
+		return (B_TRUE);
 
-	if (ksp->ks_nplayers == 0)
-		return;
+	if (kvp->kv_geomfailed) {
+		kvp->kv_nuncalibrated++;
+		return (B_FALSE);
+	}
 
-	(void) fprintf(out, "%-8s    %-32s    %-4s    %-7s    %-4s\n", "",
-	    "Character", "Posn", "Lap", "Item");
+	if (kvp->kv_geomforced) {
+		geom = kvp->kv_geom;
+		geom.kcg_width = image->img_width;
+		geom.kcg_height = image->img_height;
+		geom.kcg_y0 /= (int)kvp->kv_yscale;
+		geom.kcg_maskheight = MAX(1,
+		    geom.kcg_maskheight / kvp->kv_yscale);
+	} else if (kv_calibrate(image, kvp->kv_yscale, &geom) != 0) {
+		kvp->kv_nuncalibrated++;
+		return (B_FALSE);
+	}
 
-	for (i = 0; i < ksp->ks_nplayers; i++) {
-		(void) fprintf(out, "Player %d    ", i + 1);
+	if (kv_geometry(&geom, kvp->kv_maskcache[0] != '\0' ?
+	    kvp->kv_maskcache : NULL) != 0) {
+		warnx("no frames can be identified");
+		kvp->kv_geomfailed = B_TRUE;
+		kvp->kv_nuncalibrated++;
+		return (B_FALSE);
+	}
 
-		kpp = &ksp->ks_players[i];
-		charname = kpp->kp_character;
-		if (charname[0] == '\0' && raceksp != NULL)
-			charname = raceksp->ks_players[i].kp_character;
-		if (charname[0] == '\0')
-			charname = "?";
+	kvp->kv_calibrated = B_TRUE;
+	return (B_TRUE);
+}
 
-		(void) fprintf(out, "%-32s    ", charname);
+int
+kv_vidctx_stride(kv_vidctx_t *kvp, int stride)
+{
+	if (stride < 1 || stride > KV_MAXSTRIDE)
+		return (-1);
 
-		switch (kpp->kp_place) {
-		case 0:
-			(void) fprintf(out, "?   ");
-			break;
-		case 1:
-			(void) fprintf(out, "1st ");
-			break;
-		case 2:
-			(void) fprintf(out, "2nd ");
-			break;
-		case 3:
-			(void) fprintf(out, "3rd ");
-			break;
-		case 4:
-			(void) fprintf(out, "4th ");
-			break;
-		default:
-			assert(0 && "invalid position");
-		}
+	kvp->kv_stride = stride;
+	return (0);
+}
 
-		(void) fprintf(out, "    ");
+static void
+kv_compare_noemit(const char *framename, int i, int timems, kv_screen_t *ksp,
+    kv_screen_t *raceksp, FILE *fp)
+{
+}
 
-		switch (kpp->kp_lapnum) {
-		case 0:
-			(void) fprintf(out, "%-7s", "");
-			break;
-		case 4:
-			(void) fprintf(out, "%-7s", "Done");
-			break;
-		default:
-			assert(kpp->kp_lapnum > 0 && kpp->kp_lapnum < 4);
-			(void) fprintf(out, "Lap %d/3", kpp->kp_lapnum);
-		}
+static void
+kv_engstate_save(kv_engstate_t *kesp)
+{
+	int c, k;
 
-		(void) fprintf(out, "    ");
+	bcopy(kv_engine, kesp->kes_engine, sizeof (kesp->kes_engine));
+	for (c = 0; c < KVC_NCATEGORIES; c++) {
+		for (k = 0; k < KV_MAXPLAYERS; k++)
+			kesp->kes_last[c][k] = kv_groups[c][k].kg_last;
+	}
+}
 
-		switch (kpp->kp_itemstate) {
-		case KVS_NONE:
-		case KVS_WAIT_USE:
-			(void) fprintf(out, "-");
-			break;
-		case KVS_SLOTMACHINE:
-		case KVS_WAIT_ITEM:
-			(void) fprintf(out, "slotmachine");
-			break;
-		case KVS_HAVE_ITEM:
-			(void) fprintf(out, "got %s",
-			    kv_item_label(kpp->kp_item));
-			break;
-		default:
-			assert(0 && "invalid player flags");
-		}
+static void
+kv_engstate_load(const kv_engstate_t *kesp)
+{
+	int c, k;
 
-		if (kv_debug > 0)
-			(void) fprintf(out, " (%s)",
-			    kv_item_label(kpp->kp_item));
-		(void) fprintf(out, "\n");
+	bcopy(kesp->kes_engine, kv_engine, sizeof (kesp->kes_engine));
+	for (c = 0; c < KVC_NCATEGORIES; c++) {
+		for (k = 0; k < KV_MAXPLAYERS; k++)
+			kv_groups[c][k].kg_last = kesp->kes_last[c][k];
 	}
+}
 
-	(void) fflush(out);
+/*
+ * Exchange the global engine state with the other context's.
+ */
+static void
+kv_compare_swap(kv_compare_t *kcp)
+{
+	kv_engstate_t saved;
+
+	kv_engstate_save(&saved);
+	kv_engstate_load(&kcp->kc_state);
+	kcp->kc_state = saved;
 }
 
 /*
- * Like kv_screen_print, but emits JSON.
+ * Identify frames twice: once as usual, and once by a second context using the
+ * given engines (in the form accepted by kv_engines(), applied on top of the
+ * current ones), comparing the two as we go and reporting how they differ when
+ * the context is freed.  Only the first context emits anything.  This must be
+ * called after the context has been configured, and before any frames are
+ * processed.
  */
-void
-kv_screen_json(const char *source, int frame, int msec, kv_screen_t *ksp,
-    kv_screen_t *raceksp, FILE *out)
+int
+kv_vidctx_compare(kv_vidctx_t *kvp, const char *engines)
 {
-	int i;
-	kv_player_t *kpp;
-	char *trackname, *charname;
+	kv_compare_t *kcp;
+	kv_vidctx_t *okvp;
 
-	assert(ksp->ks_nplayers <= KV_MAXPLAYERS);
+	if (kvp->kv_cmp != NULL || kvp->kv_nframes > 0)
+		return (-1);
 
-	(void) fprintf(out, "{ \"source\": \"%s\", \"time\": %d, \"frame\": %d, ",
-	    source, msec, frame);
+	if ((kcp = calloc(1, sizeof (*kcp))) == NULL) {
+		warn("calloc");
+		return (-1);
+	}
 
-	if (ksp->ks_events & KVE_RACE_START)
-		(void) fprintf(out, "\"start\": true, ");
-	if (ksp->ks_events & KVE_RACE_DONE)
-		(void) fprintf(out, "\"done\": true, ");
+	kv_engstate_save(&kcp->kc_state);
+	if (kv_engines_parse(engines, kcp->kc_state.kes_engine) != 0) {
+		free(kcp);
+		return (-1);
+	}
 
-	trackname = ksp->ks_track;
-	if (trackname[0] == '\0' && raceksp != NULL)
-		trackname = raceksp->ks_track;
-	if (trackname[0] == '\0')
-		trackname = "Unknown Track";
+	if ((okvp = malloc(sizeof (*okvp))) == NULL) {
+		warn("malloc");
+		free(kcp);
+		return (-1);
+	}
 
-	if (ksp->ks_nplayers > 0)
-		(void) fprintf(out, "\"players\": [ ");
+	bcopy(kvp, okvp, sizeof (*okvp));
+	okvp->kv_emit = kv_compare_noemit;
+	okvp->kv_dbgdir[0] = '\0';
+	okvp->kv_frdir[0] = '\0';
+	okvp->kv_writer = NULL;
+	okvp->kv_cmp = kcp;
+	okvp->kv_cmpside = 1;
+
+	kv_engines_describe(kv_engine, kcp->kc_labels[0],
+	    sizeof (kcp->kc_labels[0]));
+	kv_engines_describe(kcp->kc_state.kes_engine, kcp->kc_labels[1],
+	    sizeof (kcp->kc_labels[1]));
+	kcp->kc_other = okvp;
+	kcp->kc_diverged = -1;
+	kvp->kv_cmp = kcp;
+	kvp->kv_cmpside = 0;
+	return (0);
+}
 
-	for (i = 0; i < ksp->ks_nplayers; i++) {
-		kpp = &ksp->ks_players[i];
-		if (raceksp != NULL)
-			charname = raceksp->ks_players[i].kp_character;
-		else if (kpp->kp_character)
-			charname = kpp->kp_character;
-		else
-			charname = "?";
+/*
+ * If two screens differ in anything we report, describe the first difference
+ * in "buf" and return true.
+ */
+static boolean_t
+kv_screen_diff(kv_screen_t *ksp1, kv_screen_t *ksp2, char *buf, size_t len)
+{
+	kv_player_t *kpp1, *kpp2;
+	int i;
 
-		(void) fprintf(out, "{ ");
+	if (ksp1->ks_events != ksp2->ks_events) {
+		(void) snprintf(buf, len, "events 0x%x vs 0x%x",
+		    ksp1->ks_events, ksp2->ks_events);
+		return (B_TRUE);
+	}
 
-		if (kpp->kp_place != 0)
-			(void) fprintf(out, "\"position\": %d, ",
-			    kpp->kp_place);
+	if (ksp1->ks_nplayers != ksp2->ks_nplayers) {
+		(void) snprintf(buf, len, "%d players vs %d",
+		    ksp1->ks_nplayers, ksp2->ks_nplayers);
+		return (B_TRUE);
+	}
 
-		if (kpp->kp_lapnum != 0)
-			(void) fprintf(out, "\"lap\": %d, ", kpp->kp_lapnum);
+	if (strcmp(ksp1->ks_track, ksp2->ks_track) != 0) {
+		(void) snprintf(buf, len, "track \"%s\" vs \"%s\"",
+		    ksp1->ks_track, ksp2->ks_track);
+		return (B_TRUE);
+	}
 
-		if (kpp->kp_itemstate == KVS_SLOTMACHINE ||
-		    kpp->kp_itemstate == KVS_WAIT_ITEM)
-			(void) fprintf(out, "\"itemstate\": \"slotmachine\", ");
-		else if (kpp->kp_itemstate == KVS_HAVE_ITEM)
-			(void) fprintf(out, "\"itemstate\": \"%s\", ",
-			    kv_item_label(kpp->kp_item));
+	for (i = 0; i < ksp1->ks_nplayers; i++) {
+		kpp1 = &ksp1->ks_players[i];
+		kpp2 = &ksp2->ks_players[i];
 
-		(void) fprintf(out, "\"character\": \"%s\" }", charname);
+		if (strcmp(kpp1->kp_character, kpp2->kp_character) != 0) {
+			(void) snprintf(buf, len, "player %d character "
+			    "\"%s\" vs \"%s\"", i + 1, kpp1->kp_character,
+			    kpp2->kp_character);
+			return (B_TRUE);
+		}
 
-		if (i != ksp->ks_nplayers - 1)
-			(void) fprintf(out, ", ");
-	}
+		if (kpp1->kp_place != kpp2->kp_place) {
+			(void) snprintf(buf, len, "player %d position %d vs %d",
+			    i + 1, kpp1->kp_place, kpp2->kp_place);
+			return (B_TRUE);
+		}
 
-	if (ksp->ks_nplayers > 0)
-		(void) fprintf(out, "], ");
+		if (kpp1->kp_lapnum != kpp2->kp_lapnum) {
+			(void) snprintf(buf, len, "player %d lap %d vs %d",
+			    i + 1, kpp1->kp_lapnum, kpp2->kp_lapnum);
+			return (B_TRUE);
+		}
 
-	(void) fprintf(out, " \"track\": \"%s\" }\n", trackname);
-	(void) fflush(out);
+		if (kpp1->kp_item != kpp2->kp_item) {
+			(void) snprintf(buf, len, "player %d item %s vs %s",
+			    i + 1, kv_item_label(kpp1->kp_item),
+			    kv_item_label(kpp2->kp_item));
+			return (B_TRUE);
+		}
+	}
+
+	return (B_FALSE);
 }
 
-kv_vidctx_t *
-kv_vidctx_init(const char *rootdir, kv_emit_f emit, const char *dbgdir,
-    kv_flags_t flags)
+static void
+kv_compare_mismatch(kv_compare_t *kcp, int i, const char *what)
 {
-	kv_vidctx_t *kvp;
+	if (kcp->kc_nmismatched++ > 0)
+		return;
 
-	if (kv_init(rootdir) != 0) {
-		warnx("failed to initialize masks");
-		return (NULL);
-	}
+	kcp->kc_diverged = i;
+	(void) snprintf(kcp->kc_divergence, sizeof (kcp->kc_divergence), "%s",
+	    what);
+}
 
-	if ((kvp = calloc(1, sizeof (*kvp))) == NULL) {
-		warn("calloc");
-		return (NULL);
+/*
+ * Queue a state emitted by one of the contexts to be matched up with the
+ * other's (see kv_compare_emits()).
+ */
+static void
+kv_compare_emit(kv_vidctx_t *kvp, int i, kv_screen_t *ksp)
+{
+	kv_compare_t *kcp = kvp->kv_cmp;
+	int side = kvp->kv_cmpside;
+	kv_cmpemit_t *kcep;
+
+	kcp->kc_nemitted[side]++;
+	if (kcp->kc_nemits[side] == KV_CMP_MAXEMITS) {
+		kv_compare_mismatch(kcp, i, "too many unmatched states");
+		return;
 	}
 
-	kvp->kv_last_start = -1;
-	kvp->kv_emit = emit;
-	kvp->kv_flags = flags;
-	if (dbgdir != NULL)
-		(void) strncpy(kvp->kv_dbgdir, dbgdir, sizeof (kvp->kv_dbgdir));
-	return (kvp);
+	kcep = &kcp->kc_emits[side][kcp->kc_nemits[side]++];
+	kcep->kce_frame = i;
+	kcep->kce_screen = *ksp;
 }
 
 /*
- * While processing frames outside a race, we store a ringbuffer of the last
- * KV_STARTFRAMES worth of frame details in kv_startbuffer.  When we do finally
- * see a start frame, we call this function to look back at the recent frames
- * and pick the best character match for each square among all of the recent
- * frames.  This technique is important to be able to identify characters in the
- * face of things like smoke that distort their images.
+ * Match up the states each context has emitted so far, in order.  A context
+ * may emit a state some frames after the other (e.g., because decimation had
+ * to backtrack), so unmatched states wait for the other context to catch up.
  */
 static void
-kv_vidctx_chars(kv_vidctx_t *kvp, kv_screen_t *ksp, int i)
+kv_compare_emits(kv_compare_t *kcp)
 {
-	kv_screen_t *pksp;
-	int j, k;
-
-	for (j = (i + 1) % KV_STARTFRAMES; j != (i % KV_STARTFRAMES);
-	    j = (j + 1) % KV_STARTFRAMES) {
-		pksp = &kvp->kv_startbuffer[j];
+	kv_cmpemit_t *kcep0, *kcep1;
+	char buf[128];
+	int j, n;
+
+	n = MIN(kcp->kc_nemits[0], kcp->kc_nemits[1]);
+	for (j = 0; j < n; j++) {
+		kcep0 = &kcp->kc_emits[0][j];
+		kcep1 = &kcp->kc_emits[1][j];
+
+		if (kcep0->kce_frame != kcep1->kce_frame) {
+			(void) snprintf(buf, sizeof (buf), "state emitted at "
+			    "frame %d vs %d", kcep0->kce_frame,
+			    kcep1->kce_frame);
+			kv_compare_mismatch(kcp,
+			    MIN(kcep0->kce_frame, kcep1->kce_frame), buf);
+		} else if (kv_screen_diff(&kcep0->kce_screen,
+		    &kcep1->kce_screen, buf, sizeof (buf))) {
+			kv_compare_mismatch(kcp, kcep0->kce_frame, buf);
+		}
+	}
 
-		for (k = 0; k < KV_MAXPLAYERS; k++) {
-			if (pksp->ks_players[k].kp_character[0] == '\0' ||
-			    (ksp->ks_players[k].kp_charscore > 0 &&
-			    pksp->ks_players[k].kp_charscore >
-			    ksp->ks_players[k].kp_charscore))
-				continue;
+	for (j = 0; j < 2; j++) {
+		kcp->kc_nemits[j] -= n;
+		(void) memmove(kcp->kc_emits[j], kcp->kc_emits[j] + n,
+		    kcp->kc_nemits[j] * sizeof (kcp->kc_emits[j][0]));
+	}
+}
 
-			if (k > ksp->ks_nplayers)
-				ksp->ks_nplayers = k;
+/*
+ * Accumulate the differences between the two engines' scores for each mask
+ * that both of them compared against the last frame.
+ */
+static void
+kv_compare_scores(kv_compare_t *kcp)
+{
+	kv_cmpscore_t *kcsp0, *kcsp1;
+	kv_cmpmask_t *kcmp;
+	double delta;
+	int i;
 
-			bcopy(&pksp->ks_players[k], &ksp->ks_players[k],
-			    sizeof (pksp->ks_players[k]));
+	for (i = 0; i < kv_nmasks; i++) {
+		kcsp0 = &kcp->kc_scores[0][i];
+		kcsp1 = &kcp->kc_scores[1][i];
+
+		if (kcsp0->kcs_set && kcsp1->kcs_set) {
+			kcmp = &kcp->kc_masks[i];
+			delta = fabs(kcsp0->kcs_score - kcsp1->kcs_score);
+			kcmp->kcm_n++;
+			kcmp->kcm_sum += delta;
+			if (delta > kcmp->kcm_max)
+				kcmp->kcm_max = delta;
+			if (kcsp0->kcs_matched != kcsp1->kcs_matched)
+				kcmp->kcm_ndisagree++;
 		}
+
+		kcsp0->kcs_set = kcsp1->kcs_set = B_FALSE;
 	}
 }
 
+/*
+ * Process a frame with both contexts and compare the results.  Frames that both
+ * contexts identified but came out differently are reported as we go.
+ */
 static void
-kv_vidctx_items(kv_screen_t *ksp, kv_screen_t *pksp, int i)
+kv_compare_frame(const char *framename, int i, int timems, img_t *image,
+    kv_vidctx_t *kvp)
 {
-	kv_player_t *pkpp, *kpp;
-	kv_item_t item;
-	kv_itemstate_t state;
-	
-	pkpp = &pksp->ks_players[i];
-	kpp = &ksp->ks_players[i];
-	item = kpp->kp_item;
-	state = pkpp->kp_itemstate;
+	kv_compare_t *kcp = kvp->kv_cmp;
+	kv_vidctx_t *okvp = kcp->kc_other;
+	int nidentified[2];
+	hrtime_t start, mid, end;
+	boolean_t recording;
+	char buf[128];
+
+	nidentified[0] = kvp->kv_nidentified;
+	nidentified[1] = okvp->kv_nidentified;
+	kcp->kc_busy = B_TRUE;
+
+	start = gethrtime();
+	kv_cmpscores = kcp->kc_scores[0];
+	kv_vidctx_frame(framename, i, timems, image, kvp);
+	mid = gethrtime();
+
+	/* Only the original context feeds the flight recorder. */
+	recording = kv_fr_enabled;
+	kv_fr_enabled = B_FALSE;
+	kv_compare_swap(kcp);
+	kv_cmpscores = kcp->kc_scores[1];
+	kv_vidctx_frame(framename, i, timems, image, okvp);
+	kv_compare_swap(kcp);
+	kv_cmpscores = NULL;
+	kv_fr_enabled = recording;
+	end = gethrtime();
+
+	kcp->kc_busy = B_FALSE;
+	kcp->kc_time[0] += mid - start;
+	kcp->kc_time[1] += end - mid;
+	kcp->kc_nframes++;
+
+	if (kvp->kv_nidentified != nidentified[0] &&
+	    okvp->kv_nidentified != nidentified[1] &&
+	    kv_screen_diff(&kvp->kv_frame, &okvp->kv_frame, buf,
+	    sizeof (buf))) {
+		kcp->kc_ndiffer++;
+		(void) fprintf(stderr, "compare: %s: %s\n", framename, buf);
+	}
 
-	switch (pkpp->kp_itemstate) {
-	case KVS_NONE:
-		if (item != KVI_NONE && item != KVI_BLANK) {
-			state = KVS_SLOTMACHINE;
-		}
-		break;
+	kv_compare_scores(kcp);
+	kv_compare_emits(kcp);
+}
 
-	case KVS_SLOTMACHINE:
-		if (item == KVI_NONE) {
-			state = KVS_NONE;
-			if (kv_debug > 0)
-				warnx("unexpected transition transition from "
-				    "waiting for item box to no item box");
-		} else if (item == KVI_BLANK) {
-			state = KVS_WAIT_ITEM;
-		}
-		break;
+/*
+ * Finish processing with the other context and report on the comparison.
+ */
+static void
+kv_compare_fini(kv_vidctx_t *kvp)
+{
+	kv_compare_t *kcp = kvp->kv_cmp;
+	kv_vidctx_t *okvp = kcp->kc_other;
+	kv_cmpmask_t *kcmp;
+	char buf[128];
+	int i, j, n;
 
-	case KVS_WAIT_ITEM:
-		if (item == KVI_NONE) {
-			state = KVS_NONE;
-			if (kv_debug > 0)
-				warnx("unexpected transition transition from "
-				    "waiting for item to no item box");
-		} else if (item >= KVI_REALITEM_MIN) {
-			state = KVS_HAVE_ITEM;
-		}
-		break;
+	if (kvp->kv_cmpside != 0)
+		return;
 
-	case KVS_HAVE_ITEM:
-		state = KVS_WAIT_USE;
-		break;
+	kv_compare_swap(kcp);
+	kv_vidctx_backtrack(okvp);
+	kv_compare_swap(kcp);
+	kv_compare_emits(kcp);
 
-	case KVS_WAIT_USE:
-		if (item == KVI_NONE)
-			state = KVS_NONE;
-		break;
+	for (j = 0; j < 2; j++) {
+		if (kcp->kc_nemits[j] == 0)
+			continue;
 
-	default:
-		assert(0 && "invalid item state");
+		(void) snprintf(buf, sizeof (buf), "state emitted at frame %d "
+		    "only by \"%s\"", kcp->kc_emits[j][0].kce_frame,
+		    kcp->kc_labels[j]);
+		kv_compare_mismatch(kcp, kcp->kc_emits[j][0].kce_frame, buf);
 	}
 
-	if (kv_debug > 0 && pkpp->kp_itemstate != state)
-		(void) printf("player %d: got item %s in state %d "
-		    "=> state %d\n", i + 1, kv_item_label(item),
-		    pkpp->kp_itemstate, state);
-	kpp->kp_itemstate = state;
-}
+	n = MAX(kcp->kc_nframes, 1);
+	(void) fprintf(stderr, "compare: %d frames, engines \"%s\" and "
+	    "\"%s\"\n", kcp->kc_nframes, kcp->kc_labels[0], kcp->kc_labels[1]);
+	for (j = 0; j < 2; j++)
+		(void) fprintf(stderr, "compare: %-16s %10.3f s  %8.3f "
+		    "ms/frame  %8.1f frames/s\n", kcp->kc_labels[j],
+		    (double)kcp->kc_time[j] / NANOSEC,
+		    (double)kcp->kc_time[j] / n / MICROSEC,
+		    kcp->kc_time[j] == 0 ? 0 :
+		    (double)kcp->kc_nframes * NANOSEC / kcp->kc_time[j]);
+	(void) fprintf(stderr, "compare: %d frames identified differently\n",
+	    kcp->kc_ndiffer);
+
+	if (kcp->kc_nmismatched == 0)
+		(void) fprintf(stderr, "compare: emitted states agree (%d)\n",
+		    kcp->kc_nemitted[0]);
+	else
+		(void) fprintf(stderr, "compare: emitted states diverge at "
+		    "frame %d: %s (%d vs %d states, %d mismatched)\n",
+		    kcp->kc_diverged, kcp->kc_divergence, kcp->kc_nemitted[0],
+		    kcp->kc_nemitted[1], kcp->kc_nmismatched);
+
+	(void) fprintf(stderr, "compare: %-32s %8s %10s %10s %8s\n", "mask",
+	    "frames", "mean diff", "max diff", "disagree");
+	for (i = 0; i < kv_nmasks; i++) {
+		kcmp = &kcp->kc_masks[i];
+		if (kcmp->kcm_n == 0)
+			continue;
 
-void
-kv_vidctx_frame_emit(kv_vidctx_t *kvp, const char *framename, int i, int timems,
-    img_t *img, kv_screen_t *ksp, kv_screen_t *raceksp, FILE *fp)
-{
-	if (kvp->kv_dbgdir[0] != '\0') {
-		char buf[PATH_MAX];
-		(void) snprintf(buf, sizeof (buf), "%s/%s.png", kvp->kv_dbgdir,
-		    framename);
-		(void) img_write(img, buf);
+		(void) fprintf(stderr, "compare: %-32s %8lu %10.6f %10.6f "
+		    "%8lu\n", kv_masks[i].km_name, kcmp->kcm_n,
+		    kcmp->kcm_sum / kcmp->kcm_n, kcmp->kcm_max,
+		    kcmp->kcm_ndisagree);
 	}
 
-	kvp->kv_emit(framename, i, timems, ksp, raceksp, fp);
+	for (j = 0; j < KV_MAXSTRIDE - 1; j++)
+		img_free(okvp->kv_deferred[j].kd_image);
+	free(okvp);
+	free(kcp);
+	kvp->kv_cmp = NULL;
 }
 
+/*
+ * Most frames in a video don't change the game state at all, so with a stride
+ * of N we only identify every Nth frame while the state is stable, saving
+ * copies of the frames in between.  If the sampled frame differs from the last
+ * frame we processed, we go back and process the saved frames in order so that
+ * we report the exact frame where the change happened.  Otherwise, the skipped
+ * frames are assumed to look like the ones on either side of them.
+ */
 void
 kv_vidctx_frame(const char *framename, int i, int timems,
     img_t *image, kv_vidctx_t *kvp)
 {
-	int j;
-	kv_screen_t *ksp, *pksp, *raceksp;
-	kv_screen_t ipks;
-	boolean_t itemsdiff, invalid;
-
-	ksp = &kvp->kv_frame;
-	pksp = &kvp->kv_pframe;
-	raceksp = &kvp->kv_raceframe;
+	kv_deferred_t *kdp;
+	kv_screen_t ks;
+	kv_scene_t scene;
 
-	/*
-	 * As we process video frames, we go through a simple state machine:
-	 *
-	 * (1) We start out waiting for the first RACE_START frame.  We're in
-	 *     this state while last_start == -1.  When we see RACE_START, we
-	 *     set last_frame to this frame number.
-	 *
-	 * (2) We ignore the first KV_MIN_RACE_FRAMES after a RACE_START frame
-	 *     to avoid catching what may look like multiple start frames right
-	 *     next to each other.  This also avoids pointless changes in player
-	 *     position in the first few seconds.
-	 *
-	 * (3) While the race is ongoing, we track player positions until we see
-	 *     a RACE_DONE frame (indicating the race was completed) or another
-	 *     RACE_START frame (indicating that the race was aborted and
-	 *     another race was started).  If we see a normal RACE_DONE frame,
-	 *     we go back to the first state, waiting for another RACE_START
-	 *     frame.
-	 */
-	if (kvp->kv_last_start != -1 &&
-	    i - kvp->kv_last_start < KV_MIN_RACE_FRAMES)
-		/* Skip the first frames after a start. See above. */
+	if (kvp->kv_cmp != NULL && !kvp->kv_cmp->kc_busy) {
+		kv_compare_frame(framename, i, timems, image, kvp);
 		return;
+	}
 
-	bcopy(ksp, &ipks, sizeof (ipks));
-	if (kv_debug > 0)
-		(void) printf("%s\n", framename);
-	/* XXX why would this include characters? */
-	kv_ident(image, ksp, KV_IDENT_NOTRACK);
+	kvp->kv_nframes++;
+	kv_vidctx_recorder_check(kvp, i);
 
-	if (ksp->ks_events & KVE_RACE_START) {
-		if (kvp->kv_last_start != -1) {
-			(void) fprintf(stderr, "%s (time %dm:%02ds): "
-			    "new race begun (previous one aborted)",
-			    framename, (int)((double)timems / MILLISEC) / 60,
-			    timems % 60);
-		}
+	if ((kvp->kv_flags & KVF_REALTIME) != 0)
+		kv_vidctx_deadline(kvp, i);
 
-		kv_ident(image, ksp, KV_IDENT_ALL);
-		bcopy(ksp, &kvp->kv_startbuffer[i % KV_STARTFRAMES],
-		    sizeof (ksp));
-		kv_vidctx_chars(kvp, ksp, i);
-		kvp->kv_last_start = i;
-		*pksp = *ksp;
-		*raceksp = *ksp;
-		kv_vidctx_frame_emit(kvp, framename, i, timems, image,
-		    ksp, NULL, stdout);
-		bzero(&kvp->kv_startbuffer[0], sizeof (kvp->kv_startbuffer));
+	if (!kv_vidctx_calibrate(kvp, image)) {
+		kv_vidctx_decide(kvp, i, KFD_UNCALIBRATED, 0, 0);
 		return;
 	}
 
 	/*
-	 * Skip frames if we're not currently inside a race.
+	 * Menus, replays, and transitions never contain anything we're looking
+	 * for, so skip them entirely.
 	 */
-	if (kvp->kv_last_start == -1) {
-		bcopy(ksp, &kvp->kv_startbuffer[i % KV_STARTFRAMES],
-		    sizeof (*ksp));
+	if ((kvp->kv_flags & KVF_SCENES) != 0) {
+		scene = kv_scene_classify(image);
+		kvp->kv_nscenes[scene]++;
+		if (scene != KVSC_RACE) {
+			kv_vidctx_decide(kvp, i, KFD_SCENE, scene, 0);
+			return;
+		}
+	}
+
+	if (kvp->kv_stride <= 1 || !kv_vidctx_stable(kvp, i)) {
+		kv_vidctx_backtrack(kvp);
+		kv_vidctx_process(kvp, framename, i, timems, image, NULL);
 		return;
 	}
 
-	/*
-	 * kv_screen_invalid() ignores screens that have a different number of
-	 * players than the initial race screen.  This is rare, since on most
-	 * tracks we use the rank numerals in each square to reliably report the
-	 * number of players.  On such tracks, a wrong number of players
-	 * indicates a numeral in transition, in which case the frame can just
-	 * be ignored.  However, on Yoshi Valley, we only have numerals for
-	 * players who have finished the race, so the number of players can
-	 * easily be wrong until the race is over (even after some players have
-	 * finished).  In order to get the correct race times, we must not
-	 * ignore such frames.  We fix this by simply bumping up the number of
-	 * players on that track.  That's sufficient, since the later player
-	 * fields will be initialized to the "unknown" values.  Of course,
-	 * consumers need to be able to handle them.
-	 */
-	if (ksp->ks_nplayers > 1 &&
-	    ksp->ks_nplayers < raceksp->ks_nplayers &&
-	    raceksp->ks_track[0] == 'y')
-		ksp->ks_nplayers = raceksp->ks_nplayers;
+	if (kvp->kv_ndeferred < kvp->kv_stride - 1) {
+		kdp = &kvp->kv_deferred[kvp->kv_ndeferred];
+		if (kdp->kd_image != NULL &&
+		    (kdp->kd_image->img_width != image->img_width ||
+		    kdp->kd_image->img_height != image->img_height)) {
+			img_free(kdp->kd_image);
+			kdp->kd_image = NULL;
+		}
 
-	/*
-	 * Update item box state.  This always operates on the immediately
-	 * previous frame (saved at the start of this function), rather than the
-	 * representative frame for the current game state, because there are
-	 * item changes with each frame that don't represent logically different
-	 * game states.  That's also why we do this every frame, not just those
-	 * that we save.
-	 */
-	for (j = 0; j < ksp->ks_nplayers; j++)
-		kv_vidctx_items(ksp, &ipks, j);
+		if ((kdp->kd_image = img_copy(kdp->kd_image, image)) == NULL) {
+			warn("failed to save frame");
+			kv_vidctx_backtrack(kvp);
+			kv_vidctx_process(kvp, framename, i, timems, image,
+			    NULL);
+			return;
+		}
 
-	itemsdiff = kv_screen_compare_items(ksp, pksp, kvp->kv_flags) != 0;
-	invalid = kv_screen_invalid(ksp, pksp, raceksp) != 0;
+		(void) strncpy(kdp->kd_name, framename, sizeof (kdp->kd_name));
+		kdp->kd_frame = i;
+		kdp->kd_timems = timems;
+		kvp->kv_ndeferred++;
+		kv_vidctx_decide(kvp, i, KFD_DEFERRED, 0, 0);
+		return;
+	}
 
-	/*
-	 * Normally we would omit invalid frames, but item detection is
-	 * sensitive to dropping individual frames, and we want to emit state
-	 * changes as soon as they happen, even if the rest of the frame would
-	 * have been invalid.  But we still don't want to emit an invalid frame,
-	 * so for this very specific case, we fake up the state based on the
-	 * last one we saw, but ignoring any events (which are generally
-	 * one-frame-only).
-	 */
-	if (itemsdiff && invalid) {
-		ksp->ks_events = 0;
-		ksp->ks_nplayers = pksp->ks_nplayers;
-		for (j = 0; j < ksp->ks_nplayers; j++) {
-			ksp->ks_players[j].kp_place =
-			    pksp->ks_players[j].kp_place;
-			ksp->ks_players[j].kp_lapnum =
-			    pksp->ks_players[j].kp_lapnum;
-		}
+	kvp->kv_nsampled++;
+	kv_vidctx_ident(kvp, i, image, &ks, KV_IDENT_NOTRACK);
 
-		invalid = B_FALSE;
+	if (kv_vidctx_changed(kvp, &ks)) {
+		kv_vidctx_decide(kvp, i, KFD_BACKTRACK,
+		    kvp->kv_ndeferred, 0);
+		kvp->kv_nbacktracks++;
+		kv_vidctx_backtrack(kvp);
+	} else {
+		kv_vidctx_decide(kvp, i, KFD_SKIPPED,
+		    kvp->kv_ndeferred, 0);
+		kvp->kv_nskipped += kvp->kv_ndeferred;
+		kvp->kv_ndeferred = 0;
 	}
 
-	if (invalid)
-		return;
+	kv_vidctx_process(kvp, framename, i, timems, image, &ks);
+}
 
-	if (itemsdiff == 0 &&
-	    kv_screen_compare(ksp, pksp, raceksp, kvp->kv_flags) == 0)
+/*
+ * Process a batch of consecutive frames, as though each were passed to
+ * kv_vidctx_frame() in turn, but identify all of them with kv_ident_batch()
+ * up front.  Decimation and realtime mode decide how to identify each frame
+ * based on the frames before it, and engine comparison identifies each frame
+ * twice, so in those modes we just process the frames one at a time.
+ */
+void
+kv_vidctx_frames(const char **framenames, const int *frames,
+    const int *timems, img_t **images, int nimages, kv_vidctx_t *kvp)
+{
+	img_t *batch[KV_MAXBATCH];
+	kv_screen_t ks[KV_MAXBATCH];
+	int idx[KV_MAXBATCH];
+	kv_scene_t scene;
+	int i, j, k, n;
+
+	if (kvp->kv_stride > 1 || (kvp->kv_flags & KVF_REALTIME) != 0 ||
+	    kvp->kv_cmp != NULL) {
+		for (i = 0; i < nimages; i++)
+			kv_vidctx_frame(framenames[i], frames[i], timems[i],
+			    images[i], kvp);
 		return;
+	}
 
-	/*
-	 * In Yoshi Valley (and only this rare case), we must explicitly fill in
-	 * the last place finisher, since we usually won't have detected it by
-	 * itself.
-	 */
-	if (raceksp->ks_track[0] == 'y' && ksp->ks_events & KVE_RACE_DONE) {
-		for (j = 0; j < ksp->ks_nplayers; j++) {
-			if (ksp->ks_players[j].kp_place == 0) {
-				ksp->ks_players[j].kp_place =
-				    ksp->ks_nplayers;
-				ksp->ks_players[j].kp_placescore = 0.0001;
+	for (i = 0; i < nimages; i = j) {
+		kv_vidctx_recorder_check(kvp, frames[i]);
+
+		for (n = 0, j = i; j < nimages && j < i + KV_MAXBATCH; j++) {
+			/*
+			 * A frame of a different size may change the masks, so
+			 * it has to start a new batch.
+			 */
+			if (n > 0 &&
+			    (images[j]->img_width != batch[0]->img_width ||
+			    images[j]->img_height != batch[0]->img_height))
 				break;
+
+			kvp->kv_nframes++;
+			if (!kv_vidctx_calibrate(kvp, images[j])) {
+				kv_vidctx_decide(kvp, frames[j],
+				    KFD_UNCALIBRATED, 0, 0);
+				continue;
+			}
+
+			if ((kvp->kv_flags & KVF_SCENES) != 0) {
+				scene = kv_scene_classify(images[j]);
+				kvp->kv_nscenes[scene]++;
+				if (scene != KVSC_RACE) {
+					kv_vidctx_decide(kvp, frames[j],
+					    KFD_SCENE, scene, 0);
+					continue;
+				}
 			}
+
+			kv_fr_frames[n] = frames[j];
+			kv_fr_record(KFR_IDENT, frames[j], KV_IDENT_NOTRACK,
+			    0, 0, 0);
+			idx[n] = j;
+			batch[n++] = images[j];
+		}
+
+		/*
+		 * The frames in a batch are identified together, so they all
+		 * start and finish at once.
+		 */
+		for (k = 0; k < n; k++)
+			PROBE2(ident__start, frames[idx[k]], KV_IDENT_NOTRACK);
+		kv_ident_batch(batch, ks, n, KV_IDENT_NOTRACK);
+		for (k = 0; k < n; k++) {
+			PROBE2(ident__done, frames[idx[k]], ks[k].ks_nmasks);
+			kvp->kv_nmasks += ks[k].ks_nmasks;
 		}
+		kvp->kv_nidentified += n;
+
+		for (k = 0; k < n; k++)
+			kv_vidctx_process(kvp, framenames[idx[k]],
+			    frames[idx[k]], timems[idx[k]], images[idx[k]],
+			    &ks[k]);
 	}
+}
 
-	kv_vidctx_frame_emit(kvp, framename, i, timems, image, ksp,
-	    raceksp, stdout);
-	*pksp = *ksp;
+static void
+kv_vidctx_rtreport(kv_vidctx_t *kvp, FILE *out)
+{
+	int i, total;
 
-	if (ksp->ks_events & KVE_RACE_DONE)
-		kvp->kv_last_start = -1;
+	total = 0;
+	for (i = 0; i < KVD_NLEVELS; i++)
+		total += kvp->kv_rt_nframes[i];
+
+	(void) fprintf(out, "realtime: max lag %lld ms\n",
+	    kvp->kv_rt_maxlag / (NANOSEC / MILLISEC));
+
+	for (i = 0; i < KVD_NLEVELS; i++) {
+		(void) fprintf(out, "realtime: %-10s %8d frames (%5.1f%%)\n",
+		    kv_degrade_labels[i], kvp->kv_rt_nframes[i],
+		    total == 0 ? 0 : 100.0 * kvp->kv_rt_nframes[i] / total);
+	}
+}
+
+static void
+kv_vidctx_scenereport(kv_vidctx_t *kvp, FILE *out)
+{
+	int i, total, secs;
+
+	total = 0;
+	for (i = 0; i < KVSC_NCLASSES; i++)
+		total += kvp->kv_nscenes[i];
+
+	for (i = 0; i < KVSC_NCLASSES; i++) {
+		secs = kvp->kv_nscenes[i] / KV_FRAMERATE;
+		(void) fprintf(out, "scenes: %-6s %8d frames (%dm:%02ds, "
+		    "%5.1f%%)\n", kv_scene_labels[i], kvp->kv_nscenes[i],
+		    secs / 60, secs % 60,
+		    total == 0 ? 0 : 100.0 * kvp->kv_nscenes[i] / total);
+	}
+}
+
+/*
+ * Print the context's counters as a JSON object, for progress reporting while
+ * a video is being processed.  Frames that weren't identified or didn't produce
+ * any output are broken down by what we decided to do with them.
+ */
+void
+kv_vidctx_stats(kv_vidctx_t *kvp, FILE *out)
+{
+	int i;
+
+	(void) fprintf(out, "{ \"frames\": %d, \"identified\": %d, "
+	    "\"masks\": %llu, \"racing\": %s, \"decisions\": { ",
+	    kvp->kv_nframes, kvp->kv_nidentified,
+	    (unsigned long long)kvp->kv_nmasks,
+	    kvp->kv_last_start != -1 ? "true" : "false");
+
+	for (i = 0; i < KFD_NDECISIONS; i++)
+		(void) fprintf(out, "%s\"%s\": %d", i == 0 ? "" : ", ",
+		    kv_frdecision_labels[i], kvp->kv_ndecisions[i]);
+	(void) fprintf(out, " }");
+
+	if ((kvp->kv_flags & KVF_SCENES) != 0) {
+		(void) fprintf(out, ", \"scenes\": { ");
+		for (i = 0; i < KVSC_NCLASSES; i++)
+			(void) fprintf(out, "%s\"%s\": %d", i == 0 ? "" : ", ",
+			    kv_scene_labels[i], kvp->kv_nscenes[i]);
+		(void) fprintf(out, " }");
+	}
+
+	if ((kvp->kv_flags & KVF_REALTIME) != 0) {
+		(void) fprintf(out, ", \"realtime\": { \"maxlagms\": %lld",
+		    kvp->kv_rt_maxlag / (NANOSEC / MILLISEC));
+		for (i = 0; i < KVD_NLEVELS; i++)
+			(void) fprintf(out, ", \"%s\": %d",
+			    kv_degrade_labels[i], kvp->kv_rt_nframes[i]);
+		(void) fprintf(out, " }");
+	}
+
+	(void) fprintf(out, " }");
 }
 
 void
 kv_vidctx_free(kv_vidctx_t *kvp)
 {
+	int j;
+
+	/*
+	 * Any frames still deferred at the end of the video haven't been
+	 * checked against a later sample, so process them now.
+	 */
+	kv_vidctx_backtrack(kvp);
+
+	if (kvp->kv_cmp != NULL)
+		kv_compare_fini(kvp);
+
+	/* Dump the recorder if we were waiting to see more after an anomaly. */
+	if (kvp->kv_frdumpat != -1)
+		kv_vidctx_recorder_check(kvp, INT_MAX);
+	if (kvp->kv_frdir[0] != '\0')
+		kv_fr_enabled = B_FALSE;
+
+	/* Wait for any outstanding debug images to be written. */
+	if (kvp->kv_writer != NULL)
+		img_writer_fini(kvp->kv_writer);
+
+	if ((kvp->kv_flags & KVF_REALTIME) != 0)
+		kv_vidctx_rtreport(kvp, stderr);
+
+	if ((kvp->kv_flags & KVF_SCENES) != 0)
+		kv_vidctx_scenereport(kvp, stderr);
+
+	if (kvp->kv_stride > 1)
+		(void) fprintf(stderr, "stride %d: %d frames sampled, "
+		    "%d frames skipped, %d backtracks\n", kvp->kv_stride,
+		    kvp->kv_nsampled, kvp->kv_nskipped, kvp->kv_nbacktracks);
+
+	if (kvp->kv_nuncalibrated > 0)
+		(void) fprintf(stderr, "geometry: %d frames skipped before "
+		    "calibration\n", kvp->kv_nuncalibrated);
+
+	for (j = 0; j < KV_MAXSTRIDE - 1; j++)
+		img_free(kvp->kv_deferred[j].kd_image);
+
 	free(kvp);
 }
 
@@ -17,8 +17,37 @@
 #define	KV_THRESHOLD_ITEMFRAME	0.155
 #define	KV_THRESHOLD_ITEM	0.155
 #define	KV_THRESHOLD_LAKITU	0.154
+
+/*
+ * Scores below which a position or character mask is taken as the only
+ * possible match for its square (see kv_ident_batch()).  These are well under
+ * the lowest score of any other outcome in the same square in sample frames.
+ */
+#define	KV_CONFIDENT_POS	0.10
+#define	KV_CONFIDENT_CHAR	0.09
+
 #define	KV_MIN_RACE_FRAMES	(2 * KV_FRAMERATE)	/* 2 seconds */
 
+/*
+ * Mask matching engines.  The default compares colors (see img_compare()).
+ * The signature engines compare binary signatures (see img_sig_compare()),
+ * whose scores are the fraction of signature bits that differ, so they have
+ * their own thresholds (see kv_sigthresholds).  The reference engine computes
+ * the same scores as the color engine, but always with img_compare() itself,
+ * and compares every mask rather than consulting the mask index or stopping
+ * at a confident match, as a baseline for the faster paths.
+ */
+typedef enum {
+	KVM_COLOR,		/* color difference */
+	KVM_LUMA,		/* thresholded luma signature */
+	KVM_GRAD,		/* gradient sign signature */
+	KVM_SIG,		/* both luma and gradient signatures */
+	KVM_REF,		/* color difference, the slow way */
+	KVM_NENGINES
+} kv_engine_t;
+
+#define	KVM_SIGNATURE(e)	((e) != KVM_COLOR && (e) != KVM_REF)
+
 #define KV_MAXPLAYERS	4
 
 typedef enum {
@@ -75,6 +104,7 @@ typedef struct {
 	char		ks_track[32];		/* name, "" = unknown */
 	double		ks_trackscore;		/* score for track match */
 	kv_player_t	ks_players[KV_MAXPLAYERS];	/* player details */
+	unsigned short	ks_nmasks;		/* masks compared */
 } kv_screen_t;
 
 typedef enum {
@@ -82,22 +112,138 @@ typedef enum {
 	KV_IDENT_TRACK   = 0x2,
 	KV_IDENT_CHARS   = 0x4,
 	KV_IDENT_ITEM	 = 0x8,
+	KV_IDENT_POS	 = 0x10,
 	KV_IDENT_ALL     = KV_IDENT_START | KV_IDENT_TRACK | KV_IDENT_CHARS |
-	    KV_IDENT_ITEM,
+	    KV_IDENT_ITEM | KV_IDENT_POS,
 	KV_IDENT_NOTRACK = KV_IDENT_ALL & (~KV_IDENT_TRACK),
 } kv_ident_t;
 
+/*
+ * Reasons kv_screen_invalid() rejects a screen.
+ */
+typedef enum {
+	KVV_VALID = 0,
+	KVV_NPLAYERS,		/* number of players differs */
+	KVV_NOPLACE,		/* a player's position is unknown */
+	KVV_NOTDONE,		/* Yoshi Valley, and nobody has finished */
+	KVV_LAPLOST,		/* a player's lap number disappeared */
+	KVV_BADPLACE,		/* position beyond the number of players */
+	KVV_DUPPLACE,		/* two players in the same position */
+	KVV_FINISHORDER,	/* finished behind someone still racing */
+} kv_invalid_t;
+
 typedef enum {
 	KVF_NONE = 0,
 	KVF_COMPARE_ITEMS = 0x1,	/* include all item box changes */
 	KVF_COMPARE_ITEMSTATE = 0x2,	/* include item state changes */
+	KVF_REALTIME = 0x4,		/* shed work to keep up with input */
+	KVF_SCENES = 0x8,		/* skip frames that aren't races */
 } kv_flags_t;
 
+/*
+ * Scene classes, as determined by kv_scene_classify().
+ */
+typedef enum {
+	KVSC_RACE,		/* split-screen race, including pre-start */
+	KVSC_BLACK,		/* black (or nearly black) transition */
+	KVSC_OTHER,		/* menus, replays, and everything else */
+	KVSC_NCLASSES
+} kv_scene_t;
+
+/* scene classifier thresholds (average luma, 0-255) */
+#define	KV_SCENE_BLACK		16	/* max luma for a black frame */
+#define	KV_SCENE_DIVIDER	48	/* max luma for split-screen divider */
+#define	KV_SCENE_CONTRAST	16	/* min frame luma above divider luma */
+
+/*
+ * The masks were made from 640x480 captures, in which the game's picture
+ * (everything inside the console's black border) covers the given rectangle.
+ * Captures with a different geometry are calibrated by finding the picture in
+ * a frame, and the masks are rescaled to match (see kv_geometry()).
+ */
+#define	KV_MASK_WIDTH		640
+#define	KV_MASK_HEIGHT		480
+#define	KV_PICTURE_X0		2
+#define	KV_PICTURE_Y0		0
+#define	KV_PICTURE_WIDTH	634
+#define	KV_PICTURE_HEIGHT	474
+
+/*
+ * Capture geometry: the size of the frames, and the rectangle within them
+ * (which may extend a little past the top-left) that the 640x480 mask geometry
+ * maps onto.
+ */
+typedef struct {
+	unsigned int	kcg_width;	/* frame size */
+	unsigned int	kcg_height;
+	int		kcg_x0;		/* mask geometry within the frame */
+	int		kcg_y0;
+	unsigned int	kcg_maskwidth;
+	unsigned int	kcg_maskheight;
+} kv_capgeom_t;
+
+/*
+ * In realtime mode, we measure how far behind the input we've fallen and shed
+ * work in this order until we catch up again.  Race start and finish detection
+ * (the Lakitu and position masks) are never shed, and neither are the character
+ * masks before a race starts, since we need them to know who's racing.
+ */
+typedef enum {
+	KVD_FULL,		/* all masks, all debug output */
+	KVD_NODEBUG,		/* skip debug image writes */
+	KVD_HALFITEMS,		/* also check item masks every other frame */
+	KVD_MINIMAL,		/* only check Lakitu and position masks */
+	KVD_NLEVELS
+} kv_degrade_t;
+
+/* lag (in frames) at which we move to each degradation level */
+#define	KV_LAG_NODEBUG		1
+#define	KV_LAG_HALFITEMS	3
+#define	KV_LAG_MINIMAL		8
+
+/* max frames identified together by kv_vidctx_frames() */
+#define	KV_MAXBATCH		16
+
+/*
+ * Compiled mask kernels.  "kartvid genkernels" generates a C file containing a
+ * table for each loaded mask of the runs of pixels that img_compare() would
+ * compare, which is compiled into kartvid as the kv_kernels table.  At runtime,
+ * each mask that's unchanged since the kernels were generated (as determined by
+ * kk_hash) is scored by walking its runs rather than by scanning its whole
+ * bounding box for the pixels to compare.
+ */
+typedef struct {
+	uint16_t	kkr_x;		/* first pixel */
+	uint16_t	kkr_y;
+	uint16_t	kkr_n;		/* number of pixels */
+} kv_kernrun_t;
+
+typedef struct {
+	const char		*kk_name;	/* mask file name */
+	uint32_t		kk_hash;	/* hash of the compared pixels */
+	unsigned int		kk_npixels;	/* pixels compared */
+	unsigned int		kk_nruns;
+	const kv_kernrun_t	*kk_runs;
+} kv_kernel_t;
+
+extern const kv_kernel_t kv_kernels[];
+extern const int kv_nkernels;
+
 int kv_init(const char *);
+int kv_engines(const char *);
+int kv_kernels_generate(FILE *);
 void kv_ident(img_t *, kv_screen_t *, kv_ident_t);
+void kv_ident_batch(img_t **, kv_screen_t *, int, kv_ident_t);
 void kv_ident_matches(kv_screen_t *, const char *, double);
+void kv_mask_bounds(kv_ident_t, unsigned int *, unsigned int *);
+void kv_groups_report(FILE *);
+int kv_calibrate(img_t *, unsigned int, kv_capgeom_t *);
+int kv_geometry(const kv_capgeom_t *, const char *);
+int kv_capgeom_parse(const char *, kv_capgeom_t *);
+kv_scene_t kv_scene_classify(img_t *);
+const char *kv_scene_label(kv_scene_t);
 int kv_screen_compare(kv_screen_t *, kv_screen_t *, kv_screen_t *, kv_flags_t);
-int kv_screen_invalid(kv_screen_t *, kv_screen_t *, kv_screen_t *);
+kv_invalid_t kv_screen_invalid(kv_screen_t *, kv_screen_t *, kv_screen_t *);
 const char *kv_item_label(kv_item_t);
 
 typedef void (*kv_emit_f)(const char *, int, int, kv_screen_t *, kv_screen_t *,
@@ -111,7 +257,21 @@ void kv_screen_json(const char *, int, int, kv_screen_t *, kv_screen_t *,
 struct kv_vidctx;
 typedef struct kv_vidctx kv_vidctx_t;
 kv_vidctx_t *kv_vidctx_init(const char *, kv_emit_f, const char *, kv_flags_t);
+int kv_vidctx_stride(kv_vidctx_t *, int);
+int kv_vidctx_writers(kv_vidctx_t *, int, int);
+int kv_vidctx_geometry(kv_vidctx_t *, const kv_capgeom_t *, const char *);
+void kv_vidctx_field(kv_vidctx_t *);
+int kv_vidctx_recorder(kv_vidctx_t *, const char *);
+int kv_vidctx_compare(kv_vidctx_t *, const char *);
+boolean_t kv_vidctx_racing(kv_vidctx_t *);
 void kv_vidctx_frame(const char *, int, int, img_t *, kv_vidctx_t *);
+void kv_vidctx_frames(const char **, const int *, const int *, img_t **, int,
+    kv_vidctx_t *);
+void kv_vidctx_stats(kv_vidctx_t *, FILE *);
 void kv_vidctx_free(kv_vidctx_t *);
 
+void kv_recorder_request(void);
+int kv_recorder_dump(const char *);
+int kv_recorder_print(const char *, FILE *);
+
 #endif
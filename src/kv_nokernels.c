@@ -0,0 +1,9 @@
+/*
+ * kv_nokernels.c: an empty table of compiled mask kernels, used to build the
+ * kartvid that generates the real table (see kv_kernels_generate()).
+ */
+
+#include "kv.h"
+
+const kv_kernel_t kv_kernels[] = { { NULL, 0, 0, 0, NULL } };
+const int kv_nkernels = 0;
@@ -0,0 +1,44 @@
+/*
+ * probes.h: static tracing probes
+ */
+
+#ifndef PROBES_H
+#define	PROBES_H
+
+/*
+ * kartvid's USDT probes (provider "kartvid") use the <sys/sdt.h> macros from
+ * SystemTap, which bpftrace and stap can both enable.  Each probe compiles to a
+ * single nop plus a note describing where its arguments live, so a disabled
+ * probe costs only the evaluation of its arguments: keep those to values that
+ * have already been computed.  As with DTrace, "__" in a probe name reads as
+ * "-" to stap; bpftrace uses the names as written here.  Arguments are integers
+ * and strings only, so scores are passed in millionths (see PROBE_SCORE()).
+ * Without <sys/sdt.h>, the probes compile away entirely.
+ *
+ *   frame__decoded	(int ndecoded, hrtime_t ns)	decoder returned a frame
+ *   frame__converted	(int ndecoded, hrtime_t ns)	frame converted to RGB
+ *   ident__start	(int frame, int which)		identification begins
+ *   ident__done	(int frame, int nmasks)		masks compared
+ *   mask__match	(char *mask, int score, int n)	mask matched the nth
+ *							frame of a batch
+ *   state__change	(int player, int from, int to)	item state transition
+ *   event__emit	(int frame, int timems, int events)	state emitted
+ *   image__written	(char *file, int rv, hrtime_t ns)	image written
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define	PROBE1(name, a1)		DTRACE_PROBE1(kartvid, name, a1)
+#define	PROBE2(name, a1, a2)		DTRACE_PROBE2(kartvid, name, a1, a2)
+#define	PROBE3(name, a1, a2, a3)	DTRACE_PROBE3(kartvid, name, a1, a2, a3)
+#else
+/* Mention the arguments (without evaluating them) so they count as used. */
+#define	PROBE1(name, a1)		((void) sizeof (a1))
+#define	PROBE2(name, a1, a2)		((void) sizeof (a1), (void) sizeof (a2))
+#define	PROBE3(name, a1, a2, a3)	\
+	((void) sizeof (a1), (void) sizeof (a2), (void) sizeof (a3))
+#endif
+
+#define	PROBE_SCORE(score)	((int)((score) * 1000000))
+
+#endif
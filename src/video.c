@@ -2,16 +2,76 @@
  * video.c: video input/output facilities
  */
 
+#include <assert.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
 
 #include "img.h"
+#include "probes.h"
 #include "video.h"
 
+extern int kv_debug;
+
+#define	MAX(x, y)	((x) > (y) ? (x) : (y))
+
+#define	VIDEO_MAXTHREADS	16	/* cap on automatic decoder threads */
+#define	VIDEO_IOBUFSZ	(256 * 1024)	/* libavformat's read buffer */
+#define	VIDEO_READAHEAD	(32 * 1024 * 1024) /* default readahead */
+#define	VIDEO_TOUCHSZ	(1024 * 1024)	/* readahead unit for mapped files */
+
+/*
+ * Input I/O.  Rather than have libavformat read the input through its default
+ * file protocol (which issues small synchronous reads), we supply our own I/O
+ * context.  In both of the following cases, a background thread stays up to
+ * "vio_bufsize" bytes ahead of the decoder so that slow (e.g., network-backed)
+ * storage doesn't stall decoding:
+ *
+ *   o Regular files are mapped and read with memcpy.  The background thread
+ *     faults in pages ahead of the decoder's position.
+ *
+ *   o Anything else (pipes, sockets, and "-" for stdin) is read by the
+ *     background thread into a ring buffer.  These inputs can't seek, so
+ *     formats that need to (e.g., QuickTime files with the index at the end)
+ *     must be staged to a file first.
+ */
+typedef struct video_io {
+	int		vio_fd;
+	size_t		vio_bufsize;	/* readahead window or ring size */
+	AVIOContext	*vio_avio;
+	pthread_t	vio_thread;
+	pthread_mutex_t	vio_lock;
+	pthread_cond_t	vio_cv;
+	boolean_t	vio_started;	/* background thread is running */
+	boolean_t	vio_done;	/* consumer is closing */
+
+	/* mapped files */
+	uint8_t		*vio_map;
+	off_t		vio_size;
+	off_t		vio_pos;	/* consumer's position */
+	off_t		vio_ahead;	/* readahead position */
+
+	/* streams */
+	uint8_t		*vio_ring;
+	uint64_t	vio_head;	/* total bytes read into ring */
+	uint64_t	vio_tail;	/* total bytes consumed from ring */
+	boolean_t	vio_eof;
+	int		vio_error;
+} video_io_t;
+
 struct video {
 	AVFormatContext	*vf_formatctx;
 	AVCodecContext	*vf_codecctx;
@@ -23,10 +83,450 @@ struct video {
 	double		vf_framerate;
 	int		vf_nframes;
 	char		vf_crtime[64];
+	struct SwsContext *vf_swsctx;	/* full-quality RGB conversion */
+	boolean_t	vf_planar;	/* hand out planar frames */
+	boolean_t	vf_field;	/* hand out the second field only */
+	img_planar_t	vf_planarimg;	/* planar data for current frame */
+	int		vf_ndecoded;	/* frames decoded */
+	hrtime_t	vf_tdecode;	/* time spent reading and decoding */
+	hrtime_t	vf_tconvert;	/* time spent converting to RGB */
+	hrtime_t	vf_tconsume;	/* time spent in the frame callback */
+	uint32_t	vf_hist[VS_NSTAGES][VIDEO_NBUCKETS];	/* latencies */
+	int		vf_framenum;	/* last frame handed to the callback */
+	double		vf_frametime;	/* its time (milliseconds) */
+	video_io_t	*vf_io;		/* input I/O context */
+	AVRational	vf_rate;	/* nominal frames per second */
 };
 
+/*
+ * Readahead for mapped files: touch each page up to vio_bufsize bytes past the
+ * consumer's position, then wait for the consumer to catch up.
+ */
+static void *
+vio_touch(void *arg)
+{
+	video_io_t *viop = arg;
+	long pgsz = sysconf(_SC_PAGESIZE);
+	volatile uint8_t sum = 0;
+	off_t start, end, off;
+
+	(void) pthread_mutex_lock(&viop->vio_lock);
+	while (!viop->vio_done) {
+		start = viop->vio_ahead;
+		end = viop->vio_pos + viop->vio_bufsize;
+		if (end > viop->vio_size)
+			end = viop->vio_size;
+
+		if (start >= end) {
+			(void) pthread_cond_wait(&viop->vio_cv,
+			    &viop->vio_lock);
+			continue;
+		}
+
+		if (end - start > VIDEO_TOUCHSZ)
+			end = start + VIDEO_TOUCHSZ;
+
+		(void) pthread_mutex_unlock(&viop->vio_lock);
+		for (off = start; off < end; off += pgsz)
+			sum += viop->vio_map[off];
+		(void) pthread_mutex_lock(&viop->vio_lock);
+
+		/* The consumer may have seeked while we were unlocked. */
+		if (viop->vio_ahead == start)
+			viop->vio_ahead = end;
+	}
+	(void) pthread_mutex_unlock(&viop->vio_lock);
+
+	return (NULL);
+}
+
+static int
+vio_map_read(void *arg, uint8_t *buf, int size)
+{
+	video_io_t *viop = arg;
+	off_t n;
+
+	/*
+	 * Only this thread changes vio_pos, so we only need the lock to update
+	 * it.
+	 */
+	n = viop->vio_size - viop->vio_pos;
+	if (n <= 0)
+		return (AVERROR_EOF);
+	if (n > size)
+		n = size;
+
+	(void) memcpy(buf, viop->vio_map + viop->vio_pos, n);
+
+	(void) pthread_mutex_lock(&viop->vio_lock);
+	viop->vio_pos += n;
+	(void) pthread_cond_signal(&viop->vio_cv);
+	(void) pthread_mutex_unlock(&viop->vio_lock);
+
+	return ((int)n);
+}
+
+static int64_t
+vio_map_seek(void *arg, int64_t offset, int whence)
+{
+	video_io_t *viop = arg;
+	long pgsz = sysconf(_SC_PAGESIZE);
+	int64_t pos;
+
+	switch (whence & ~AVSEEK_FORCE) {
+	case AVSEEK_SIZE:
+		return (viop->vio_size);
+
+	case SEEK_SET:
+		pos = offset;
+		break;
+
+	case SEEK_CUR:
+		pos = viop->vio_pos + offset;
+		break;
+
+	case SEEK_END:
+		pos = viop->vio_size + offset;
+		break;
+
+	default:
+		return (AVERROR(EINVAL));
+	}
+
+	if (pos < 0 || pos > viop->vio_size)
+		return (AVERROR(EINVAL));
+
+	(void) pthread_mutex_lock(&viop->vio_lock);
+	viop->vio_pos = pos;
+	viop->vio_ahead = pos & ~(pgsz - 1);
+	(void) pthread_cond_signal(&viop->vio_cv);
+	(void) pthread_mutex_unlock(&viop->vio_lock);
+
+	return (pos);
+}
+
+/*
+ * Readahead for streams: fill the ring buffer as fast as the consumer drains
+ * it.
+ */
+static void *
+vio_fill(void *arg)
+{
+	video_io_t *viop = arg;
+	size_t off, n;
+	ssize_t rv;
+
+	(void) pthread_mutex_lock(&viop->vio_lock);
+	for (;;) {
+		while (!viop->vio_done &&
+		    viop->vio_head - viop->vio_tail == viop->vio_bufsize)
+			(void) pthread_cond_wait(&viop->vio_cv,
+			    &viop->vio_lock);
+
+		if (viop->vio_done)
+			break;
+
+		off = viop->vio_head % viop->vio_bufsize;
+		n = viop->vio_bufsize - (viop->vio_head - viop->vio_tail);
+		if (n > viop->vio_bufsize - off)
+			n = viop->vio_bufsize - off;
+
+		/*
+		 * The consumer never looks past vio_head, so we can fill this
+		 * part of the ring without holding the lock.
+		 */
+		(void) pthread_mutex_unlock(&viop->vio_lock);
+		rv = read(viop->vio_fd, viop->vio_ring + off, n);
+		(void) pthread_mutex_lock(&viop->vio_lock);
+
+		if (rv < 0 && errno == EINTR)
+			continue;
+
+		if (rv <= 0) {
+			viop->vio_error = rv < 0 ? errno : 0;
+			viop->vio_eof = B_TRUE;
+			(void) pthread_cond_broadcast(&viop->vio_cv);
+			break;
+		}
+
+		viop->vio_head += rv;
+		(void) pthread_cond_broadcast(&viop->vio_cv);
+	}
+	(void) pthread_mutex_unlock(&viop->vio_lock);
+
+	return (NULL);
+}
+
+static int
+vio_stream_read(void *arg, uint8_t *buf, int size)
+{
+	video_io_t *viop = arg;
+	size_t off, n;
+
+	(void) pthread_mutex_lock(&viop->vio_lock);
+	while (viop->vio_head == viop->vio_tail && !viop->vio_eof)
+		(void) pthread_cond_wait(&viop->vio_cv, &viop->vio_lock);
+
+	if (viop->vio_head == viop->vio_tail) {
+		(void) pthread_mutex_unlock(&viop->vio_lock);
+		if (viop->vio_error != 0) {
+			warnx("read: %s", strerror(viop->vio_error));
+			return (AVERROR(viop->vio_error));
+		}
+		return (AVERROR_EOF);
+	}
+
+	off = viop->vio_tail % viop->vio_bufsize;
+	n = viop->vio_head - viop->vio_tail;
+	if (n > viop->vio_bufsize - off)
+		n = viop->vio_bufsize - off;
+	if (n > size)
+		n = size;
+	(void) pthread_mutex_unlock(&viop->vio_lock);
+
+	(void) memcpy(buf, viop->vio_ring + off, n);
+
+	(void) pthread_mutex_lock(&viop->vio_lock);
+	viop->vio_tail += n;
+	(void) pthread_cond_signal(&viop->vio_cv);
+	(void) pthread_mutex_unlock(&viop->vio_lock);
+
+	return ((int)n);
+}
+
+static void vio_close(video_io_t *);
+
+/*
+ * Set up I/O for the given input file ("-" for stdin).
+ */
+static video_io_t *
+vio_open(const char *filename, size_t bufsize)
+{
+	video_io_t *viop;
+	struct stat st;
+	uint8_t *iobuf;
+	int rv;
+
+	if ((viop = calloc(1, sizeof (*viop))) == NULL) {
+		warn("malloc");
+		return (NULL);
+	}
+
+	viop->vio_bufsize = bufsize;
+	(void) pthread_mutex_init(&viop->vio_lock, NULL);
+	(void) pthread_cond_init(&viop->vio_cv, NULL);
+
+	if (strcmp(filename, "-") == 0) {
+		viop->vio_fd = STDIN_FILENO;
+	} else if ((viop->vio_fd = open(filename, O_RDONLY)) < 0) {
+		warn("open %s", filename);
+		vio_close(viop);
+		return (NULL);
+	}
+
+	if (fstat(viop->vio_fd, &st) != 0) {
+		warn("fstat %s", filename);
+		vio_close(viop);
+		return (NULL);
+	}
+
+	if (S_ISREG(st.st_mode) && st.st_size > 0) {
+#ifdef POSIX_FADV_SEQUENTIAL
+		(void) posix_fadvise(viop->vio_fd, 0, 0,
+		    POSIX_FADV_SEQUENTIAL);
+#endif
+		viop->vio_size = st.st_size;
+		viop->vio_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+		    viop->vio_fd, 0);
+		if (viop->vio_map == MAP_FAILED) {
+			warn("mmap %s", filename);
+			viop->vio_map = NULL;
+			vio_close(viop);
+			return (NULL);
+		}
+
+		(void) madvise((void *)viop->vio_map, st.st_size,
+		    MADV_SEQUENTIAL);
+	} else if ((viop->vio_ring = malloc(bufsize)) == NULL) {
+		warn("malloc");
+		vio_close(viop);
+		return (NULL);
+	}
+
+	if ((iobuf = av_malloc(VIDEO_IOBUFSZ)) == NULL) {
+		warnx("failed to allocate I/O buffer");
+		vio_close(viop);
+		return (NULL);
+	}
+
+	viop->vio_avio = avio_alloc_context(iobuf, VIDEO_IOBUFSZ, 0, viop,
+	    viop->vio_map != NULL ? vio_map_read : vio_stream_read, NULL,
+	    viop->vio_map != NULL ? vio_map_seek : NULL);
+	if (viop->vio_avio == NULL) {
+		warnx("failed to allocate I/O context");
+		av_free(iobuf);
+		vio_close(viop);
+		return (NULL);
+	}
+
+	if (viop->vio_map == NULL)
+		viop->vio_avio->seekable = 0;
+
+	rv = pthread_create(&viop->vio_thread, NULL,
+	    viop->vio_map != NULL ? vio_touch : vio_fill, viop);
+	if (rv != 0) {
+		warnx("pthread_create: %s", strerror(rv));
+		vio_close(viop);
+		return (NULL);
+	}
+
+	viop->vio_started = B_TRUE;
+	return (viop);
+}
+
+static void
+vio_close(video_io_t *viop)
+{
+	if (viop->vio_started) {
+		(void) pthread_mutex_lock(&viop->vio_lock);
+		viop->vio_done = B_TRUE;
+		(void) pthread_cond_broadcast(&viop->vio_cv);
+		(void) pthread_mutex_unlock(&viop->vio_lock);
+		(void) pthread_join(viop->vio_thread, NULL);
+	}
+
+	if (viop->vio_avio != NULL) {
+		av_free(viop->vio_avio->buffer);
+		av_free(viop->vio_avio);
+	}
+
+	if (viop->vio_map != NULL)
+		(void) munmap((void *)viop->vio_map, viop->vio_size);
+
+	free(viop->vio_ring);
+
+	if (viop->vio_fd > STDIN_FILENO)
+		(void) close(viop->vio_fd);
+
+	(void) pthread_mutex_destroy(&viop->vio_lock);
+	(void) pthread_cond_destroy(&viop->vio_cv);
+	free(viop);
+}
+
+static const char *video_threadmodels[] = {
+	"auto",
+	"frame",
+	"slice",
+};
+
+/*
+ * Configure decoder threading.  This must be done before the codec is opened.
+ */
+static void
+video_threads(AVCodecContext *ctx, const video_opts_t *optsp)
+{
+	long ncpus;
+	int nthreads;
+	video_threadmodel_t model;
+
+	nthreads = optsp != NULL ? optsp->vo_nthreads : 0;
+	model = optsp != NULL ? optsp->vo_model : VT_AUTO;
+
+	if (nthreads == 0) {
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (ncpus < 1)
+			nthreads = 1;
+		else if (ncpus > VIDEO_MAXTHREADS)
+			nthreads = VIDEO_MAXTHREADS;
+		else
+			nthreads = (int)ncpus;
+	}
+
+	ctx->thread_count = nthreads;
+
+	switch (model) {
+	case VT_FRAME:
+		ctx->thread_type = FF_THREAD_FRAME;
+		break;
+
+	case VT_SLICE:
+		ctx->thread_type = FF_THREAD_SLICE;
+		break;
+
+	default:
+		/* The codec uses frame threading if it can. */
+		ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+		break;
+	}
+}
+
+/*
+ * Parse a readahead buffer size, in bytes, with an optional "k" or "m" suffix.
+ */
+int
+video_parse_bufsize(const char *arg, video_opts_t *optsp)
+{
+	char *q;
+	unsigned long long size;
+
+	size = strtoull(arg, &q, 10);
+	if (*q == 'k' || *q == 'K') {
+		size *= 1024;
+		q++;
+	} else if (*q == 'm' || *q == 'M') {
+		size *= 1024 * 1024;
+		q++;
+	}
+
+	if (q == arg || *q != '\0' || size < VIDEO_IOBUFSZ ||
+	    size > 1024ULL * 1024 * 1024) {
+		warnx("invalid buffer size (expected 256k to 1024m): %s", arg);
+		return (-1);
+	}
+
+	optsp->vo_bufsize = (size_t)size;
+	return (0);
+}
+
+/*
+ * Parse a decoder threading specification of the form "N[:frame|:slice]",
+ * where N is the number of threads (0 means automatic).
+ */
+int
+video_parse_threads(const char *arg, video_opts_t *optsp)
+{
+	char *q;
+	long nthreads;
+	int i;
+
+	nthreads = strtol(arg, &q, 10);
+	if (q == arg || nthreads < 0 || nthreads > 64 ||
+	    (*q != '\0' && *q != ':')) {
+		warnx("invalid thread count: %s", arg);
+		return (-1);
+	}
+
+	optsp->vo_nthreads = (int)nthreads;
+	optsp->vo_model = VT_AUTO;
+
+	if (*q == '\0')
+		return (0);
+
+	for (i = 0; i < sizeof (video_threadmodels) /
+	    sizeof (video_threadmodels[0]); i++) {
+		if (strcmp(q + 1, video_threadmodels[i]) == 0) {
+			optsp->vo_model = i;
+			return (0);
+		}
+	}
+
+	warnx("invalid thread model (expected \"frame\" or \"slice\"): %s",
+	    q + 1);
+	return (-1);
+}
+
 video_t *
-video_open(const char *filename)
+video_open(const char *filename, const video_opts_t *optsp)
 {
 	int i, nbytes;
 	video_t *rv;
@@ -39,17 +539,26 @@ video_open(const char *filename)
 
 	av_register_all();
 
-
-	if (avformat_open_input(&rv->vf_formatctx, filename, NULL, NULL) != 0) {
+	if ((rv->vf_io = vio_open(filename, optsp != NULL &&
+	    optsp->vo_bufsize != 0 ? optsp->vo_bufsize : VIDEO_READAHEAD)) ==
+	    NULL) {
 		free(rv);
 		return (NULL);
 	}
 
+	if ((rv->vf_formatctx = avformat_alloc_context()) == NULL) {
+		warnx("failed to allocate format context");
+		goto out_io;
+	}
+
+	/* On failure, this frees the format context. */
+	rv->vf_formatctx->pb = rv->vf_io->vio_avio;
+	if (avformat_open_input(&rv->vf_formatctx, filename, NULL, NULL) != 0)
+		goto out_io;
+
 	if (av_find_stream_info(rv->vf_formatctx) < 0) {
-		/* XXX */
 		warnx("failed to read stream info");
-		free(rv);
-		return (NULL);
+		goto out_format;
 	}
 
 	tag = av_dict_get(rv->vf_formatctx->metadata, "creation_time",
@@ -66,10 +575,8 @@ video_open(const char *filename)
 	}
 
 	if (i == rv->vf_formatctx->nb_streams) {
-		/* XXX */
 		warnx("no video stream found");
-		free(rv);
-		return (NULL);
+		goto out_format;
 	}
 
 	rv->vf_stream = i;
@@ -77,44 +584,108 @@ video_open(const char *filename)
 
 	rv->vf_codec = avcodec_find_decoder(rv->vf_codecctx->codec_id);
 	if (rv->vf_codec == NULL) {
-		/* XXX */
 		warnx("no decoder found for video codec");
-		free(rv);
-		return (NULL);
+		goto out_format;
 	}
 
+	video_threads(rv->vf_codecctx, optsp);
+
 	if (avcodec_open(rv->vf_codecctx, rv->vf_codec) < 0) {
 		warnx("failed to open video codec");
-		free(rv);
-		return (NULL);
+		goto out_format;
 	}
 
 	rv->vf_framerate = av_q2d(rv->vf_formatctx->streams[i]->time_base);
+	rv->vf_rate = rv->vf_formatctx->streams[i]->r_frame_rate;
+	if (rv->vf_rate.num <= 0 || rv->vf_rate.den <= 0) {
+		rv->vf_rate.num = 30000;
+		rv->vf_rate.den = 1001;
+	}
 	rv->vf_nframes = rv->vf_formatctx->streams[i]->nb_frames;
 
 	rv->vf_frame = avcodec_alloc_frame();
 	rv->vf_framergb = avcodec_alloc_frame();
 	if (rv->vf_frame == NULL || rv->vf_framergb == NULL) {
 		warnx("failed to allocate video frames");
-		/* XXX */
-		free(rv);
-		return (NULL);
+		goto out_codec;
 	}
 
 	nbytes = avpicture_get_size(PIX_FMT_RGB24, rv->vf_codecctx->width,
 	    rv->vf_codecctx->height);
-	rv->vf_buffer = malloc(nbytes);
+	rv->vf_buffer = calloc(1, nbytes);
 
 	if (rv->vf_buffer == NULL) {
 		warnx("failed to allocate video buffer");
-		/* XXX */
-		free(rv);
-		return (NULL);
+		goto out_codec;
 	}
 
 	avpicture_fill((AVPicture *)rv->vf_framergb, rv->vf_buffer,
 	    PIX_FMT_RGB24, rv->vf_codecctx->width, rv->vf_codecctx->height);
 	return (rv);
+
+out_codec:
+	av_free(rv->vf_framergb);
+	av_free(rv->vf_frame);
+	avcodec_close(rv->vf_codecctx);
+out_format:
+	av_close_input_file(rv->vf_formatctx);
+out_io:
+	vio_close(rv->vf_io);
+	free(rv);
+	return (NULL);
+}
+
+/*
+ * Hand frames to the consumer as planar YUV data (see img_planar_t), rather
+ * than converting each one to RGB.  Frames are only converted to RGB if the
+ * consumer needs the pixels (e.g., to write them out).  This is only supported
+ * for the limited-range planar YUV formats.
+ */
+int
+video_planar(video_t *vp)
+{
+	switch (vp->vf_codecctx->pix_fmt) {
+	case PIX_FMT_YUV420P:
+	case PIX_FMT_YUV422P:
+	case PIX_FMT_YUV444P:
+	case PIX_FMT_YUV411P:
+		break;
+
+	default:
+		warnx("video is not in a supported planar format");
+		return (-1);
+	}
+
+	vp->vf_planar = B_TRUE;
+	return (0);
+}
+
+/*
+ * Hand the consumer only the second field of each (interlaced) frame: the odd
+ * rows, as a half-height image (see img_field()).  Converting from planar
+ * formats still converts whole frames.
+ */
+void
+video_field(video_t *vp)
+{
+	vp->vf_field = B_TRUE;
+}
+
+/*
+ * Convert the current (planar) frame to RGB.  See img_materialize().
+ */
+static int
+video_torgb(img_t *image, void *arg)
+{
+	video_t *vp = arg;
+
+	(void) sws_scale(vp->vf_swsctx,
+	    (const uint8_t *const*)vp->vf_frame->data,
+	    vp->vf_frame->linesize, 0, vp->vf_codecctx->height,
+	    vp->vf_framergb->data, vp->vf_framergb->linesize);
+	image->img_pixels = (img_pixel_t *)(vp->vf_framergb->data[0] +
+	    (vp->vf_field ? vp->vf_framergb->linesize[0] : 0));
+	return (0);
 }
 
 double
@@ -135,14 +706,80 @@ video_crtime(video_t *vp)
 	return (vp->vf_crtime);
 }
 
+/*
+ * Convert only rows [miny, maxy) of the decoded frame into the RGB buffer.  The
+ * rest of the RGB buffer is left as-is.  The row range is widened as needed to
+ * line up with the chroma planes.
+ */
+static int
+video_convert_rows(video_t *vp, struct SwsContext **swsctxp,
+    unsigned int miny, unsigned int maxy)
+{
+	int p, hshift, vshift, width, height, y0, y1;
+	const uint8_t *src[4];
+	uint8_t *dst[4];
+
+	width = vp->vf_codecctx->width;
+	height = vp->vf_codecctx->height;
+	avcodec_get_chroma_sub_sample(vp->vf_codecctx->pix_fmt,
+	    &hshift, &vshift);
+
+	y0 = miny & ~((1 << vshift) - 1);
+	y1 = (maxy + (1 << vshift) - 1) & ~((1 << vshift) - 1);
+	if (y1 > height)
+		y1 = height;
+	if (y0 >= y1)
+		return (0);
+
+	*swsctxp = sws_getCachedContext(*swsctxp, width, y1 - y0,
+	    vp->vf_codecctx->pix_fmt, width, y1 - y0, PIX_FMT_RGB24,
+	    SWS_FAST_BILINEAR, NULL, NULL, NULL);
+	if (*swsctxp == NULL) {
+		warnx("failed to initialize conversion context");
+		return (-1);
+	}
+
+	for (p = 0; p < 4; p++) {
+		src[p] = vp->vf_frame->data[p];
+		if (src[p] != NULL)
+			src[p] += (p == 0 ? y0 : y0 >> vshift) *
+			    vp->vf_frame->linesize[p];
+		dst[p] = vp->vf_framergb->data[p];
+		if (dst[p] != NULL)
+			dst[p] += y0 * vp->vf_framergb->linesize[p];
+	}
+
+	(void) sws_scale(*swsctxp, src, vp->vf_frame->linesize, 0, y1 - y0,
+	    dst, vp->vf_framergb->linesize);
+	return (0);
+}
+
+/*
+ * Count a latency of "ns" nanoseconds in a histogram (see video_stats_t).
+ */
+static void
+video_hist_add(uint32_t *hist, hrtime_t ns)
+{
+	hrtime_t us = ns / (NANOSEC / MICROSEC);
+	int i;
+
+	for (i = 0; i < VIDEO_NBUCKETS - 1 && us >= ((hrtime_t)1 << i); i++)
+		continue;
+
+	hist[i]++;
+}
+
 int
 video_iter_frames(video_t *vp, frame_iter_t func, void *arg)
 {
 	AVPacket avp;
 	AVFrame *fp;
-	int width, height, rv, done;
+	int width, height, rv, done, npackets, hshift, vshift, p, n, field;
+	int64_t pts;
+	hrtime_t start, now;
+	boolean_t skipped, eof;
 	video_frame_t frame;
-	struct SwsContext *swsctx;
+	struct SwsContext *swsctx, *fastctx, *rowctx;
 
 	fp = vp->vf_framergb;
 	width = vp->vf_codecctx->width;
@@ -150,27 +787,84 @@ video_iter_frames(video_t *vp, frame_iter_t func, void *arg)
 
 	swsctx = sws_getContext(width, height, vp->vf_codecctx->pix_fmt,
 	    width, height, PIX_FMT_RGB24, SWS_BICUBIC, NULL, NULL, NULL);
+	fastctx = sws_getContext(width, height, vp->vf_codecctx->pix_fmt,
+	    width, height, PIX_FMT_RGB24, SWS_FAST_BILINEAR, NULL, NULL, NULL);
+	rowctx = NULL;
 
-	if (swsctx == NULL) {
+	if (swsctx == NULL || fastctx == NULL) {
 		warnx("failed to initialize conversion context");
+		sws_freeContext(swsctx);
+		sws_freeContext(fastctx);
 		return (-1);
 	}
 
+	/*
+	 * A single field is described by starting one row into the frame and
+	 * doubling the distance between rows.  For chroma planes that are
+	 * already subsampled vertically, each row of the field has its own row
+	 * of chroma, so the field just has one less level of subsampling.
+	 */
+	field = vp->vf_field ? 1 : 0;
+	vshift = 0;
+	vp->vf_swsctx = swsctx;
+	if (vp->vf_planar) {
+		avcodec_get_chroma_sub_sample(vp->vf_codecctx->pix_fmt,
+		    &hshift, &vshift);
+		vp->vf_planarimg.ip_hshift = hshift;
+		vp->vf_planarimg.ip_vshift = vshift > 0 ? vshift - field :
+		    vshift;
+		vp->vf_planarimg.ip_torgb = video_torgb;
+		vp->vf_planarimg.ip_arg = vp;
+	}
+
 	rv = 0;
+	npackets = 0;
+	skipped = B_FALSE;
+	bzero(&frame, sizeof (frame));
 	frame.vf_framenum = 0;
 	frame.vf_frametime = 0;
 	frame.vf_image.img_width = width;
-	frame.vf_image.img_height = height;
+	frame.vf_image.img_height = height >> field;
 	frame.vf_image.img_minx = 0;
 	frame.vf_image.img_maxx = width;
 	frame.vf_image.img_miny = 0;
-	frame.vf_image.img_maxy = height;
+	frame.vf_image.img_maxy = height >> field;
 	frame.vf_image.img_pixels = NULL;
+	frame.vf_image.img_stride = fp->linesize[0] << field;
+	frame.vf_demand = VD_FULL;
+	frame.vf_miny = 0;
+	frame.vf_maxy = height >> field;
 
-	while (av_read_frame(vp->vf_formatctx, &avp) >= 0) {
-		if (avp.stream_index != vp->vf_stream) {
+	eof = B_FALSE;
+	start = gethrtime();
+
+	for (;;) {
+		if (!eof && av_read_frame(vp->vf_formatctx, &avp) < 0)
+			eof = B_TRUE;
+
+		if (eof) {
+			/*
+			 * With frame-level threading, the decoder holds on to
+			 * several frames at once.  At the end of the stream,
+			 * feed it empty packets until it's returned them all.
+			 */
+			av_init_packet(&avp);
+			avp.data = NULL;
+			avp.size = 0;
+		} else if (avp.stream_index != vp->vf_stream) {
 			av_free_packet(&avp);
 			continue;
+		} else {
+			/*
+			 * When demand is reduced, have the decoder drop frames
+			 * that no other frames depend on.
+			 */
+			vp->vf_codecctx->skip_frame =
+			    frame.vf_demand == VD_FULL ?
+			    AVDISCARD_DEFAULT : AVDISCARD_NONREF;
+			if (frame.vf_demand != VD_FULL)
+				skipped = B_TRUE;
+			npackets++;
 		}
 
 		avcodec_decode_video2(vp->vf_codecctx, vp->vf_frame,
@@ -178,14 +872,53 @@ video_iter_frames(video_t *vp, frame_iter_t func, void *arg)
 
 		if (!done) {
 			av_free_packet(&avp);
+			if (eof)
+				break;
 			continue;
 		}
 
-		(void) sws_scale(swsctx,
-		    (const uint8_t *const*)vp->vf_frame->data,
-		    vp->vf_frame->linesize, 0, height,
-		    vp->vf_framergb->data,
-		    vp->vf_framergb->linesize);
+		now = gethrtime();
+		vp->vf_tdecode += now - start;
+		vp->vf_ndecoded++;
+		video_hist_add(vp->vf_hist[VS_DECODE], now - start);
+		PROBE2(frame__decoded, vp->vf_ndecoded, now - start);
+		start = now;
+
+		if (vp->vf_planar) {
+			/*
+			 * Planar frames are only converted on demand.
+			 */
+			for (p = 0; p < 3; p++) {
+				n = p == 0 || vshift == 0 ? field : 0;
+				vp->vf_planarimg.ip_data[p] =
+				    vp->vf_frame->data[p] +
+				    n * vp->vf_frame->linesize[p];
+				vp->vf_planarimg.ip_linesize[p] =
+				    vp->vf_frame->linesize[p] << n;
+			}
+		} else if (frame.vf_demand == VD_MINIMAL) {
+			rv = video_convert_rows(vp, &rowctx,
+			    (frame.vf_miny << field) + field,
+			    frame.vf_maxy << field);
+		} else {
+			(void) sws_scale(frame.vf_demand == VD_FULL ?
+			    swsctx : fastctx,
+			    (const uint8_t *const*)vp->vf_frame->data,
+			    vp->vf_frame->linesize, 0, height,
+			    vp->vf_framergb->data,
+			    vp->vf_framergb->linesize);
+		}
+
+		now = gethrtime();
+		vp->vf_tconvert += now - start;
+		video_hist_add(vp->vf_hist[VS_CONVERT], now - start);
+		PROBE2(frame__converted, vp->vf_ndecoded, now - start);
+		start = now;
+
+		if (rv != 0) {
+			av_free_packet(&avp);
+			break;
+		}
 
 		/*
 		 * It turns out that the layout of the data in the video frame
@@ -193,20 +926,126 @@ video_iter_frames(video_t *vp, frame_iter_t func, void *arg)
 		 * so we can just point img_pixels at it.  While a
 		 * pixel-by-pixel copy would keep the abstractions separate, we
 		 * save about 30% of total execution time by skipping the copy.
+		 *
+		 * Each packet holds one frame, so if the decoder discarded any
+		 * frames since the last one it returned, we account for them
+		 * by the number of packets we've fed it since then.  (When
+		 * nothing's been discarded, the difference is just the
+		 * decoder's constant delay, which we ignore.)  While draining
+		 * the decoder at the end of the stream, we feed it no packets
+		 * at all, but each frame it returns is still a new one.
 		 */
-		frame.vf_image.img_pixels = (img_pixel_t *)fp->data[0];
-		frame.vf_framenum++;
-		frame.vf_frametime = vp->vf_framerate * avp.pts * MILLISEC;
+		if (vp->vf_planar) {
+			frame.vf_image.img_pixels = NULL;
+			frame.vf_image.img_planar = &vp->vf_planarimg;
+		} else {
+			frame.vf_image.img_pixels = (img_pixel_t *)
+			    (fp->data[0] + field * fp->linesize[0]);
+		}
+
+		if (skipped && frame.vf_framenum > 0)
+			frame.vf_framenum += MAX(npackets, 1);
+		else
+			frame.vf_framenum++;
+		npackets = 0;
+		skipped = B_FALSE;
+
+		/*
+		 * The decoder may return frames some packets after the one
+		 * that carried them (always, with frame-level threading), so
+		 * use the timestamp of the packet that the frame came from.
+		 */
+		pts = vp->vf_frame->pkt_pts != AV_NOPTS_VALUE ?
+		    vp->vf_frame->pkt_pts : avp.pts;
+		frame.vf_frametime = vp->vf_framerate * pts * MILLISEC;
+		vp->vf_framenum = frame.vf_framenum;
+		vp->vf_frametime = frame.vf_frametime;
 		rv = func(&frame, arg);
 		av_free_packet(&avp);
 
+		now = gethrtime();
+		vp->vf_tconsume += now - start;
+		video_hist_add(vp->vf_hist[VS_CONSUME], now - start);
+		start = now;
+
 		if (rv != 0)
 			break;
 	}
 
+	vp->vf_swsctx = NULL;
+	sws_freeContext(swsctx);
+	sws_freeContext(fastctx);
+	sws_freeContext(rowctx);
 	return (rv);
 }
 
+/*
+ * Print a summary of where video_iter_frames() spent its time.  "Consumer" time
+ * is time spent in the caller's frame function (e.g., identifying frames).
+ */
+void
+video_report(video_t *vp, FILE *out)
+{
+	int n = vp->vf_ndecoded > 0 ? vp->vf_ndecoded : 1;
+	const char *model;
+
+	switch (vp->vf_codecctx->active_thread_type) {
+	case FF_THREAD_FRAME:
+		model = "frame";
+		break;
+	case FF_THREAD_SLICE:
+		model = "slice";
+		break;
+	default:
+		model = "none";
+		break;
+	}
+
+	(void) fprintf(out, "video: %d frames decoded, %d threads "
+	    "(threading: %s)\n", vp->vf_ndecoded,
+	    vp->vf_codecctx->thread_count, model);
+	(void) fprintf(out, "    %-10s %10.3f s  %8.3f ms/frame\n", "decode",
+	    (double)vp->vf_tdecode / NANOSEC,
+	    (double)vp->vf_tdecode / n / MICROSEC);
+	(void) fprintf(out, "    %-10s %10.3f s  %8.3f ms/frame\n", "convert",
+	    (double)vp->vf_tconvert / NANOSEC,
+	    (double)vp->vf_tconvert / n / MICROSEC);
+	(void) fprintf(out, "    %-10s %10.3f s  %8.3f ms/frame\n", "consumer",
+	    (double)vp->vf_tconsume / NANOSEC,
+	    (double)vp->vf_tconsume / n / MICROSEC);
+}
+
+/*
+ * Return a snapshot of the video's counters.  This may be called from the frame
+ * callback, so a consumer can report progress while the video is processed.
+ */
+void
+video_stats(video_t *vp, video_stats_t *vsp)
+{
+	video_io_t *viop = vp->vf_io;
+
+	bzero(vsp, sizeof (*vsp));
+	vsp->vs_ndecoded = vp->vf_ndecoded;
+	vsp->vs_nframes = vp->vf_nframes;
+	vsp->vs_framenum = vp->vf_framenum;
+	vsp->vs_frametime = vp->vf_frametime;
+	vsp->vs_time[VS_DECODE] = vp->vf_tdecode;
+	vsp->vs_time[VS_CONVERT] = vp->vf_tconvert;
+	vsp->vs_time[VS_CONSUME] = vp->vf_tconsume;
+	bcopy(vp->vf_hist, vsp->vs_hist, sizeof (vsp->vs_hist));
+
+	/*
+	 * Only the decoding thread (i.e., our caller) moves the consumer's
+	 * position, so we don't need the lock to read it.
+	 */
+	if (viop->vio_map != NULL) {
+		vsp->vs_offset = viop->vio_pos;
+		vsp->vs_size = viop->vio_size;
+	} else {
+		vsp->vs_offset = viop->vio_tail;
+	}
+}
+
 void
 video_free(video_t *vp)
 {
@@ -215,4 +1054,577 @@ video_free(video_t *vp)
 	av_free(vp->vf_frame);
 	avcodec_close(vp->vf_codecctx);
 	av_close_input_file(vp->vf_formatctx);
+	vio_close(vp->vf_io);
+}
+
+/*
+ * Race clips.  A clipper encodes selected stretches of the video (e.g., races)
+ * into separate WebM files while the video is being decoded for some other
+ * purpose, so the video only needs to be decoded once.  The consumer passes
+ * each frame to video_clipper_frame(), and calls video_clipper_start() and
+ * video_clipper_end() as clips begin and end.
+ *
+ * A clip begins "leadms" before the time passed to video_clipper_start(), so
+ * we keep a ring of the most recent frames (converted to YUV 4:2:0, which is
+ * what the encoder wants).  Clips continue "tailms" past the time passed to
+ * video_clipper_end().  Each clip is encoded by its own thread.  Frames are
+ * reference-counted so that a frame can be in the ring and any number of clip
+ * queues without being copied.  If a clip's queue is full, the consumer waits
+ * for the encoder to catch up.
+ *
+ * Clips are numbered from 0 in the order they're started.  A clip that's
+ * started but never ended (i.e., because another one starts first, or the
+ * video ends) is discarded and its number reused.  Clips are written under a
+ * temporary name and only renamed to "N.webm" once they're complete.
+ */
+#define	VIDEO_CLIPSLACK		2000	/* extra ring time for late starts */
+#define	VIDEO_CLIPQEXTRA	64	/* clip queue slots beyond ring size */
+#define	VIDEO_CLIPBITRATE	1000000	/* clip bits per second */
+#define	VIDEO_CLIPGOP		120	/* clip frames between key frames */
+
+typedef struct video_cframe {
+	struct video_cframe	*vcf_next;	/* free list linkage */
+	int			vcf_refs;	/* ring and clip queue refs */
+	double			vcf_time;	/* frame time (msec) */
+	AVPicture		vcf_pic;	/* YUV 4:2:0 frame data */
+} video_cframe_t;
+
+typedef struct video_clip {
+	struct video_clip	*vc_next;
+	video_clipper_t		*vc_clipper;
+	char			vc_filename[PATH_MAX];	/* final name */
+	char			vc_tmpname[PATH_MAX];	/* while writing */
+	double			vc_end;		/* last frame time, or -1 */
+	boolean_t		vc_closing;	/* no more frames coming */
+	boolean_t		vc_abort;	/* discard this clip */
+	boolean_t		vc_finished;	/* thread is done */
+	boolean_t		vc_failed;	/* encoding failed */
+	video_cframe_t		**vc_queue;	/* frames to encode */
+	int			vc_qhead;
+	int			vc_qcount;
+	pthread_t		vc_thread;
+
+	/* encoder state (owned by vc_thread while it's running) */
+	AVFormatContext		*vc_formatctx;
+	AVStream		*vc_stream;
+	AVFrame			*vc_frame;
+	uint8_t			*vc_outbuf;
+	int			vc_outbufsz;
+	int			vc_nframes;
+} video_clip_t;
+
+struct video_clipper {
+	video_t			*vcl_video;
+	char			vcl_dir[PATH_MAX];
+	int			vcl_leadms;
+	int			vcl_tailms;
+	int			vcl_width;
+	int			vcl_height;
+	struct SwsContext	*vcl_swsctx;	/* if input isn't YUV 4:2:0 */
+	pthread_mutex_t		vcl_lock;	/* protects everything below */
+	pthread_cond_t		vcl_cv;		/* any clip state change */
+	video_cframe_t		**vcl_ring;	/* most recent frames */
+	int			vcl_ringcap;
+	int			vcl_ringhead;
+	int			vcl_ringcount;
+	int			vcl_qcap;	/* clip queue capacity */
+	video_cframe_t		*vcl_free;	/* unused frames */
+	video_clip_t		*vcl_clips;	/* all clips not yet reaped */
+	int			vcl_nclips;	/* clip numbers assigned */
+	int			vcl_nstarted;	/* clips started */
+};
+
+static void
+video_cframe_rele(video_clipper_t *vclp, video_cframe_t *vcfp)
+{
+	assert(vcfp->vcf_refs > 0);
+	if (--vcfp->vcf_refs == 0) {
+		vcfp->vcf_next = vclp->vcl_free;
+		vclp->vcl_free = vcfp;
+	}
+}
+
+video_clipper_t *
+video_clipper_init(video_t *vp, const char *dir, int leadms, int tailms)
+{
+	video_clipper_t *vclp;
+	AVCodecContext *ctx = vp->vf_codecctx;
+	double fps = av_q2d(vp->vf_rate);
+
+	if ((vclp = calloc(1, sizeof (*vclp))) == NULL) {
+		warn("calloc");
+		return (NULL);
+	}
+
+	vclp->vcl_video = vp;
+	(void) strncpy(vclp->vcl_dir, dir, sizeof (vclp->vcl_dir) - 1);
+	vclp->vcl_leadms = leadms;
+	vclp->vcl_tailms = tailms;
+	vclp->vcl_width = ctx->width;
+	vclp->vcl_height = ctx->height;
+	vclp->vcl_ringcap = (leadms + VIDEO_CLIPSLACK) * fps / MILLISEC + 1;
+	vclp->vcl_qcap = vclp->vcl_ringcap + VIDEO_CLIPQEXTRA;
+	(void) pthread_mutex_init(&vclp->vcl_lock, NULL);
+	(void) pthread_cond_init(&vclp->vcl_cv, NULL);
+
+	if ((vclp->vcl_ring = calloc(vclp->vcl_ringcap,
+	    sizeof (vclp->vcl_ring[0]))) == NULL) {
+		warn("calloc");
+		video_clipper_fini(vclp);
+		return (NULL);
+	}
+
+	if (ctx->pix_fmt != PIX_FMT_YUV420P &&
+	    (vclp->vcl_swsctx = sws_getContext(ctx->width, ctx->height,
+	    ctx->pix_fmt, ctx->width, ctx->height, PIX_FMT_YUV420P,
+	    SWS_BICUBIC, NULL, NULL, NULL)) == NULL) {
+		warnx("failed to initialize clip conversion context");
+		video_clipper_fini(vclp);
+		return (NULL);
+	}
+
+	return (vclp);
+}
+
+/*
+ * Encode one frame (or with vcfp == NULL, flush the encoder) and write out
+ * whatever the encoder produces.  Returns the number of bytes encoded, or -1 on
+ * error.
+ */
+static int
+video_clip_encode(video_clip_t *vcp, video_cframe_t *vcfp)
+{
+	AVCodecContext *ctx = vcp->vc_stream->codec;
+	AVPacket pkt;
+	int i, size;
+
+	if (vcfp != NULL) {
+		for (i = 0; i < 4; i++) {
+			vcp->vc_frame->data[i] = vcfp->vcf_pic.data[i];
+			vcp->vc_frame->linesize[i] = vcfp->vcf_pic.linesize[i];
+		}
+		vcp->vc_frame->pts = vcp->vc_nframes++;
+	}
+
+	size = avcodec_encode_video(ctx, vcp->vc_outbuf, vcp->vc_outbufsz,
+	    vcfp != NULL ? vcp->vc_frame : NULL);
+	if (size <= 0)
+		return (size);
+
+	av_init_packet(&pkt);
+	if (ctx->coded_frame->pts != AV_NOPTS_VALUE)
+		pkt.pts = av_rescale_q(ctx->coded_frame->pts, ctx->time_base,
+		    vcp->vc_stream->time_base);
+	if (ctx->coded_frame->key_frame)
+		pkt.flags |= AV_PKT_FLAG_KEY;
+	pkt.stream_index = vcp->vc_stream->index;
+	pkt.data = vcp->vc_outbuf;
+	pkt.size = size;
+
+	if (av_interleaved_write_frame(vcp->vc_formatctx, &pkt) != 0) {
+		warnx("%s: failed to write frame", vcp->vc_tmpname);
+		return (-1);
+	}
+
+	return (size);
+}
+
+static void *
+video_clip_thread(void *arg)
+{
+	video_clip_t *vcp = arg;
+	video_clipper_t *vclp = vcp->vc_clipper;
+	video_cframe_t *vcfp;
+
+	(void) pthread_mutex_lock(&vclp->vcl_lock);
+	for (;;) {
+		while (vcp->vc_qcount == 0 && !vcp->vc_closing)
+			(void) pthread_cond_wait(&vclp->vcl_cv,
+			    &vclp->vcl_lock);
+
+		if (vcp->vc_qcount == 0)
+			break;
+
+		vcfp = vcp->vc_queue[vcp->vc_qhead];
+		vcp->vc_qhead = (vcp->vc_qhead + 1) % vclp->vcl_qcap;
+		vcp->vc_qcount--;
+
+		if (!vcp->vc_abort && !vcp->vc_failed) {
+			(void) pthread_mutex_unlock(&vclp->vcl_lock);
+			if (video_clip_encode(vcp, vcfp) < 0)
+				vcp->vc_failed = B_TRUE;
+			(void) pthread_mutex_lock(&vclp->vcl_lock);
+		}
+
+		video_cframe_rele(vclp, vcfp);
+		(void) pthread_cond_broadcast(&vclp->vcl_cv);
+	}
+
+	if (!vcp->vc_abort && !vcp->vc_failed) {
+		(void) pthread_mutex_unlock(&vclp->vcl_lock);
+		while (video_clip_encode(vcp, NULL) > 0)
+			continue;
+		(void) av_write_trailer(vcp->vc_formatctx);
+		(void) pthread_mutex_lock(&vclp->vcl_lock);
+	}
+
+	vcp->vc_finished = B_TRUE;
+	(void) pthread_cond_broadcast(&vclp->vcl_cv);
+	(void) pthread_mutex_unlock(&vclp->vcl_lock);
+	return (NULL);
+}
+
+/*
+ * Tear down a clip whose thread has finished (or never started).  The codec is
+ * opened and closed here rather than by the clip's thread because libavcodec
+ * doesn't allow that to happen concurrently with other codec operations.
+ */
+static void
+video_clip_free(video_clip_t *vcp)
+{
+	if (vcp->vc_stream != NULL)
+		(void) avcodec_close(vcp->vc_stream->codec);
+
+	if (vcp->vc_formatctx != NULL) {
+		if (vcp->vc_formatctx->pb != NULL)
+			(void) avio_close(vcp->vc_formatctx->pb);
+		avformat_free_context(vcp->vc_formatctx);
+	}
+
+	if (vcp->vc_abort || vcp->vc_failed)
+		(void) unlink(vcp->vc_tmpname);
+	else if (rename(vcp->vc_tmpname, vcp->vc_filename) != 0)
+		warn("rename %s", vcp->vc_tmpname);
+
+	if (kv_debug > 0)
+		(void) fprintf(stderr, "clip %s: %d frames%s\n",
+		    vcp->vc_filename, vcp->vc_nframes,
+		    vcp->vc_abort ? " (discarded)" :
+		    vcp->vc_failed ? " (failed)" : "");
+
+	av_free(vcp->vc_frame);
+	free(vcp->vc_outbuf);
+	free(vcp->vc_queue);
+	free(vcp);
+}
+
+/*
+ * Set up the output file and encoder for a new clip.
+ */
+static int
+video_clip_open(video_clipper_t *vclp, video_clip_t *vcp)
+{
+	AVOutputFormat *fmt;
+	AVCodecContext *ctx;
+	AVCodec *codec;
+
+	if ((fmt = av_guess_format("webm", NULL, NULL)) == NULL ||
+	    (codec = avcodec_find_encoder(CODEC_ID_VP8)) == NULL) {
+		warnx("no support for writing WebM files");
+		return (-1);
+	}
+
+	if ((vcp->vc_formatctx = avformat_alloc_context()) == NULL ||
+	    (vcp->vc_frame = avcodec_alloc_frame()) == NULL) {
+		warnx("failed to allocate encoder state");
+		return (-1);
+	}
+
+	vcp->vc_formatctx->oformat = fmt;
+	if (snprintf(vcp->vc_formatctx->filename,
+	    sizeof (vcp->vc_formatctx->filename), "%s", vcp->vc_tmpname) >=
+	    sizeof (vcp->vc_formatctx->filename)) {
+		warnx("clip name too long: %s", vcp->vc_tmpname);
+		return (-1);
+	}
+
+	if ((vcp->vc_stream = av_new_stream(vcp->vc_formatctx, 0)) == NULL) {
+		warnx("failed to allocate clip stream");
+		return (-1);
+	}
+
+	ctx = vcp->vc_stream->codec;
+	ctx->codec_id = CODEC_ID_VP8;
+	ctx->codec_type = AVMEDIA_TYPE_VIDEO;
+	ctx->width = vclp->vcl_width;
+	ctx->height = vclp->vcl_height;
+	ctx->pix_fmt = PIX_FMT_YUV420P;
+	ctx->time_base.num = vclp->vcl_video->vf_rate.den;
+	ctx->time_base.den = vclp->vcl_video->vf_rate.num;
+	ctx->bit_rate = VIDEO_CLIPBITRATE;
+	ctx->gop_size = VIDEO_CLIPGOP;
+	if ((fmt->flags & AVFMT_GLOBALHEADER) != 0)
+		ctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
+
+	if (avcodec_open(ctx, codec) < 0) {
+		warnx("failed to open VP8 encoder");
+		vcp->vc_stream = NULL;
+		return (-1);
+	}
+
+	if (avio_open(&vcp->vc_formatctx->pb, vcp->vc_tmpname,
+	    AVIO_FLAG_WRITE) < 0) {
+		warnx("failed to open %s", vcp->vc_tmpname);
+		return (-1);
+	}
+
+	if (avformat_write_header(vcp->vc_formatctx, NULL) != 0) {
+		warnx("%s: failed to write header", vcp->vc_tmpname);
+		return (-1);
+	}
+
+	vcp->vc_outbufsz = vclp->vcl_width * vclp->vcl_height * 3 + 10000;
+	if ((vcp->vc_outbuf = malloc(vcp->vc_outbufsz)) == NULL) {
+		warn("malloc");
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Add a frame to a clip's queue, waiting for room if necessary.  Called with
+ * vcl_lock held.
+ */
+static void
+video_clip_enqueue(video_clipper_t *vclp, video_clip_t *vcp,
+    video_cframe_t *vcfp)
+{
+	while (vcp->vc_qcount == vclp->vcl_qcap)
+		(void) pthread_cond_wait(&vclp->vcl_cv, &vclp->vcl_lock);
+
+	vcfp->vcf_refs++;
+	vcp->vc_queue[(vcp->vc_qhead + vcp->vc_qcount) % vclp->vcl_qcap] =
+	    vcfp;
+	vcp->vc_qcount++;
+	(void) pthread_cond_broadcast(&vclp->vcl_cv);
+}
+
+/*
+ * Stop feeding frames to a clip.  If "abort" is set, the clip is discarded.
+ * Called with vcl_lock held.
+ */
+static void
+video_clip_close(video_clipper_t *vclp, video_clip_t *vcp, boolean_t abort)
+{
+	if (vcp->vc_closing)
+		return;
+
+	vcp->vc_closing = B_TRUE;
+	if (abort) {
+		vcp->vc_abort = B_TRUE;
+		vclp->vcl_nclips--;
+	}
+	(void) pthread_cond_broadcast(&vclp->vcl_cv);
+}
+
+/*
+ * Join and free clips whose threads have finished.  Called with vcl_lock held.
+ */
+static void
+video_clipper_reap(video_clipper_t *vclp)
+{
+	video_clip_t **vcpp, *vcp;
+
+	for (vcpp = &vclp->vcl_clips; (vcp = *vcpp) != NULL; ) {
+		if (!vcp->vc_finished) {
+			vcpp = &vcp->vc_next;
+			continue;
+		}
+
+		*vcpp = vcp->vc_next;
+		(void) pthread_join(vcp->vc_thread, NULL);
+		video_clip_free(vcp);
+	}
+}
+
+int
+video_clipper_frame(video_clipper_t *vclp, video_frame_t *vfp)
+{
+	video_t *vp = vclp->vcl_video;
+	video_cframe_t *vcfp;
+	video_clip_t *vcp;
+	int slot;
+
+	(void) pthread_mutex_lock(&vclp->vcl_lock);
+	video_clipper_reap(vclp);
+	if ((vcfp = vclp->vcl_free) != NULL)
+		vclp->vcl_free = vcfp->vcf_next;
+	(void) pthread_mutex_unlock(&vclp->vcl_lock);
+
+	if (vcfp == NULL) {
+		if ((vcfp = calloc(1, sizeof (*vcfp))) == NULL ||
+		    avpicture_alloc(&vcfp->vcf_pic, PIX_FMT_YUV420P,
+		    vclp->vcl_width, vclp->vcl_height) != 0) {
+			warnx("failed to allocate clip frame");
+			free(vcfp);
+			return (-1);
+		}
+	}
+
+	if (vclp->vcl_swsctx != NULL)
+		(void) sws_scale(vclp->vcl_swsctx,
+		    (const uint8_t *const*)vp->vf_frame->data,
+		    vp->vf_frame->linesize, 0, vclp->vcl_height,
+		    vcfp->vcf_pic.data, vcfp->vcf_pic.linesize);
+	else
+		av_picture_copy(&vcfp->vcf_pic, (AVPicture *)vp->vf_frame,
+		    PIX_FMT_YUV420P, vclp->vcl_width, vclp->vcl_height);
+
+	vcfp->vcf_time = vfp->vf_frametime;
+	vcfp->vcf_refs = 1;
+
+	(void) pthread_mutex_lock(&vclp->vcl_lock);
+	if (vclp->vcl_ringcount == vclp->vcl_ringcap) {
+		video_cframe_rele(vclp, vclp->vcl_ring[vclp->vcl_ringhead]);
+		vclp->vcl_ringhead = (vclp->vcl_ringhead + 1) %
+		    vclp->vcl_ringcap;
+		vclp->vcl_ringcount--;
+	}
+
+	slot = (vclp->vcl_ringhead + vclp->vcl_ringcount) % vclp->vcl_ringcap;
+	vclp->vcl_ring[slot] = vcfp;
+	vclp->vcl_ringcount++;
+
+	for (vcp = vclp->vcl_clips; vcp != NULL; vcp = vcp->vc_next) {
+		if (vcp->vc_closing)
+			continue;
+
+		if (vcp->vc_end >= 0 && vcfp->vcf_time > vcp->vc_end)
+			video_clip_close(vclp, vcp, B_FALSE);
+		else
+			video_clip_enqueue(vclp, vcp, vcfp);
+	}
+	(void) pthread_mutex_unlock(&vclp->vcl_lock);
+
+	return (0);
+}
+
+int
+video_clipper_start(video_clipper_t *vclp, int timems)
+{
+	video_clip_t *vcp, *ovcp;
+	video_cframe_t *vcfp;
+	int i, rv;
+
+	if ((vcp = calloc(1, sizeof (*vcp))) == NULL ||
+	    (vcp->vc_queue = calloc(vclp->vcl_qcap,
+	    sizeof (vcp->vc_queue[0]))) == NULL) {
+		warn("calloc");
+		free(vcp);
+		return (-1);
+	}
+
+	(void) pthread_mutex_lock(&vclp->vcl_lock);
+
+	/* A clip that never ended doesn't correspond to a finished race. */
+	for (ovcp = vclp->vcl_clips; ovcp != NULL; ovcp = ovcp->vc_next) {
+		if (ovcp->vc_end < 0)
+			video_clip_close(vclp, ovcp, B_TRUE);
+	}
+
+	vcp->vc_clipper = vclp;
+	vcp->vc_end = -1;
+	if (snprintf(vcp->vc_filename, sizeof (vcp->vc_filename),
+	    "%s/%d.webm", vclp->vcl_dir, vclp->vcl_nclips) >=
+	    sizeof (vcp->vc_filename) ||
+	    snprintf(vcp->vc_tmpname, sizeof (vcp->vc_tmpname),
+	    "%s/.clip%d.webm", vclp->vcl_dir, vclp->vcl_nstarted++) >=
+	    sizeof (vcp->vc_tmpname)) {
+		(void) pthread_mutex_unlock(&vclp->vcl_lock);
+		warnx("clip directory name too long: %s", vclp->vcl_dir);
+		free(vcp->vc_queue);
+		free(vcp);
+		return (-1);
+	}
+	(void) pthread_mutex_unlock(&vclp->vcl_lock);
+
+	if (video_clip_open(vclp, vcp) != 0) {
+		vcp->vc_failed = B_TRUE;
+		video_clip_free(vcp);
+		return (-1);
+	}
+
+	(void) pthread_mutex_lock(&vclp->vcl_lock);
+	for (i = 0; i < vclp->vcl_ringcount; i++) {
+		vcfp = vclp->vcl_ring[(vclp->vcl_ringhead + i) %
+		    vclp->vcl_ringcap];
+		if (vcfp->vcf_time >= timems - vclp->vcl_leadms)
+			video_clip_enqueue(vclp, vcp, vcfp);
+	}
+
+	if ((rv = pthread_create(&vcp->vc_thread, NULL, video_clip_thread,
+	    vcp)) != 0) {
+		warnx("pthread_create: %s", strerror(rv));
+		while (vcp->vc_qcount > 0) {
+			video_cframe_rele(vclp, vcp->vc_queue[vcp->vc_qhead]);
+			vcp->vc_qhead = (vcp->vc_qhead + 1) % vclp->vcl_qcap;
+			vcp->vc_qcount--;
+		}
+		(void) pthread_mutex_unlock(&vclp->vcl_lock);
+		vcp->vc_failed = B_TRUE;
+		video_clip_free(vcp);
+		return (-1);
+	}
+
+	vclp->vcl_nclips++;
+	vcp->vc_next = vclp->vcl_clips;
+	vclp->vcl_clips = vcp;
+	(void) pthread_mutex_unlock(&vclp->vcl_lock);
+	return (0);
+}
+
+void
+video_clipper_end(video_clipper_t *vclp, int timems)
+{
+	video_clip_t *vcp;
+
+	(void) pthread_mutex_lock(&vclp->vcl_lock);
+	for (vcp = vclp->vcl_clips; vcp != NULL; vcp = vcp->vc_next) {
+		if (!vcp->vc_closing && vcp->vc_end < 0)
+			vcp->vc_end = timems + vclp->vcl_tailms;
+	}
+	(void) pthread_mutex_unlock(&vclp->vcl_lock);
+}
+
+/*
+ * Finish any clips in progress and free the clipper.  Clips that were started
+ * but never ended are discarded.
+ */
+void
+video_clipper_fini(video_clipper_t *vclp)
+{
+	video_clip_t *vcp;
+	video_cframe_t *vcfp;
+
+	(void) pthread_mutex_lock(&vclp->vcl_lock);
+	for (vcp = vclp->vcl_clips; vcp != NULL; vcp = vcp->vc_next)
+		video_clip_close(vclp, vcp, vcp->vc_end < 0);
+
+	while (vclp->vcl_clips != NULL) {
+		video_clipper_reap(vclp);
+		if (vclp->vcl_clips != NULL)
+			(void) pthread_cond_wait(&vclp->vcl_cv,
+			    &vclp->vcl_lock);
+	}
+
+	while (vclp->vcl_ringcount > 0) {
+		video_cframe_rele(vclp, vclp->vcl_ring[vclp->vcl_ringhead]);
+		vclp->vcl_ringhead = (vclp->vcl_ringhead + 1) %
+		    vclp->vcl_ringcap;
+		vclp->vcl_ringcount--;
+	}
+	(void) pthread_mutex_unlock(&vclp->vcl_lock);
+
+	while ((vcfp = vclp->vcl_free) != NULL) {
+		vclp->vcl_free = vcfp->vcf_next;
+		avpicture_free(&vcfp->vcf_pic);
+		free(vcfp);
+	}
+
+	sws_freeContext(vclp->vcl_swsctx);
+	(void) pthread_mutex_destroy(&vclp->vcl_lock);
+	(void) pthread_cond_destroy(&vclp->vcl_cv);
+	free(vclp->vcl_ring);
+	free(vclp);
 }
@@ -15,19 +15,97 @@
 struct video;
 typedef struct video video_t;
 
+/*
+ * Consumers that don't need every frame at full fidelity can say so by setting
+ * vf_demand (and for VD_MINIMAL, vf_miny and vf_maxy) from the frame callback.
+ * The new level takes effect with the next frame.  Frames may be skipped under
+ * reduced demand, in which case vf_framenum skips ahead accordingly.
+ */
+typedef enum {
+	VD_FULL,	/* decode and convert every frame at full quality */
+	VD_REDUCED,	/* skip non-reference frames and use a fast scaler */
+	VD_MINIMAL,	/* same, and convert only rows [vf_miny, vf_maxy) */
+} video_demand_t;
+
 typedef struct {
-	int 	vf_framenum;
-	double	vf_frametime;
-	img_t 	vf_image;
+	int 		vf_framenum;
+	double		vf_frametime;
+	img_t 		vf_image;
+	video_demand_t	vf_demand;
+	unsigned int	vf_miny;
+	unsigned int	vf_maxy;
 } video_frame_t;
 
 typedef int (*frame_iter_t)(video_frame_t *, void *);
 
-video_t *video_open(const char *);
+/*
+ * Options for video_open().  vo_nthreads is the number of decoder threads (0
+ * means one per CPU, up to a limit).  With VT_AUTO, the codec uses frame-level
+ * threading where it can and slice-level threading otherwise.  vo_bufsize is
+ * how far ahead of the decoder to read the input (0 for the default).
+ */
+typedef enum {
+	VT_AUTO,
+	VT_FRAME,
+	VT_SLICE,
+} video_threadmodel_t;
+
+typedef struct {
+	int			vo_nthreads;
+	video_threadmodel_t	vo_model;
+	size_t			vo_bufsize;
+} video_opts_t;
+
+/*
+ * Progress and performance counters for a video being processed by
+ * video_iter_frames(), as returned by video_stats().  Each stage of handling a
+ * frame has a latency histogram with power-of-two buckets: bucket i counts
+ * latencies of at least 2^(i-1) and less than 2^i microseconds, except that
+ * the last bucket also counts everything longer.
+ */
+typedef enum {
+	VS_DECODE,	/* reading and decoding */
+	VS_CONVERT,	/* conversion to RGB */
+	VS_CONSUME,	/* the frame callback (e.g., identification) */
+	VS_NSTAGES
+} video_stage_t;
+
+#define	VIDEO_NBUCKETS	24
+
+typedef struct {
+	int		vs_ndecoded;	/* frames decoded */
+	int		vs_nframes;	/* estimated frames in the video */
+	int		vs_framenum;	/* last frame handed to the callback */
+	double		vs_frametime;	/* its time (milliseconds) */
+	uint64_t	vs_offset;	/* input bytes consumed */
+	uint64_t	vs_size;	/* input size (0 if unknown) */
+	hrtime_t	vs_time[VS_NSTAGES];	/* total time in each stage */
+	uint32_t	vs_hist[VS_NSTAGES][VIDEO_NBUCKETS];
+} video_stats_t;
+
+int video_parse_threads(const char *, video_opts_t *);
+int video_parse_bufsize(const char *, video_opts_t *);
+video_t *video_open(const char *, const video_opts_t *);
+int video_planar(video_t *);
+void video_field(video_t *);
 int video_iter_frames(video_t *, frame_iter_t, void *);
 double video_framerate(video_t *);
 int video_nframes(video_t *);
 const char *video_crtime(video_t *);
+void video_report(video_t *, FILE *);
+void video_stats(video_t *, video_stats_t *);
+
+/*
+ * Encode clips of the video as it's being decoded.  See video.c.
+ */
+struct video_clipper;
+typedef struct video_clipper video_clipper_t;
+
+video_clipper_t *video_clipper_init(video_t *, const char *, int, int);
+int video_clipper_frame(video_clipper_t *, video_frame_t *);
+int video_clipper_start(video_clipper_t *, int);
+void video_clipper_end(video_clipper_t *, int);
+void video_clipper_fini(video_clipper_t *);
 void video_free(video_t *);
 
 #endif